@@ -32,6 +32,11 @@ typedef int32_t SLBA_t, *SLBA_p;
 #define SDMMC_DATATIMEOUT 5000000
 #endif
 
+// The most sectors to transfer with one call to `fn_read_sector` or `fn_write_sector`
+#ifndef PHAT_MAX_TRANSFER_SECTORS
+#define PHAT_MAX_TRANSFER_SECTORS 256
+#endif
+
 #ifndef PHAT_NO_DMA
 #define PHAT_USE_DMA 1
 #endif
@@ -169,15 +169,34 @@ typedef struct Phat_LFN_Entry_s
 #define CI_EXTENSION_IS_LOWER 0x08
 #define CI_BASENAME_IS_LOWER 0x10
 
-static const uint8_t empty_sector[512] = { 0 };
+static const uint8_t empty_sectors[PHAT_ZERO_SECTORS * 512] = { 0 };
 
 static const Phat_GUID_t GUID_EFI_system_partition_type =  { 0xC12A7328, 0xF81F, 0x11D2, "\xBA\x4B\x00\xA0\xC9\x3E\xC9\x3B" };
 static const Phat_GUID_t GUID_MS_reserved_partition_type = { 0xE3C9E316, 0x0B5C, 0x4DB8, "\x81\x7D\xF9\x2D\xF0\x02\x15\xAE" };
 static const Phat_GUID_t GUID_basic_data_partition_type =  { 0xEBD0A0A2, 0xB9E5, 0x4433, "\x87\xC0\x68\xB6\xB7\x26\x99\xC7" };
 static const Phat_GUID_t GUID_empty = {0};
 
+// FAT entry accessors for one FAT type, installed by `Phat_InstallFATCodec()` at mount time
+struct Phat_FATCodec_s
+{
+	uint8_t entry_size;
+	Cluster_t end_of_cluster_chain;
+	// The "volume is clean" bit of FAT entry 1, FAT12 doesn't have one
+	Cluster_t clean_bit;
+	// Byte offset of the entry of `cluster` from the start of a FAT
+	LBA_t (*entry_offset)(Cluster_t cluster);
+	// Read the entry from the first FAT
+	PhatState (*read)(Phat_p phat, Cluster_t cluster, Cluster_t *read_out);
+	// Write the entry to the FAT that starts at `FAT_LBA`
+	PhatState (*write)(Phat_p phat, LBA_t FAT_LBA, Cluster_t cluster, Cluster_t write, PhatBool_t flush);
+};
+
 PHAT_STATIC_FUNC PhatState Phat_ReadFAT(Phat_p phat, Cluster_t cluster, Cluster_t *read_out);
 PHAT_STATIC_FUNC PhatState Phat_WriteFAT(Phat_p phat, Cluster_t cluster, Cluster_t write, PhatBool_t flush);
+PHAT_STATIC_FUNC PhatState Phat_InstallFATCodec(Phat_p phat);
+PHAT_STATIC_FUNC PhatBool_t Phat_IsResidentFATModified(Phat_p phat);
+PHAT_STATIC_FUNC PhatState Phat_FlushWriteBehind(Phat_FileInfo_p file_info);
+PHAT_STATIC_FUNC PhatState Phat_SeekFileTail(Phat_FileInfo_p file_info);
 
 static const WChar_t Cp437_UpperPart[] =
 {
@@ -315,6 +334,9 @@ PHAT_FUNC const char *Phat_StateToString(PhatState s)
 		"The partition index is out of bound",
 		"64-bit LBA is needed for the disk",
 		"Modified data in the cache need​ a write-back.",
+		"The FAT type is not supported by this build",
+		"Too many open files",
+		"File is open by another handle",
 	};
 	if (s >= PhatState_LastState) return "InvalidStateNumber";
 	else return strlist[s];
@@ -653,9 +675,9 @@ PHAT_STATIC_FUNC PhatState Phat_ReadSectorsWithoutCache(Phat_p phat, LBA_t LBA,
 		Phat_SectorCache_p cached_sector = &phat->cache[i];
 		if (Phat_IsCachedSectorValid(cached_sector) && cached_sector->LBA >= LBA && cached_sector->LBA < LBA + num_sectors)
 		{
-			uint8_t *copy_from = (uint8_t *)buffer + (cached_sector->LBA - LBA) * 512;
-			memcpy(cached_sector->data, copy_from, 512);
-			Phat_SetCachedSectorSync(cached_sector);
+			// The modified cached sectors are newer than the disk
+			uint8_t *copy_to = (uint8_t *)buffer + (cached_sector->LBA - LBA) * 512;
+			if (!Phat_IsCachedSectorSync(cached_sector)) memcpy(copy_to, cached_sector->data, 512);
 		}
 	}
 	return PhatState_OK;
@@ -681,6 +703,207 @@ PHAT_STATIC_FUNC PhatState Phat_WriteSectorsWithoutCache(Phat_p phat, LBA_t LBA,
 	return PhatState_OK;
 }
 
+PHAT_STATIC_FUNC Phat_DataPage_p Phat_FindDataPage(Phat_p phat, LBA_t LBA)
+{
+	for (size_t i = 0; i < phat->num_data_pages; i++)
+	{
+		Phat_DataPage_p page = &phat->data_pages[i];
+		if ((page->usage & SECTORCACHE_VALID) && page->LBA == LBA) return page;
+	}
+	return NULL;
+}
+
+PHAT_STATIC_FUNC uint8_t *Phat_GetDataPageData(Phat_p phat, Phat_DataPage_p page)
+{
+	return &phat->data_page_buffer[(size_t)(page - phat->data_pages) * 512];
+}
+
+PHAT_STATIC_FUNC PhatBool_t Phat_IsDataPageModified(Phat_DataPage_p page)
+{
+	return (page->usage & SECTORCACHE_VALID) && !(page->usage & SECTORCACHE_SYNC);
+}
+
+// Write back a modified page together with the modified pages after it that hold the following sectors.
+// Sequentially written pages are usually next to each other, so they go to the disk with one driver call.
+PHAT_STATIC_FUNC PhatState Phat_WriteBackDataPage(Phat_p phat, Phat_DataPage_p page)
+{
+	size_t index = (size_t)(page - phat->data_pages);
+	size_t num_pages = 1;
+
+	if (!Phat_IsDataPageModified(page)) return PhatState_OK;
+	while (index + num_pages < phat->num_data_pages && num_pages < PHAT_MAX_TRANSFER_SECTORS)
+	{
+		Phat_DataPage_p next_page = &page[num_pages];
+		if (!Phat_IsDataPageModified(next_page) || next_page->LBA != page->LBA + num_pages) break;
+		num_pages++;
+	}
+	if (!phat->driver.fn_write_sector(Phat_GetDataPageData(phat, page), page->LBA, num_pages, phat->driver.userdata))
+	{
+		return PhatState_WriteFail;
+	}
+	for (size_t i = 0; i < num_pages; i++) page[i].usage |= SECTORCACHE_SYNC;
+	return PhatState_OK;
+}
+
+PHAT_STATIC_FUNC PhatState Phat_WriteBackDataPages(Phat_p phat)
+{
+	PhatState ret;
+	for (size_t i = 0; i < phat->num_data_pages; i++)
+	{
+		ret = Phat_WriteBackDataPage(phat, &phat->data_pages[i]);
+		if (ret != PhatState_OK) return ret;
+	}
+	return PhatState_OK;
+}
+
+// Write back the modified pages of the sectors from `LBA` to `LBA + num_sectors - 1`
+PHAT_STATIC_FUNC PhatState Phat_WriteBackDataPageRange(Phat_p phat, LBA_t LBA, LBA_t num_sectors)
+{
+	PhatState ret;
+	for (size_t i = 0; i < phat->num_data_pages; i++)
+	{
+		Phat_DataPage_p page = &phat->data_pages[i];
+		if (Phat_IsDataPageModified(page) && page->LBA >= LBA && page->LBA < LBA + num_sectors)
+		{
+			ret = Phat_WriteBackDataPage(phat, page);
+			if (ret != PhatState_OK) return ret;
+		}
+	}
+	return PhatState_OK;
+}
+
+PHAT_STATIC_FUNC PhatBool_t Phat_IsDataCacheModified(Phat_p phat)
+{
+	for (size_t i = 0; i < phat->num_data_pages; i++)
+	{
+		if (Phat_IsDataPageModified(&phat->data_pages[i])) return 1;
+	}
+	return 0;
+}
+
+// Pick a page for `LBA` with the CLOCK algorithm, a modified victim is written back first
+PHAT_STATIC_FUNC PhatState Phat_ClaimDataPage(Phat_p phat, LBA_t LBA, Phat_DataPage_p *page_out)
+{
+	PhatState ret;
+	Phat_DataPage_p page;
+	for (;;)
+	{
+		page = &phat->data_pages[phat->data_page_hand];
+		if (++phat->data_page_hand >= phat->num_data_pages) phat->data_page_hand = 0;
+		if (!(page->usage & SECTORCACHE_REFERENCED)) break;
+		page->usage &= ~SECTORCACHE_REFERENCED;
+	}
+	ret = Phat_WriteBackDataPage(phat, page);
+	if (ret != PhatState_OK) return ret;
+	page->LBA = LBA;
+	page->usage = SECTORCACHE_VALID | SECTORCACHE_SYNC | SECTORCACHE_REFERENCED;
+	*page_out = page;
+	return PhatState_OK;
+}
+
+// The modified pages are newer than the disk, copy them over the sectors just read
+PHAT_STATIC_FUNC void Phat_OverlayModifiedDataPages(Phat_p phat, LBA_t LBA, size_t num_sectors, void *buffer)
+{
+	for (size_t i = 0; i < phat->num_data_pages; i++)
+	{
+		Phat_DataPage_p page = &phat->data_pages[i];
+		if (Phat_IsDataPageModified(page) && page->LBA >= LBA && page->LBA < LBA + num_sectors)
+			memcpy((uint8_t *)buffer + (page->LBA - LBA) * 512, Phat_GetDataPageData(phat, page), 512);
+	}
+}
+
+// Refresh the pages of the sectors just written to the disk, `buffer` could be NULL for zeros
+PHAT_STATIC_FUNC void Phat_UpdateDataPages(Phat_p phat, LBA_t LBA, size_t num_sectors, const void *buffer)
+{
+	for (size_t i = 0; i < phat->num_data_pages; i++)
+	{
+		Phat_DataPage_p page = &phat->data_pages[i];
+		if ((page->usage & SECTORCACHE_VALID) && page->LBA >= LBA && page->LBA < LBA + num_sectors)
+		{
+			if (buffer)
+				memcpy(Phat_GetDataPageData(phat, page), (const uint8_t *)buffer + (page->LBA - LBA) * 512, 512);
+			else
+				memset(Phat_GetDataPageData(phat, page), 0, 512);
+			page->usage |= SECTORCACHE_SYNC;
+		}
+	}
+}
+
+// Long runs bypass the data cache, the short ones are kept in it
+PHAT_STATIC_FUNC PhatBool_t Phat_IsDataCacheBypassed(Phat_p phat, size_t num_sectors)
+{
+	return !phat->num_data_pages || (num_sectors > 1 && num_sectors * 4 > phat->num_data_pages);
+}
+
+// Read file data through the data cache
+PHAT_STATIC_FUNC PhatState Phat_ReadFileSectors(Phat_p phat, LBA_t LBA, size_t num_sectors, void *buffer)
+{
+	PhatState ret;
+	uint8_t *data = buffer;
+	Phat_DataPage_p page;
+	size_t i = 0;
+
+	if (Phat_IsDataCacheBypassed(phat, num_sectors))
+	{
+		ret = Phat_ReadSectorsWithoutCache(phat, LBA, num_sectors, buffer);
+		if (ret != PhatState_OK) return ret;
+		Phat_OverlayModifiedDataPages(phat, LBA, num_sectors, buffer);
+		return PhatState_OK;
+	}
+	while (i < num_sectors)
+	{
+		size_t num_missing = 1;
+		page = Phat_FindDataPage(phat, LBA + (LBA_t)i);
+		if (page)
+		{
+			memcpy(&data[i * 512], Phat_GetDataPageData(phat, page), 512);
+			page->usage |= SECTORCACHE_REFERENCED;
+			i++;
+			continue;
+		}
+
+		// Read the missing sectors together, then keep them in the cache
+		while (i + num_missing < num_sectors && !Phat_FindDataPage(phat, LBA + (LBA_t)(i + num_missing))) num_missing++;
+		ret = Phat_ReadSectorsWithoutCache(phat, LBA + (LBA_t)i, num_missing, &data[i * 512]);
+		if (ret != PhatState_OK) return ret;
+		for (size_t j = 0; j < num_missing; j++, i++)
+		{
+			ret = Phat_ClaimDataPage(phat, LBA + (LBA_t)i, &page);
+			if (ret != PhatState_OK) return ret;
+			memcpy(Phat_GetDataPageData(phat, page), &data[i * 512], 512);
+		}
+	}
+	return PhatState_OK;
+}
+
+// Write file data through the data cache, the cached sectors are written back later
+PHAT_STATIC_FUNC PhatState Phat_WriteFileSectors(Phat_p phat, LBA_t LBA, size_t num_sectors, const void *buffer)
+{
+	PhatState ret;
+	const uint8_t *data = buffer;
+	Phat_DataPage_p page;
+
+	if (Phat_IsDataCacheBypassed(phat, num_sectors))
+	{
+		ret = Phat_WriteSectorsWithoutCache(phat, LBA, num_sectors, buffer);
+		if (ret != PhatState_OK) return ret;
+		Phat_UpdateDataPages(phat, LBA, num_sectors, buffer);
+		return PhatState_OK;
+	}
+	for (size_t i = 0; i < num_sectors; i++)
+	{
+		page = Phat_FindDataPage(phat, LBA + (LBA_t)i);
+		if (!page)
+		{
+			ret = Phat_ClaimDataPage(phat, LBA + (LBA_t)i, &page);
+			if (ret != PhatState_OK) return ret;
+		}
+		memcpy(Phat_GetDataPageData(phat, page), &data[i * 512], 512);
+		page->usage = SECTORCACHE_VALID | SECTORCACHE_REFERENCED;
+	}
+	return PhatState_OK;
+}
+
 PHAT_STATIC_FUNC LBA_t Phat_CHS_to_LBA(Phat_CHS_p chs)
 {
 	uint8_t actual_sector = chs->sector & 0x1F;
@@ -936,7 +1159,8 @@ PHAT_STATIC_FUNC PhatState Phat_SearchForFreeCluster(Phat_p phat, Cluster_t from
 {
 	PhatState ret;
 	Cluster_t cluster;
-	for (Cluster_t i = from; i < phat->num_FAT_entries; i++)
+	if (from < 2) from = 2;
+	for (Cluster_t i = from; i <= phat->max_valid_cluster; i++)
 	{
 		ret = Phat_ReadFAT(phat, i, &cluster);
 		if (ret != PhatState_OK) return ret;
@@ -955,7 +1179,7 @@ PHAT_STATIC_FUNC PhatState Phat_SumFreeClusters(Phat_p phat, Cluster_t *num_free
 	PhatState ret;
 	Cluster_t cluster;
 	Cluster_t sum = 0;
-	for (Cluster_t i = 0; i < phat->num_FAT_entries; i++)
+	for (Cluster_t i = 2; i <= phat->max_valid_cluster; i++)
 	{
 		ret = Phat_ReadFAT(phat, i, &cluster);
 		if (ret != PhatState_OK) return ret;
@@ -970,31 +1194,35 @@ PHAT_STATIC_FUNC LBA_t Phat_ClusterToLBA(Phat_p phat, Cluster_t cluster)
 	return phat->data_start_LBA + (LBA_t)(cluster - 2) * phat->sectors_per_cluster;
 }
 
-// Find next free cluster starting from phat->next_free_cluster
-PHAT_STATIC_FUNC PhatState Phat_SeekForFreeCluster(Phat_p phat, Cluster_t *cluster_out)
+// The last cluster that both has a FAT entry and lies inside the partition
+PHAT_STATIC_FUNC Cluster_t Phat_GetMaxValidCluster(Phat_p phat)
 {
-	return Phat_SearchForFreeCluster(phat, phat->next_free_cluster, cluster_out);
+	Cluster_t max_valid_cluster = (Cluster_t)((phat->total_sectors - phat->data_start_LBA) / phat->sectors_per_cluster) + 1;
+	if (max_valid_cluster > phat->num_FAT_entries - 1) max_valid_cluster = phat->num_FAT_entries - 1;
+	return max_valid_cluster;
 }
 
 PHAT_STATIC_FUNC PhatState Phat_MarkDirty(Phat_p phat, PhatBool_t is_dirty, PhatBool_t flush_immediately)
 {
 	PhatState ret;
-	Cluster_t clean_bit;
+	Cluster_t clean_bit = phat->FAT_codec->clean_bit;
 	Cluster_t dirty_entry;
+	PhatBool_t deferred;
 
-	switch(phat->FAT_bits)
-	{
-	case 12: clean_bit = 0x800; break;
-	case 16: clean_bit = 0x8000; break;
-	case 32: clean_bit = 0x80000000; break;
-	default: return PhatState_InternalError;
-	}
-
-	ret = Phat_ReadFAT(phat, 0, &dirty_entry);
+	if (!clean_bit) return PhatState_OK;
+	ret = Phat_ReadFAT(phat, 1, &dirty_entry);
 	if (ret != PhatState_OK) return ret;
-	if (is_dirty) dirty_entry &= clean_bit - 1;
+
+	// The flag is always written with `flush_immediately`, if it's already as wanted then it's already on the disk
+	if (flush_immediately && ((dirty_entry & clean_bit) == 0) == (is_dirty != 0)) return PhatState_OK;
+	if (is_dirty) dirty_entry &= ~clean_bit;
 	else dirty_entry |= clean_bit;
-	ret = Phat_WriteFAT(phat, 0, dirty_entry, flush_immediately);
+
+	// The dirty flag goes to every FAT immediately since it guards the deferred FAT mirrors
+	deferred = phat->FAT_mirror_deferred;
+	phat->FAT_mirror_deferred = 0;
+	ret = Phat_WriteFAT(phat, 1, dirty_entry, flush_immediately);
+	phat->FAT_mirror_deferred = deferred;
 	if (ret != PhatState_OK) return ret;
 
 	return PhatState_OK;
@@ -1003,18 +1231,15 @@ PHAT_STATIC_FUNC PhatState Phat_MarkDirty(Phat_p phat, PhatBool_t is_dirty, Phat
 PHAT_STATIC_FUNC PhatState Phat_CheckIsDirty(Phat_p phat, PhatBool_t *is_dirty)
 {
 	PhatState ret;
-	Cluster_t clean_bit;
+	Cluster_t clean_bit = phat->FAT_codec->clean_bit;
 	Cluster_t dirty_entry;
 
-	switch (phat->FAT_bits)
+	if (!clean_bit)
 	{
-	case 12: clean_bit = 0x800; break;
-	case 16: clean_bit = 0x8000; break;
-	case 32: clean_bit = 0x80000000; break;
-	default: return PhatState_InternalError;
+		*is_dirty = 0;
+		return PhatState_OK;
 	}
-
-	ret = Phat_ReadFAT(phat, 0, &dirty_entry);
+	ret = Phat_ReadFAT(phat, 1, &dirty_entry);
 	if (ret != PhatState_OK) return ret;
 	if (dirty_entry & clean_bit)*is_dirty = 0;
 	else *is_dirty = 1;
@@ -1044,6 +1269,19 @@ PHAT_FUNC PhatState Phat_Mount(Phat_p phat, int partition_index, PhatBool_t writ
 	if (ret != PhatState_OK) return ret;
 
 	phat->write_enable = write_enable;
+	phat->num_FAT_mirror_ranges = 0;
+	phat->resident_FAT = NULL;
+	phat->resident_FAT_num_sectors = 0;
+	memset(phat->resident_FAT_modified, 0, sizeof phat->resident_FAT_modified);
+	phat->FAT_read_ahead = 0;
+	phat->data_pages = NULL;
+	phat->data_page_buffer = NULL;
+	phat->num_data_pages = 0;
+	memset(phat->chain_hints, 0, sizeof phat->chain_hints);
+	memset(phat->file_sector_buffers, 0, sizeof phat->file_sector_buffers);
+#if PHAT_OPEN_FILES
+	memset(phat->open_files, 0, sizeof phat->open_files);
+#endif
 
 	dbr = (Phat_DBR_FAT_p)cached_sector->data;
 	dbr_32 = (Phat_DBR_FAT32_p)cached_sector->data;
@@ -1074,12 +1312,11 @@ PHAT_FUNC PhatState Phat_Mount(Phat_p phat, int partition_index, PhatBool_t writ
 		phat->num_diritems_in_a_cluster = (phat->bytes_per_sector * phat->sectors_per_cluster) / 32;
 		phat->num_FAT_entries = (phat->FAT_size_in_sectors * phat->bytes_per_sector * 8) / phat->FAT_bits;
 		phat->FATs_are_same = 1;
-		switch (phat->FAT_bits)
-		{
-		case 12: phat->end_of_cluster_chain = 0x0FF8; break;
-		case 16: phat->end_of_cluster_chain = 0xFFF8; break;
-		}
-		phat->max_valid_cluster = phat->num_FAT_entries + 1;
+		ret = Phat_InstallFATCodec(phat);
+		if (ret != PhatState_OK) return ret;
+		phat->max_valid_cluster = Phat_GetMaxValidCluster(phat);
+		phat->has_FSInfo = 0;
+		phat->FSInfo_modified = 0;
 	}
 	else
 	{
@@ -1098,18 +1335,30 @@ PHAT_FUNC PhatState Phat_Mount(Phat_p phat, int partition_index, PhatBool_t writ
 		phat->num_diritems_in_a_cluster = (phat->bytes_per_sector * phat->sectors_per_cluster) / 32;
 		phat->num_FAT_entries = (phat->FAT_size_in_sectors * phat->bytes_per_sector * 8) / phat->FAT_bits;
 		phat->FATs_are_same = !dbr_32->FATs_are_different;
-		phat->end_of_cluster_chain = 0x0FFFFFF8;
-		phat->max_valid_cluster = phat->num_FAT_entries + 1;
+		ret = Phat_InstallFATCodec(phat);
+		if (ret != PhatState_OK) return ret;
+		phat->max_valid_cluster = Phat_GetMaxValidCluster(phat);
 
 		// Read FSInfo sector
 		ret = Phat_ReadSectorThroughCache(phat, partition_start_LBA + dbr_32->FS_info_sector, &cached_sector);
 		if (ret != PhatState_OK) return ret;
 		fsi = (Phat_FSInfo_p)cached_sector->data;
+		phat->FSInfo_LBA = partition_start_LBA + dbr_32->FS_info_sector;
+		phat->FSInfo_modified = 0;
 		if (fsi->lead_signature == 0x41615252 && fsi->struct_signature == 0x61417272 && fsi->trail_signature == 0xAA55)
 		{
 			phat->has_FSInfo = 1;
 			phat->free_clusters = fsi->free_cluster_count;
 			phat->next_free_cluster = fsi->next_free_cluster;
+
+			// Both fields could be 0xFFFFFFFF for unknown
+			if (phat->next_free_cluster < 2 || phat->next_free_cluster > phat->max_valid_cluster) phat->next_free_cluster = 2;
+			if (phat->free_clusters > phat->max_valid_cluster - 1)
+			{
+				ret = Phat_SumFreeClusters(phat, &phat->free_clusters);
+				if (ret != PhatState_OK) return ret;
+				phat->FSInfo_modified = 1;
+			}
 		}
 		else
 		{
@@ -1133,6 +1382,11 @@ PHAT_FUNC PhatState Phat_ChangeWriteEnable(Phat_p phat, PhatBool_t write_enable)
 
 	if (!write_enable)
 	{
+		if (phat->num_FAT_mirror_ranges || phat->FSInfo_modified || Phat_IsResidentFATModified(phat) || Phat_IsDataCacheModified(phat))
+		{
+			phat->write_enable = 1;
+			return PhatState_ModifiedDataNeedWriteBack;
+		}
 		for (size_t i = 0; i < PHAT_CACHED_SECTORS; i++)
 		{
 			Phat_SectorCache_p cache = &phat->cache[i];
@@ -1147,1624 +1401,3570 @@ PHAT_FUNC PhatState Phat_ChangeWriteEnable(Phat_p phat, PhatBool_t write_enable)
 	return PhatState_OK;
 }
 
-// Should be called after some allocations or deletions happened on the FAT
+// Allocations and deletions only update the counters in `phat`, the FSInfo sector is written here when flushing
 PHAT_STATIC_FUNC PhatState Phat_UpdateFSInfo(Phat_p phat)
 {
 	PhatState ret = PhatState_OK;
 	Phat_SectorCache_p cached_sector;
 	Phat_FSInfo_p fsi;
 
-	ret = Phat_ReadSectorThroughCache(phat, phat->partition_start_LBA + 1, &cached_sector);
+	if (!phat->has_FSInfo || !phat->FSInfo_modified) return PhatState_OK;
+	ret = Phat_ReadSectorThroughCache(phat, phat->FSInfo_LBA, &cached_sector);
 	if (ret != PhatState_OK) return ret;
 
 	fsi = (Phat_FSInfo_p)cached_sector->data;
 	fsi->next_free_cluster = phat->next_free_cluster;
 	fsi->free_cluster_count = phat->free_clusters;
 	Phat_SetCachedSectorModified(cached_sector);
+	phat->FSInfo_modified = 0;
 	return PhatState_OK;
 }
 
-PHAT_STATIC_FUNC int Phat_Cache_Compare_LBA(void const *a, void const *b)
-{
-	Phat_SectorCache_t const *ca = a;
-	Phat_SectorCache_t const *cb = b;
-
-	if (ca->LBA > cb->LBA) return 1;
-	if (ca->LBA < cb->LBA) return -1;
-	return 0;
-}
-
-PHAT_FUNC PhatState Phat_FlushCache(Phat_p phat, PhatBool_t invalidate)
+// Remember that the FAT sector `FAT_sector` (counted from the start of the FAT) needs to be copied to the other FATs
+PHAT_STATIC_FUNC void Phat_AddFATMirrorRange(Phat_p phat, LBA_t FAT_sector)
 {
-	PhatState ret = PhatState_OK;
-	Phat_SectorCache_p pointers[PHAT_CACHED_SECTORS] = { 0 };
-	size_t count = 0;
+	Phat_SectorRange_p ranges = phat->FAT_mirror_ranges;
+	uint8_t nearest = 0;
+	LBA_t nearest_growth = 0;
 
-	// Check parameters
-	if (!phat) return PhatState_InvalidParameter;
-	if (!phat->write_enable)
+	for (uint8_t i = 0; i < phat->num_FAT_mirror_ranges; i++)
 	{
-		for (size_t i = 0; i < PHAT_CACHED_SECTORS; i++)
+		LBA_t growth;
+		if (FAT_sector >= ranges[i].start && FAT_sector < ranges[i].end) return;
+		if (FAT_sector < ranges[i].start)
+			growth = ranges[i].start - FAT_sector;
+		else
+			growth = FAT_sector + 1 - ranges[i].end;
+		if (i == 0 || growth < nearest_growth)
 		{
-			Phat_SectorCache_p cache = &phat->cache[i];
-			ret = Phat_InvalidateCachedSector(phat, cache);
-			if (ret != PhatState_OK) return ret;
+			nearest = i;
+			nearest_growth = growth;
 		}
-		return PhatState_OK;
 	}
-
-	for (size_t i = 0; i < PHAT_CACHED_SECTORS; i++)
+	if (!phat->num_FAT_mirror_ranges || (nearest_growth > 1 && phat->num_FAT_mirror_ranges < PHAT_FAT_MIRROR_RANGES))
 	{
-		Phat_SectorCache_p cache = &phat->cache[i];
-		if (Phat_IsCachedSectorValid(cache) && !Phat_IsCachedSectorSync(cache))
-			pointers[count ++ ] = &phat->cache[i];
+		ranges[phat->num_FAT_mirror_ranges].start = FAT_sector;
+		ranges[phat->num_FAT_mirror_ranges].end = FAT_sector + 1;
+		phat->num_FAT_mirror_ranges++;
+		return;
 	}
-	if (count)
-	{
-		qsort(pointers, count, sizeof pointers[0], Phat_Cache_Compare_LBA);
 
-		for (size_t i = 0; i < count; i++)
+	// Grow the nearest range to cover the sector, then merge the ranges it touches
+	if (FAT_sector < ranges[nearest].start)
+		ranges[nearest].start = FAT_sector;
+	else
+		ranges[nearest].end = FAT_sector + 1;
+	for (uint8_t i = 0; i < phat->num_FAT_mirror_ranges;)
+	{
+		uint8_t last = phat->num_FAT_mirror_ranges - 1;
+		if (i != nearest && ranges[i].start <= ranges[nearest].end && ranges[nearest].start <= ranges[i].end)
 		{
-			if (invalidate)
-				ret = Phat_InvalidateCachedSector(phat, pointers[i]);
-			else
-				ret = Phat_WriteBackCachedSector(phat, pointers[i]);
-			if (ret != PhatState_OK) return ret;
+			if (ranges[i].start < ranges[nearest].start) ranges[nearest].start = ranges[i].start;
+			if (ranges[i].end > ranges[nearest].end) ranges[nearest].end = ranges[i].end;
+			ranges[i] = ranges[last];
+			if (nearest == last) nearest = i;
+			phat->num_FAT_mirror_ranges--;
+			continue;
 		}
+		i++;
 	}
-	return PhatState_OK;
 }
 
-PHAT_FUNC PhatState Phat_Unmount(Phat_p phat)
+// Copy the remembered ranges of the first FAT to the other FATs
+PHAT_STATIC_FUNC PhatState Phat_SyncFATMirrors(Phat_p phat)
 {
 	PhatState ret;
 
-	// Check parameters
-	if (!phat) return PhatState_InvalidParameter;
+	if (!phat->num_FAT_mirror_ranges) return PhatState_OK;
+	while (phat->num_FAT_mirror_ranges)
+	{
+		Phat_SectorRange_p range = &phat->FAT_mirror_ranges[phat->num_FAT_mirror_ranges - 1];
+		while (range->start < range->end)
+		{
+			LBA_t LBA = phat->partition_start_LBA + phat->FAT1_start_LBA + range->start;
+			LBA_t num_sectors = range->end - range->start;
+			if (num_sectors > PHAT_FAT_BUFFER_SECTORS) num_sectors = PHAT_FAT_BUFFER_SECTORS;
+			if (!phat->driver.fn_read_sector(phat->FAT_buffer, LBA, num_sectors, phat->driver.userdata))
+			{
+				return PhatState_ReadFail;
+			}
 
-	ret = Phat_FlushCache(phat, 0);
-	if (ret != PhatState_OK) return ret;
+			// The cached sectors are newer than the disk
+			for (size_t i = 0; i < PHAT_CACHED_SECTORS; i++)
+			{
+				Phat_SectorCache_p cached_sector = &phat->cache[i];
+				if (Phat_IsCachedSectorValid(cached_sector) && cached_sector->LBA >= LBA && cached_sector->LBA < LBA + num_sectors)
+				{
+					memcpy(&phat->FAT_buffer[(cached_sector->LBA - LBA) * 512], cached_sector->data, 512);
+				}
+			}
 
-	if (phat->write_enable)
-	{
-		ret = Phat_MarkDirty(phat, phat->is_dirty, 1);
-		if (ret != PhatState_OK) return ret;
+			for (LBA_t i = 1; i < phat->num_FATs; i++)
+			{
+				ret = Phat_WriteSectorsWithoutCache(phat, LBA + i * phat->FAT_size_in_sectors, num_sectors, phat->FAT_buffer);
+				if (ret != PhatState_OK) return ret;
+			}
+			range->start += num_sectors;
+		}
+		phat->num_FAT_mirror_ranges--;
 	}
-	return PhatState_OK;
+
+	// The FATs are the same again, the dirty bit goes back to how it was when mounting
+	return Phat_MarkDirty(phat, phat->is_dirty, 1);
 }
 
-PHAT_FUNC PhatState Phat_DeInit(Phat_p phat)
+PHAT_FUNC PhatState Phat_SetDeferredFATMirroring(Phat_p phat, PhatBool_t deferred)
 {
 	PhatState ret;
 
 	// Check parameters
-	if (!phat) return PhatState_InvalidParameter;
+	if (!phat || !phat->FAT_codec) return PhatState_InvalidParameter;
 
-	ret = Phat_Unmount(phat);
-	if (ret != PhatState_OK) return ret;
-	if (!Phat_CloseDevice(&phat->driver)) return PhatState_DriverError;
-	Phat_DeInitDriver(&phat->driver);
-	memset(phat, 0, sizeof * phat);
+	// Without a dirty bit a crash would leave FATs that differ with nothing telling so
+	if (deferred && !phat->FAT_codec->clean_bit) return PhatState_FATTypeNotSupported;
+	if (!deferred)
+	{
+		ret = Phat_SyncFATMirrors(phat);
+		if (ret != PhatState_OK) return ret;
+	}
+	phat->FAT_mirror_deferred = deferred;
 	return PhatState_OK;
 }
 
-PHAT_FUNC void Phat_SetCurDateTime(Phat_p phat, const Phat_Date_p cur_date, const Phat_Time_p cur_time)
+PHAT_STATIC_FUNC PhatBool_t Phat_IsResidentFATSectorModified(Phat_p phat, LBA_t index)
 {
-	// Check parameters
-	if (!phat || (!cur_date && !cur_time)) return;
-	if (cur_date) phat->cur_date = *cur_date;
-	if (cur_time) phat->cur_time = *cur_time;
+	return (phat->resident_FAT_modified[index >> 3] >> (index & 7)) & 1;
 }
 
-PHAT_STATIC_FUNC PhatState Phat_WipeCluster(Phat_p phat, Cluster_t cluster)
+PHAT_STATIC_FUNC PhatBool_t Phat_IsResidentFATModified(Phat_p phat)
+{
+	for (size_t i = 0; i < sizeof phat->resident_FAT_modified; i++)
+	{
+		if (phat->resident_FAT_modified[i]) return 1;
+	}
+	return 0;
+}
+
+// Write `num_sectors` sectors of the resident FAT window starting from `index` to every FAT
+PHAT_STATIC_FUNC PhatState Phat_WriteResidentFATSectors(Phat_p phat, LBA_t index, LBA_t num_sectors)
 {
 	PhatState ret;
-	LBA_t cluster_LBA = Phat_ClusterToLBA(phat, cluster) + phat->partition_start_LBA;
-	for (LBA_t i = 0; i < phat->sectors_per_cluster; i++)
+	LBA_t LBA = phat->partition_start_LBA + phat->FAT1_start_LBA + phat->resident_FAT_first_sector + index;
+
+	for (LBA_t i = 0; i < phat->num_FATs; i++)
 	{
-		LBA_t LBA = cluster_LBA + i;
-		ret = Phat_WriteSectorsWithoutCache(phat, LBA, 1, empty_sector);
+		ret = Phat_WriteSectorsWithoutCache(phat, LBA + i * phat->FAT_size_in_sectors, num_sectors, &phat->resident_FAT[index << phat->bytes_per_sector_shift]);
 		if (ret != PhatState_OK) return ret;
+		if (!phat->FATs_are_same) break;
+	}
+	for (LBA_t i = index; i < index + num_sectors; i++)
+	{
+		phat->resident_FAT_modified[i >> 3] &= ~(1 << (i & 7));
 	}
 	return PhatState_OK;
 }
 
-// Read FAT table by `cluster` starting from 0
-PHAT_STATIC_FUNC PhatState Phat_ReadFAT(Phat_p phat, Cluster_t cluster, Cluster_t *read_out)
+PHAT_STATIC_FUNC PhatState Phat_WriteBackResidentFAT(Phat_p phat)
 {
-	PhatState ret = PhatState_OK;
-	uint16_t raw_entry;
-	int half_cluster = 0;
-	LBA_t fat_offset;
-	LBA_t fat_sector_LBA;
-	Phat_SectorCache_p cached_sector;
-	Cluster_t cluster_number = 0;
-	size_t ent_offset_in_sector;
+	PhatState ret;
+	LBA_t i = 0;
 
-	switch (phat->FAT_bits)
-	{
-	case 12:
-		half_cluster = cluster & 1;
-		fat_offset = (LBA_t)cluster + (cluster >> 1);
-		break;
-	case 16:
-		fat_offset = (LBA_t)cluster * 2;
-		break;
-	case 32:
-		fat_offset = (LBA_t)cluster * 4;
-		break;
-	default:
-		return PhatState_InternalError;
-	}
-	fat_sector_LBA = phat->partition_start_LBA + phat->FAT1_start_LBA + (fat_offset / phat->bytes_per_sector);
-	ret = Phat_ReadSectorThroughCache(phat, fat_sector_LBA, &cached_sector);
-	if (ret != PhatState_OK) return ret;
-	ent_offset_in_sector = fat_offset % phat->bytes_per_sector;
-	switch (phat->FAT_bits)
+	while (i < phat->resident_FAT_num_sectors)
 	{
-	case 12:
-		raw_entry = *(uint16_t *)&cached_sector->data[ent_offset_in_sector];
-		if (half_cluster == 0)
-			cluster_number = raw_entry & 0x0FFF;
+		LBA_t num_sectors = 0;
+		if (!phat->resident_FAT_modified[i >> 3])
+		{
+			i = (i | 7) + 1;
+			continue;
+		}
+
+		// Write the consecutive modified sectors at once
+		while (i + num_sectors < phat->resident_FAT_num_sectors && Phat_IsResidentFATSectorModified(phat, i + num_sectors)) num_sectors++;
+		if (num_sectors)
+		{
+			ret = Phat_WriteResidentFATSectors(phat, i, num_sectors);
+			if (ret != PhatState_OK) return ret;
+			i += num_sectors;
+		}
 		else
-			cluster_number = (raw_entry >> 4) & 0x0FFF;
-		break;
-	case 16:
-		cluster_number = *(uint16_t *)&cached_sector->data[ent_offset_in_sector];
-		break;
-	case 32:
-		cluster_number = *(uint32_t *)&cached_sector->data[ent_offset_in_sector];
-		break;
+			i++;
 	}
-	*read_out = cluster_number;
 	return PhatState_OK;
 }
 
-// Write FAT table by `cluster` starting from 0
-PHAT_STATIC_FUNC PhatState Phat_WriteFAT(Phat_p phat, Cluster_t cluster, Cluster_t write, PhatBool_t flush)
+PHAT_FUNC PhatState Phat_SetResidentFAT(Phat_p phat, void *buffer, size_t buffer_size, Cluster_t first_cluster)
 {
-	PhatState ret = PhatState_OK;
-	int half_cluster = 0;
-	LBA_t fat_offset;
-	LBA_t fat_sector_LBA;
-	Phat_SectorCache_p cached_sector;
-	size_t ent_offset_in_sector;
+	PhatState ret;
+	LBA_t first_sector;
+	LBA_t num_sectors;
+	LBA_t LBA;
 
-	switch (phat->FAT_bits)
+	// Check parameters
+	if (!phat) return PhatState_InvalidParameter;
+
+	if (phat->resident_FAT)
 	{
-	case 12:
-		half_cluster = cluster & 1;
-		fat_offset = (LBA_t)cluster + (cluster >> 1);
-		break;
-	case 16:
-		fat_offset = (LBA_t)cluster * 2;
-		break;
-	case 32:
-		fat_offset = (LBA_t)cluster * 4;
-		break;
-	default:
-		return PhatState_InternalError;
+		ret = Phat_WriteBackResidentFAT(phat);
+		if (ret != PhatState_OK) return ret;
+		phat->resident_FAT = NULL;
+		phat->resident_FAT_num_sectors = 0;
 	}
-	for (LBA_t i = 0; i < phat->num_FATs; i++)
+	if (!buffer) return PhatState_OK;
+
+	first_sector = phat->FAT_codec->entry_offset(first_cluster) >> phat->bytes_per_sector_shift;
+	if (first_sector >= phat->FAT_size_in_sectors) return PhatState_InvalidParameter;
+	num_sectors = buffer_size >> phat->bytes_per_sector_shift;
+	if (num_sectors > phat->FAT_size_in_sectors - first_sector) num_sectors = phat->FAT_size_in_sectors - first_sector;
+	if (num_sectors > PHAT_RESIDENT_FAT_MAX_SECTORS) num_sectors = PHAT_RESIDENT_FAT_MAX_SECTORS;
+	if (!num_sectors) return PhatState_InvalidParameter;
+
+	LBA = phat->partition_start_LBA + phat->FAT1_start_LBA + first_sector;
+	ret = Phat_ReadSectorsWithoutCache(phat, LBA, num_sectors, buffer);
+	if (ret != PhatState_OK) return ret;
+
+	// The window takes over the cached FAT sectors, including their modifications
+	memset(phat->resident_FAT_modified, 0, sizeof phat->resident_FAT_modified);
+	for (size_t i = 0; i < PHAT_CACHED_SECTORS; i++)
 	{
-		fat_sector_LBA = phat->partition_start_LBA + phat->FAT1_start_LBA + i * phat->FAT_size_in_sectors + (fat_offset / phat->bytes_per_sector);
-		ret = Phat_ReadSectorThroughCache(phat, fat_sector_LBA, &cached_sector);
-		if (ret != PhatState_OK) return ret;
-		ent_offset_in_sector = fat_offset % phat->bytes_per_sector;
-		switch (phat->FAT_bits)
-		{
-		case 12:
+		Phat_SectorCache_p cached_sector = &phat->cache[i];
+		if (Phat_IsCachedSectorValid(cached_sector) && cached_sector->LBA >= LBA && cached_sector->LBA < LBA + num_sectors)
 		{
-			uint16_t raw_entry = *(uint16_t *)&cached_sector->data[ent_offset_in_sector];
-			if (write == 0x0FFFFFFF) write = 0x0FFF;
-			if (half_cluster == 0)
-			{
-				raw_entry &= 0xF000;
-				raw_entry |= (write & 0x0FFF);
-			}
-			else
-			{
-				raw_entry &= 0x000F;
-				raw_entry |= (write & 0x0FFF) << 4;
-			}
-			*(uint16_t *)&cached_sector->data[ent_offset_in_sector] = raw_entry;
-		}
-		break;
-		case 16:
-			if (write == 0x0FFFFFFF) write = 0xFFFF;
-			*(uint16_t *)&cached_sector->data[ent_offset_in_sector] = (uint16_t)write;
-			break;
-		case 32:
-			*(uint32_t *)&cached_sector->data[ent_offset_in_sector] = write;
-			break;
+			LBA_t index = cached_sector->LBA - LBA;
+			if (!Phat_IsCachedSectorSync(cached_sector)) phat->resident_FAT_modified[index >> 3] |= 1 << (index & 7);
+			cached_sector->usage &= ~SECTORCACHE_VALID;
 		}
-		Phat_SetCachedSectorModified(cached_sector);
-		if (flush) Phat_WriteBackCachedSector(phat, cached_sector);
-		if (!phat->FATs_are_same) break;
 	}
+	phat->resident_FAT = buffer;
+	phat->resident_FAT_first_sector = first_sector;
+	phat->resident_FAT_num_sectors = num_sectors;
 	return PhatState_OK;
 }
 
-PHAT_STATIC_FUNC PhatState Phat_UnlinkCluster(Phat_p phat, Cluster_t cluster)
+PHAT_FUNC PhatState Phat_SetDataCache(Phat_p phat, void *buffer, size_t buffer_size)
 {
 	PhatState ret;
-	Cluster_t next_sector;
-	Cluster_t end_of_chain = phat->end_of_cluster_chain;
+	size_t num_pages;
+	size_t headers_size;
+
+	// Check parameters
+	if (!phat) return PhatState_InvalidParameter;
+
+	ret = Phat_WriteBackDataPages(phat);
+	if (ret != PhatState_OK) return ret;
+	phat->data_pages = NULL;
+	phat->data_page_buffer = NULL;
+	phat->num_data_pages = 0;
+	phat->data_page_hand = 0;
+	if (!buffer) return PhatState_OK;
+
+	// The page headers go first, the page data starts 32-byte aligned after them for DMA
+	num_pages = buffer_size / (sizeof(Phat_DataPage_t) + 512);
 	for (;;)
 	{
-		if (cluster < phat->next_free_cluster) phat->next_free_cluster = cluster;
-		ret = Phat_ReadFAT(phat, cluster, &next_sector);
-		if (ret != PhatState_OK) return ret;
-		ret = Phat_WriteFAT(phat, cluster, 0, 0);
+		if (!num_pages) return PhatState_InvalidParameter;
+		headers_size = (num_pages * sizeof(Phat_DataPage_t) + 31) & ~(size_t)31;
+		if (headers_size + num_pages * 512 <= buffer_size) break;
+		num_pages--;
+	}
+	phat->data_pages = buffer;
+	phat->data_page_buffer = (uint8_t *)buffer + headers_size;
+	phat->num_data_pages = num_pages;
+	memset(phat->data_pages, 0, num_pages * sizeof(Phat_DataPage_t));
+	return PhatState_OK;
+}
+
+// Put a sector that was read from the disk into the sector cache, a cached copy of the sector is kept as it could be newer
+PHAT_STATIC_FUNC PhatState Phat_LoadSectorIntoCache(Phat_p phat, LBA_t LBA, const uint8_t *data, Phat_SectorCache_p *pp_cached_sector)
+{
+	PhatState ret;
+	Phat_SectorCache_p cache;
+
+	for (cache = phat->cache_LRU_head; cache; cache = cache->next)
+	{
+		if (cache->LBA == LBA && Phat_IsCachedSectorValid(cache)) break;
+	}
+	if (!cache)
+	{
+		cache = phat->cache_LRU_tail;
+		ret = Phat_InvalidateCachedSector(phat, cache);
 		if (ret != PhatState_OK) return ret;
-		if (next_sector >= end_of_chain) break;
-		if (next_sector < 2 || next_sector > phat->max_valid_cluster) return PhatState_FATError;
-		cluster = next_sector;
+		memcpy(cache->data, data, 512);
+		cache->LBA = LBA;
+		Phat_SetCachedSectorValid(cache);
+		Phat_SetCachedSectorSync(cache);
 	}
+	Phat_MoveCachedSectorHead(phat, cache);
+	if (pp_cached_sector) *pp_cached_sector = cache;
 	return PhatState_OK;
 }
 
-// `allocated_cluster` could point to a valid cluster that you wish to allocate
-PHAT_STATIC_FUNC PhatState Phat_AllocateCluster(Phat_p phat, Cluster_t *allocated_cluster)
+// Read a sector of the first FAT through the cache. On a miss, the following FAT sectors are read in the same driver call,
+// the read-ahead doubles while the misses are sequential and falls back to one sector on a random miss.
+PHAT_STATIC_FUNC PhatState Phat_ReadFATSectorThroughCache(Phat_p phat, LBA_t FAT_sector, Phat_SectorCache_p *pp_cached_sector)
 {
 	PhatState ret;
-	Cluster_t free_cluster = *allocated_cluster;
-	if (free_cluster >= 2 && free_cluster <= phat->max_valid_cluster)
+	LBA_t LBA = phat->partition_start_LBA + phat->FAT1_start_LBA + FAT_sector;
+	LBA_t num_sectors;
+	uint8_t max_read_ahead = PHAT_FAT_READ_AHEAD_SECTORS;
+
+	if (max_read_ahead > PHAT_FAT_BUFFER_SECTORS) max_read_ahead = PHAT_FAT_BUFFER_SECTORS;
+	if (max_read_ahead > PHAT_CACHED_SECTORS / 2) max_read_ahead = PHAT_CACHED_SECTORS / 2;
+	if (max_read_ahead <= 1 || !phat->cache_LRU_head) return Phat_ReadSectorThroughCache(phat, LBA, pp_cached_sector);
+	for (Phat_SectorCache_p cache = phat->cache_LRU_head; cache; cache = cache->next)
 	{
-		Cluster_t value;
-		ret = Phat_ReadFAT(phat, free_cluster, &value);
-		if (ret == PhatState_OK && value == 0)
+		if (cache->LBA == LBA && Phat_IsCachedSectorValid(cache))
 		{
-			ret = Phat_WriteFAT(phat, free_cluster, phat->end_of_cluster_chain, 0);
-			if (ret != PhatState_OK) return ret;
-			if (phat->has_FSInfo)
-			{
-				if (phat->next_free_cluster == free_cluster)
-				{
-					ret = Phat_SearchForFreeCluster(phat, free_cluster + 1, &phat->next_free_cluster);
-					if (ret != PhatState_OK)
-					{
-						phat->next_free_cluster = 2;
-					}
-				}
-				if (phat->free_clusters > 0)
-					phat->free_clusters--;
-			}
+			Phat_MoveCachedSectorHead(phat, cache);
+			*pp_cached_sector = cache;
+			return PhatState_OK;
 		}
 	}
-	ret = Phat_SeekForFreeCluster(phat, &free_cluster);
-	if (ret != PhatState_OK) return ret;
-	ret = Phat_WriteFAT(phat, free_cluster, phat->end_of_cluster_chain, 0);
-	if (ret != PhatState_OK) return ret;
-	*allocated_cluster = free_cluster;
-	if (phat->has_FSInfo)
+
+	if (FAT_sector == phat->FAT_read_ahead_next && phat->FAT_read_ahead)
 	{
-		if (free_cluster == phat->next_free_cluster)
-		{
-			ret = Phat_SearchForFreeCluster(phat, free_cluster + 1, &phat->next_free_cluster);
-			if (ret != PhatState_OK)
-			{
-				phat->next_free_cluster = 2;
-			}
-		}
-		if (phat->free_clusters > 0)
-			phat->free_clusters--;
-		ret = Phat_UpdateFSInfo(phat);
+		if (phat->FAT_read_ahead < max_read_ahead) phat->FAT_read_ahead *= 2;
+		if (phat->FAT_read_ahead > max_read_ahead) phat->FAT_read_ahead = max_read_ahead;
+	}
+	else
+		phat->FAT_read_ahead = 1;
+	num_sectors = phat->FAT_read_ahead;
+	if (num_sectors > phat->FAT_size_in_sectors - FAT_sector) num_sectors = phat->FAT_size_in_sectors - FAT_sector;
+	if (phat->resident_FAT_num_sectors && FAT_sector < phat->resident_FAT_first_sector && num_sectors > phat->resident_FAT_first_sector - FAT_sector)
+		num_sectors = phat->resident_FAT_first_sector - FAT_sector;
+	phat->FAT_read_ahead_next = FAT_sector + num_sectors;
+	if (num_sectors <= 1) return Phat_ReadSectorThroughCache(phat, LBA, pp_cached_sector);
+
+	if (!phat->driver.fn_read_sector(phat->FAT_buffer, LBA, num_sectors, phat->driver.userdata))
+	{
+		return PhatState_ReadFail;
+	}
+
+	// Load the requested sector last to have it at the head of the LRU list
+	for (LBA_t i = num_sectors - 1; i > 0; i--)
+	{
+		ret = Phat_LoadSectorIntoCache(phat, LBA + i, &phat->FAT_buffer[i * 512], NULL);
 		if (ret != PhatState_OK) return ret;
 	}
-	return PhatState_OK;
+	return Phat_LoadSectorIntoCache(phat, LBA, phat->FAT_buffer, pp_cached_sector);
 }
 
-// The `cur_cluster` is not an index, it's a cluster number.
-PHAT_STATIC_FUNC PhatState Phat_GetFATNextCluster(Phat_p phat, Cluster_t cur_cluster, Cluster_t *next_cluster)
+// Get the data of a FAT sector, from the resident FAT window if it's there, otherwise through the sector cache.
+// `cached_sector_out` receives NULL for a resident sector.
+PHAT_STATIC_FUNC PhatState Phat_GetFATSectorData(Phat_p phat, LBA_t FAT_LBA, LBA_t FAT_sector, uint8_t **data_out, Phat_SectorCache_p *cached_sector_out)
 {
-	PhatState ret = PhatState_OK;
-	Cluster_t cluster_number;
-	if (cur_cluster < 2) return PhatState_InvalidParameter;
-	if (cur_cluster > phat->max_valid_cluster) return PhatState_InvalidParameter;
-	ret = Phat_ReadFAT(phat, cur_cluster, &cluster_number);
+	PhatState ret;
+	LBA_t index = FAT_sector - phat->resident_FAT_first_sector;
+
+	if (index < phat->resident_FAT_num_sectors && FAT_LBA == phat->partition_start_LBA + phat->FAT1_start_LBA)
+	{
+		*data_out = &phat->resident_FAT[index << phat->bytes_per_sector_shift];
+		*cached_sector_out = NULL;
+		return PhatState_OK;
+	}
+	if (FAT_LBA == phat->partition_start_LBA + phat->FAT1_start_LBA)
+		ret = Phat_ReadFATSectorThroughCache(phat, FAT_sector, cached_sector_out);
+	else
+		ret = Phat_ReadSectorThroughCache(phat, FAT_LBA + FAT_sector, cached_sector_out);
 	if (ret != PhatState_OK) return ret;
-	if (cluster_number >= phat->end_of_cluster_chain) return PhatState_EndOfFATChain;
-	if (cluster_number > phat->max_valid_cluster) return PhatState_FATError;
-	if (cluster_number < 2) return PhatState_FATError;
-	*next_cluster = cluster_number;
+	*data_out = (*cached_sector_out)->data;
 	return PhatState_OK;
 }
 
-PHAT_STATIC_FUNC Phat_Time_t Phat_ParseTime(uint16_t time, uint8_t tenths)
+PHAT_STATIC_FUNC PhatState Phat_SetFATSectorModified(Phat_p phat, LBA_t FAT_sector, Phat_SectorCache_p cached_sector, PhatBool_t flush)
 {
-	Phat_Time_t t =
-	{
-		(time >> 11) & 0x1F,
-		(time >> 5) & 0x3F,
-		(time & 0x1F) * 2,
-		(tenths & 0x3F) * 10,
-	};
-	return t;
-}
+	LBA_t index;
 
-PHAT_STATIC_FUNC Phat_Date_t Phat_ParseDate(uint16_t date)
-{
-	Phat_Date_t d =
+	if (cached_sector)
 	{
-		((date >> 9) & 0x7F) + 1980,
-		(date >> 5) & 0x0F,
-		date & 0x1F,
-	};
-	return d;
+		Phat_SetCachedSectorModified(cached_sector);
+		if (flush) return Phat_WriteBackCachedSector(phat, cached_sector);
+		return PhatState_OK;
+	}
+	index = FAT_sector - phat->resident_FAT_first_sector;
+	phat->resident_FAT_modified[index >> 3] |= 1 << (index & 7);
+	if (flush) return Phat_WriteResidentFATSectors(phat, index, 1);
+	return PhatState_OK;
 }
 
-PHAT_STATIC_FUNC uint16_t Phat_EncodeTime(Phat_Time_p time)
+// Check if the entry of `cluster` is entirely inside the resident FAT window
+PHAT_STATIC_FUNC PhatBool_t Phat_IsFATEntryResident(Phat_p phat, Cluster_t cluster)
 {
-	uint16_t raw_time = 0;
-	if (time->hours > 23) time->hours = 23;
-	if (time->minutes > 59) time->minutes = 59;
-	if (time->seconds > 59) time->seconds = 59;
-	raw_time |= (time->hours & 0x1F) << 11;
-	raw_time |= (time->minutes & 0x3F) << 5;
-	raw_time |= (time->seconds / 2) & 0x1F;
-	return raw_time;
+	LBA_t fat_offset = phat->FAT_codec->entry_offset(cluster);
+	LBA_t first = (fat_offset >> phat->bytes_per_sector_shift) - phat->resident_FAT_first_sector;
+	LBA_t last = ((fat_offset + phat->FAT_codec->entry_size - 1) >> phat->bytes_per_sector_shift) - phat->resident_FAT_first_sector;
+	return first < phat->resident_FAT_num_sectors && last < phat->resident_FAT_num_sectors;
 }
 
-PHAT_STATIC_FUNC uint16_t Phat_EncodeDate(Phat_Date_p date)
+PHAT_STATIC_FUNC int Phat_Cache_Compare_LBA(void const *a, void const *b)
 {
-	uint16_t raw_date = 0;
-	if (date->year < 1980) date->year = 1980;
-	if (date->year > 2107) date->year = 2107;
-	if (date->month < 1) date->month = 1;
-	if (date->month > 12) date->month = 12;
-	if (date->day < 1) date->day = 1;
-	if (date->day > 31) date->day = 31;
-	raw_date |= ((date->year - 1980) & 0x7F) << 9;
-	raw_date |= (date->month & 0x0F) << 5;
-	raw_date |= date->day & 0x1F;
-	return raw_date;
-}
+	Phat_SectorCache_t const *ca = *(Phat_SectorCache_t const *const *)a;
+	Phat_SectorCache_t const *cb = *(Phat_SectorCache_t const *const *)b;
 
-PHAT_STATIC_FUNC uint8_t Phat_LFN_ChkSum(uint8_t *file_name_8_3)
-{
-	uint8_t sum = 0;
-	for (int i = 0; i < 11; i++) sum = ((sum & 1) ? 0x80 : 0) + (sum >> 1) + *file_name_8_3++;
-	return sum;
+	if (ca->LBA > cb->LBA) return 1;
+	if (ca->LBA < cb->LBA) return -1;
+	return 0;
 }
 
-PHAT_STATIC_FUNC PhatState Phat_UpdateClusterByDirItemIndex(Phat_DirInfo_p dir_info, PhatBool_t allocate_new_sectors)
+PHAT_FUNC PhatState Phat_FlushCache(Phat_p phat, PhatBool_t invalidate)
 {
 	PhatState ret = PhatState_OK;
-	Phat_p phat = dir_info->phat;
-	Cluster_t cluster_index;
-	Cluster_t next_cluster;
+	Phat_SectorCache_p pointers[PHAT_CACHED_SECTORS] = { 0 };
+	size_t count = 0;
 
-	if (phat->FAT_bits != 32)
+	// Check parameters
+	if (!phat) return PhatState_InvalidParameter;
+	if (!phat->write_enable)
 	{
-		if (dir_info->dir_start_cluster == 0)
+		for (size_t i = 0; i < PHAT_CACHED_SECTORS; i++)
 		{
-			// For root dir, no cluster need to be updated
-			if (dir_info->cur_diritem >= phat->root_dir_entry_count) return PhatState_EndOfDirectory;
-			return PhatState_OK;
+			Phat_SectorCache_p cache = &phat->cache[i];
+			ret = Phat_InvalidateCachedSector(phat, cache);
+			if (ret != PhatState_OK) return ret;
 		}
+		return PhatState_OK;
 	}
-	else
+
+	// File data goes before the metadata that refers to it
+	ret = Phat_WriteBackDataPages(phat);
+	if (ret != PhatState_OK) return ret;
+	if (invalidate)
 	{
-		if (dir_info->dir_start_cluster < 2) return PhatState_InvalidParameter;
+		for (size_t i = 0; i < phat->num_data_pages; i++)
+			phat->data_pages[i].usage = 0;
 	}
-	cluster_index = dir_info->cur_diritem / phat->num_diritems_in_a_cluster;
-	if (dir_info->dir_current_cluster_index > cluster_index)
+
+	ret = Phat_UpdateFSInfo(phat);
+	if (ret != PhatState_OK) return ret;
+
+	for (size_t i = 0; i < PHAT_CACHED_SECTORS; i++)
 	{
-		dir_info->dir_current_cluster_index = 0;
-		dir_info->dir_current_cluster = dir_info->dir_start_cluster;
+		Phat_SectorCache_p cache = &phat->cache[i];
+		if (Phat_IsCachedSectorValid(cache) && !Phat_IsCachedSectorSync(cache))
+			pointers[count ++ ] = &phat->cache[i];
 	}
-	while (dir_info->dir_current_cluster_index < cluster_index)
+	if (count)
 	{
-		if (dir_info->dir_current_cluster < 2) return PhatState_InternalError;
-		ret = Phat_GetFATNextCluster(phat, dir_info->dir_current_cluster, &next_cluster);
-		if (ret == PhatState_EndOfFATChain)
+		qsort(pointers, count, sizeof pointers[0], Phat_Cache_Compare_LBA);
+
+		for (size_t i = 0; i < count; i++)
 		{
-			if (!allocate_new_sectors) return PhatState_EndOfDirectory;
-			// Allocate a new cluster
-			next_cluster = dir_info->dir_current_cluster + 1;
-			ret = Phat_AllocateCluster(phat, &next_cluster);
-			if (ret != PhatState_OK) return ret;
-			ret = Phat_WriteFAT(phat, dir_info->dir_current_cluster, next_cluster, 0);
-			if (ret != PhatState_OK) return ret;
-			dir_info->dir_current_cluster = next_cluster;
-			ret = Phat_WipeCluster(phat, next_cluster);
+			if (invalidate)
+				ret = Phat_InvalidateCachedSector(phat, pointers[i]);
+			else
+				ret = Phat_WriteBackCachedSector(phat, pointers[i]);
 			if (ret != PhatState_OK) return ret;
 		}
-		else if (ret != PhatState_OK)
-			return ret;
-		if (next_cluster > phat->max_valid_cluster) return PhatState_FATError;
-		dir_info->dir_current_cluster_index++;
-		dir_info->dir_current_cluster = next_cluster;
 	}
-	return PhatState_OK;
+	ret = Phat_WriteBackResidentFAT(phat);
+	if (ret != PhatState_OK) return ret;
+	return Phat_SyncFATMirrors(phat);
 }
 
-PHAT_STATIC_FUNC PhatState Phat_GetDirItem(Phat_DirInfo_p dir_info, Phat_DirItem_p dir_item)
+PHAT_FUNC PhatState Phat_Unmount(Phat_p phat)
 {
-	PhatState ret = PhatState_OK;
-	LBA_t dir_sector_LBA;
-	uint8_t item_index_in_sector;
-	Phat_SectorCache_p cached_sector;
-	Phat_DirItem_p dir_items;
-	Phat_p phat = dir_info->phat;
-	uint16_t cur_diritem_in_cur_cluster;
+	PhatState ret;
 
-	if (!phat->num_diritems_in_a_cluster) return PhatState_InternalError;
-	cur_diritem_in_cur_cluster = dir_info->cur_diritem % phat->num_diritems_in_a_cluster;
-	if (phat->FAT_bits == 32)
+	// Check parameters
+	if (!phat) return PhatState_InvalidParameter;
+
+	ret = Phat_FlushCache(phat, 0);
+	if (ret != PhatState_OK) return ret;
+
+	if (phat->write_enable)
 	{
-		if (dir_info->dir_start_cluster == 0) return PhatState_EndOfDirectory;
-		ret = Phat_UpdateClusterByDirItemIndex(dir_info, 0);
+		ret = Phat_MarkDirty(phat, phat->is_dirty, 1);
 		if (ret != PhatState_OK) return ret;
-		dir_sector_LBA = Phat_ClusterToLBA(phat, dir_info->dir_current_cluster) + cur_diritem_in_cur_cluster / phat->num_diritems_in_a_sector;
-	}
-	else // Root directory in FAT12/16
-	{
-		if (dir_info->dir_start_cluster == 0)
-			dir_sector_LBA = phat->root_dir_start_LBA + dir_info->cur_diritem / phat->num_diritems_in_a_sector;
-		else
-		{
-			ret = Phat_UpdateClusterByDirItemIndex(dir_info, 0);
-			if (ret != PhatState_OK) return ret;
-			dir_sector_LBA = Phat_ClusterToLBA(phat, dir_info->dir_current_cluster) + cur_diritem_in_cur_cluster / phat->num_diritems_in_a_sector;
-		}
 	}
-	item_index_in_sector = cur_diritem_in_cur_cluster % phat->num_diritems_in_a_sector;
-	dir_sector_LBA += phat->partition_start_LBA;
-	ret = Phat_ReadSectorThroughCache(phat, dir_sector_LBA, &cached_sector);
-	if (ret != PhatState_OK) return ret;
-	dir_items = (Phat_DirItem_p)&cached_sector->data[0];
-	*dir_item = dir_items[item_index_in_sector];
 	return PhatState_OK;
 }
 
-PHAT_STATIC_FUNC PhatState Phat_PutDirItem(Phat_DirInfo_p dir_info, const Phat_DirItem_p dir_item)
+PHAT_FUNC PhatState Phat_DeInit(Phat_p phat)
 {
-	PhatState ret = PhatState_OK;
-	LBA_t dir_sector_LBA;
-	uint8_t item_index_in_sector;
-	Phat_SectorCache_p cached_sector;
-	Phat_DirItem_p dir_items;
-	Phat_p phat = dir_info->phat;
-	uint16_t cur_diritem_in_cur_cluster = dir_info->cur_diritem % phat->num_diritems_in_a_cluster;
+	PhatState ret;
 
-	if (phat->FAT_bits == 32)
-	{
-		if (dir_info->dir_start_cluster == 0) return PhatState_EndOfDirectory;
-		ret = Phat_UpdateClusterByDirItemIndex(dir_info, 0);
-		if (ret != PhatState_OK) return ret;
-		dir_sector_LBA = Phat_ClusterToLBA(phat, dir_info->dir_current_cluster) + cur_diritem_in_cur_cluster / phat->num_diritems_in_a_sector;
-	}
-	else // Root directory in FAT12/16
-	{
-		if (dir_info->dir_start_cluster == 0)
-			dir_sector_LBA = phat->root_dir_start_LBA + dir_info->cur_diritem / phat->num_diritems_in_a_sector;
-		else
-		{
-			ret = Phat_UpdateClusterByDirItemIndex(dir_info, 0);
-			if (ret != PhatState_OK) return ret;
-			dir_sector_LBA = Phat_ClusterToLBA(phat, dir_info->dir_current_cluster) + cur_diritem_in_cur_cluster / phat->num_diritems_in_a_sector;
-		}
-	}
-	item_index_in_sector = cur_diritem_in_cur_cluster % phat->num_diritems_in_a_sector;
-	dir_sector_LBA += phat->partition_start_LBA;
-	ret = Phat_ReadSectorThroughCache(phat, dir_sector_LBA, &cached_sector);
+	// Check parameters
+	if (!phat) return PhatState_InvalidParameter;
+
+	ret = Phat_Unmount(phat);
 	if (ret != PhatState_OK) return ret;
-	dir_items = (Phat_DirItem_p)&cached_sector->data[0];
-	dir_items[item_index_in_sector] = *dir_item;
-	Phat_SetCachedSectorModified(cached_sector);
+	if (!Phat_CloseDevice(&phat->driver)) return PhatState_DriverError;
+	Phat_DeInitDriver(&phat->driver);
+	memset(phat, 0, sizeof * phat);
 	return PhatState_OK;
 }
 
-PHAT_STATIC_FUNC PhatState Phat_SuckLFNIntoBuffer(Phat_LFN_Entry_p lfn_item, Phat_DirInfo_p buffer)
+PHAT_FUNC void Phat_SetCurDateTime(Phat_p phat, const Phat_Date_p cur_date, const Phat_Time_p cur_time)
 {
-	uint8_t order = lfn_item->order & 0x3F;
-	uint16_t write_pos = (order - 1) * 13;
-	if (order < 1) return PhatState_FSError;
-	if (write_pos > MAX_LFN) return PhatState_FSError;
-	for (size_t i = 0; i < 5; i++)
-	{
-		WChar_t wchar = lfn_item->name1[i];
-		if (write_pos > MAX_LFN) goto Ended;
-		buffer->LFN_name[write_pos++] = wchar;
-		if (!wchar) goto Ended;
-	}
-	for (size_t i = 0; i < 6; i++)
-	{
-		WChar_t wchar = lfn_item->name2[i];
-		if (write_pos > MAX_LFN) goto Ended;
-		buffer->LFN_name[write_pos++] = wchar;
-		if (!wchar) goto Ended;
-	}
-	for (size_t i = 0; i < 2; i++)
-	{
-		WChar_t wchar = lfn_item->name3[i];
-		if (write_pos > MAX_LFN) goto Ended;
-		buffer->LFN_name[write_pos++] = wchar;
-		if (!wchar) goto Ended;
-	}
-Ended:
-	if (lfn_item->order & 0x40)
-	{
-		buffer->LFN_length = write_pos % 13 ? write_pos - 1 : write_pos;
-		if (buffer->LFN_length > 0 && !buffer->LFN_name[buffer->LFN_length - 1]) buffer->LFN_length--;
-	}
-	return PhatState_OK;
+	// Check parameters
+	if (!phat || (!cur_date && !cur_time)) return;
+	if (cur_date) phat->cur_date = *cur_date;
+	if (cur_time) phat->cur_time = *cur_time;
 }
 
-PHAT_STATIC_FUNC PhatBool_t Phat_IsValidLFNEntry(Phat_DirItem_p lfn_item)
+PHAT_STATIC_FUNC PhatState Phat_WriteZeroSectors(Phat_p phat, LBA_t LBA, size_t num_sectors)
 {
-	Phat_LFN_Entry_p lfne = (Phat_LFN_Entry_p)lfn_item;
-	if (lfne->order == 0xE5) return 0;
-	if (lfne->attributes != ATTRIB_LFN) return 0;
-	if (lfne->type != 0) return 0;
-	if (lfne->first_cluster_low != 0) return 0;
-	return 1;
+	PhatState ret;
+	while (num_sectors)
+	{
+		size_t to_write = num_sectors;
+		if (to_write > PHAT_ZERO_SECTORS) to_write = PHAT_ZERO_SECTORS;
+		if (to_write > PHAT_MAX_TRANSFER_SECTORS) to_write = PHAT_MAX_TRANSFER_SECTORS;
+		ret = Phat_WriteSectorsWithoutCache(phat, LBA, to_write, empty_sectors);
+		if (ret != PhatState_OK) return ret;
+		Phat_UpdateDataPages(phat, LBA, to_write, NULL);
+		LBA += (LBA_t)to_write;
+		num_sectors -= to_write;
+	}
+	return PhatState_OK;
 }
 
-PHAT_STATIC_FUNC PhatState Phat_MoveToNextDirItem(Phat_DirInfo_p dir_info)
+PHAT_STATIC_FUNC PhatState Phat_WipeCluster(Phat_p phat, Cluster_t cluster)
 {
-	dir_info->cur_diritem++;
-	return Phat_UpdateClusterByDirItemIndex(dir_info, 0);
+	LBA_t cluster_LBA = Phat_ClusterToLBA(phat, cluster) + phat->partition_start_LBA;
+	return Phat_WriteZeroSectors(phat, cluster_LBA, phat->sectors_per_cluster);
 }
 
-PHAT_STATIC_FUNC PhatState Phat_MoveToNextDirItemWithAllocation(Phat_DirInfo_p dir_info)
+#if PHAT_SUPPORT_FAT12
+PHAT_STATIC_FUNC LBA_t Phat_FAT12EntryOffset(Cluster_t cluster)
 {
-	dir_info->cur_diritem++;
-	return Phat_UpdateClusterByDirItemIndex(dir_info, 1);
+	return (LBA_t)cluster + (cluster >> 1);
 }
 
-PHAT_FUNC PhatState Phat_NextDirItem(Phat_DirInfo_p dir_info)
+// A FAT12 entry could span across two sectors
+PHAT_STATIC_FUNC PhatState Phat_ReadFAT12(Phat_p phat, Cluster_t cluster, Cluster_t *read_out)
 {
-	PhatState ret = PhatState_OK;
-	Phat_DirItem_t diritem;
-	Phat_LFN_Entry_p lfnitem;
-	PhatBool_t no_checksum = 1;
-	uint8_t checksum;
-
-	// Check parameters
-	if (!dir_info) return PhatState_InvalidParameter;
+	PhatState ret;
+	LBA_t FAT_LBA = phat->partition_start_LBA + phat->FAT1_start_LBA;
+	LBA_t fat_offset = Phat_FAT12EntryOffset(cluster);
+	LBA_t fat_sector = fat_offset >> phat->bytes_per_sector_shift;
+	size_t ent_offset_in_sector = fat_offset & (phat->bytes_per_sector - 1);
+	Phat_SectorCache_p cached_sector;
+	uint8_t *data;
+	uint16_t raw_entry;
 
-	lfnitem = (Phat_LFN_Entry_p)&diritem;
-	dir_info->LFN_length = 0;
-	for (;;)
+	ret = Phat_GetFATSectorData(phat, FAT_LBA, fat_sector, &data, &cached_sector);
+	if (ret != PhatState_OK) return ret;
+	raw_entry = data[ent_offset_in_sector];
+	if (ent_offset_in_sector + 1 < phat->bytes_per_sector)
+		raw_entry |= (uint16_t)data[ent_offset_in_sector + 1] << 8;
+	else
 	{
-		ret = Phat_GetDirItem(dir_info, &diritem);
+		ret = Phat_GetFATSectorData(phat, FAT_LBA, fat_sector + 1, &data, &cached_sector);
 		if (ret != PhatState_OK) return ret;
-		if (Phat_IsValidLFNEntry(&diritem))
-		{
-			// LFN entry
-			if (no_checksum)
-			{
-				no_checksum = 0;
-				dir_info->sfn_checksum = lfnitem->checksum;
-			}
-			else if (lfnitem->checksum != dir_info->sfn_checksum)
-			{
-				dir_info->sfn_checksum = lfnitem->checksum;
-				dir_info->LFN_length = 0;
-			}
-			ret = Phat_SuckLFNIntoBuffer(lfnitem, dir_info);
-			if (ret != PhatState_OK) return ret;
-			ret = Phat_MoveToNextDirItem(dir_info);
-			if (ret != PhatState_OK) return ret;
-		}
-		else if (diritem.file_name_8_3[0] == 0xE5)
-		{
-			// Deleted entry
-			dir_info->LFN_length = 0;
-			no_checksum = 1;
-			ret = Phat_MoveToNextDirItem(dir_info);
-			if (ret != PhatState_OK) return ret;
-		}
-		else if (diritem.file_name_8_3[0] == 0x00)
-		{
-			// End of directory
-			dir_info->LFN_length = 0;
-			return PhatState_EndOfDirectory;
-		}
-		else
-		{
-			// Standard entry
-			checksum = Phat_LFN_ChkSum(diritem.file_name_8_3);
-			if (!no_checksum && checksum != dir_info->sfn_checksum)
-			{
-				dir_info->LFN_length = 0;
-			}
-			memcpy(dir_info->file_name_8_3, diritem.file_name_8_3, 11);
-			dir_info->attributes = diritem.attributes;
-			dir_info->ctime = Phat_ParseTime(diritem.creation_time, diritem.creation_time_tenths);
-			dir_info->cdate = Phat_ParseDate(diritem.creation_date);
-			dir_info->mtime = Phat_ParseTime(diritem.last_modification_time, 0);
-			dir_info->mdate = Phat_ParseDate(diritem.last_modification_date);
-			dir_info->adate = Phat_ParseDate(diritem.last_access_date);
-			dir_info->file_size = diritem.file_size;
-			dir_info->first_cluster = ((uint32_t)diritem.first_cluster_high << 16) | diritem.first_cluster_low;
-			if (dir_info->LFN_length == 0)
-			{
-				// No valid LFN, generate from 8.3 name
-				size_t copy_to = 0;
-				for (size_t i = 0; i < 8; i++)
-				{
-					uint8_t ch = diritem.file_name_8_3[i];
-					if (!ch) break;
-					if (ch != ' ') copy_to = i;
-				}
-				for (size_t i = 0; i <= copy_to; i++)
-				{
-					uint8_t ch = diritem.file_name_8_3[i];
-					if (diritem.case_info & CI_BASENAME_IS_LOWER)
-						ch = (uint8_t)tolower(ch);
-					dir_info->LFN_name[dir_info->LFN_length++] = Cp437_To_Unicode(ch);
-				}
-				if (diritem.file_name_8_3[8] != ' ')
-				{
-					dir_info->LFN_name[dir_info->LFN_length++] = L'.';
-					for (size_t i = 8; i < 11; i++)
-					{
-						uint8_t ch = diritem.file_name_8_3[i];
-						if (!ch) break;
-						if (ch != ' ') copy_to = i;
-					}
-				}
-				for (size_t i = 8; i <= copy_to; i++)
-				{
-					uint8_t ch = diritem.file_name_8_3[i];
-					if (diritem.case_info & CI_EXTENSION_IS_LOWER)
-						ch = (uint8_t)tolower(ch);
-					dir_info->LFN_name[dir_info->LFN_length++] = Cp437_To_Unicode(ch);
-				}
-			}
-			dir_info->LFN_name[dir_info->LFN_length] = L'\0';
-			Phat_MoveToNextDirItem(dir_info);
-			return PhatState_OK;
-		}
+		raw_entry |= (uint16_t)data[0] << 8;
 	}
+	*read_out = (cluster & 1) ? raw_entry >> 4 : raw_entry & 0x0FFF;
+	return PhatState_OK;
 }
 
-PHAT_STATIC_FUNC PhatState Phat_FindFirstLFNEntry(Phat_DirInfo_p dir_info)
+PHAT_STATIC_FUNC PhatState Phat_WriteFAT12(Phat_p phat, LBA_t FAT_LBA, Cluster_t cluster, Cluster_t write, PhatBool_t flush)
 {
 	PhatState ret;
-	Phat_DirItem_t diritem;
-	Phat_LFN_Entry_p lfnitem;
-	uint8_t sfn_checksum;
+	LBA_t fat_offset = Phat_FAT12EntryOffset(cluster);
+	LBA_t fat_sector = fat_offset >> phat->bytes_per_sector_shift;
+	size_t ent_offset_in_sector = fat_offset & (phat->bytes_per_sector - 1);
+	Phat_SectorCache_p cached_sector;
+	uint8_t *data;
+	uint8_t *high_byte;
 
-	lfnitem = (Phat_LFN_Entry_p)&diritem;
-	ret = Phat_GetDirItem(dir_info, &diritem);
+	write &= 0x0FFF;
+	ret = Phat_GetFATSectorData(phat, FAT_LBA, fat_sector, &data, &cached_sector);
 	if (ret != PhatState_OK) return ret;
-	if (Phat_IsValidLFNEntry(&diritem)) return PhatState_InvalidParameter;
-	else if (diritem.file_name_8_3[0] == 0xE5)
-	{
-		// Deleted entry
-		return PhatState_InvalidParameter;
-	}
-	else if (diritem.file_name_8_3[0] == 0x00)
-	{
-		// End of directory
-		return PhatState_InvalidParameter;
-	}
+	if (cluster & 1)
+		data[ent_offset_in_sector] = (data[ent_offset_in_sector] & 0x0F) | (uint8_t)(write << 4);
+	else
+		data[ent_offset_in_sector] = (uint8_t)write;
+	if (ent_offset_in_sector + 1 < phat->bytes_per_sector)
+		high_byte = &data[ent_offset_in_sector + 1];
 	else
 	{
-		sfn_checksum = Phat_LFN_ChkSum(diritem.file_name_8_3);
-		for (;;)
-		{
-			dir_info->cur_diritem--;
-			ret = Phat_GetDirItem(dir_info, &diritem);
-			if (ret != PhatState_OK) return ret;
-			if (lfnitem->attributes != ATTRIB_LFN || lfnitem->order == 0xE5)
-			{
-				dir_info->cur_diritem++;
-				return PhatState_OK;
-			}
-			if (lfnitem->checksum != sfn_checksum || !Phat_IsValidLFNEntry(&diritem)) return PhatState_FSError;
-			if (lfnitem->order & 0x40) return PhatState_OK;
-		}
+		ret = Phat_SetFATSectorModified(phat, fat_sector, cached_sector, flush);
+		if (ret != PhatState_OK) return ret;
+		fat_sector++;
+		ret = Phat_GetFATSectorData(phat, FAT_LBA, fat_sector, &data, &cached_sector);
+		if (ret != PhatState_OK) return ret;
+		high_byte = &data[0];
 	}
+	if (cluster & 1)
+		*high_byte = (uint8_t)(write >> 4);
+	else
+		*high_byte = (*high_byte & 0xF0) | (uint8_t)(write >> 8);
+	return Phat_SetFATSectorModified(phat, fat_sector, cached_sector, flush);
 }
 
-PHAT_FUNC void Phat_CloseDir(Phat_DirInfo_p dir_info)
+static const Phat_FATCodec_t Phat_FAT12Codec =
 {
-	// Check parameters
-	if (!dir_info) return;
+	2, 0x0FF8, 0,
+	Phat_FAT12EntryOffset,
+	Phat_ReadFAT12,
+	Phat_WriteFAT12,
+};
+#endif
 
-	memset(dir_info, 0, sizeof * dir_info);
+#if PHAT_SUPPORT_FAT16
+PHAT_STATIC_FUNC LBA_t Phat_FAT16EntryOffset(Cluster_t cluster)
+{
+	return (LBA_t)cluster << 1;
 }
 
-PHAT_FUNC void Phat_OpenRootDir(Phat_p phat, Phat_DirInfo_p dir_info)
+PHAT_STATIC_FUNC PhatState Phat_ReadFAT16(Phat_p phat, Cluster_t cluster, Cluster_t *read_out)
 {
-	// Check parameters
-	if (!phat || !dir_info) return;
+	PhatState ret;
+	LBA_t fat_offset = Phat_FAT16EntryOffset(cluster);
+	Phat_SectorCache_p cached_sector;
+	uint8_t *data;
 
-	memset(dir_info, 0, sizeof * dir_info);
-	dir_info->phat = phat;
-	dir_info->dir_start_cluster = phat->root_dir_cluster;
-	dir_info->dir_current_cluster = phat->root_dir_cluster;
-	dir_info->dir_current_cluster_index = 0;
-	dir_info->cur_diritem = 0;
+	ret = Phat_GetFATSectorData(phat, phat->partition_start_LBA + phat->FAT1_start_LBA, fat_offset >> phat->bytes_per_sector_shift, &data, &cached_sector);
+	if (ret != PhatState_OK) return ret;
+	*read_out = *(uint16_t *)&data[fat_offset & (phat->bytes_per_sector - 1)];
+	return PhatState_OK;
 }
 
-PHAT_FUNC PhatState Phat_ChDir(Phat_DirInfo_p dir_info, const WChar_p dirname)
+PHAT_STATIC_FUNC PhatState Phat_WriteFAT16(Phat_p phat, LBA_t FAT_LBA, Cluster_t cluster, Cluster_t write, PhatBool_t flush)
 {
 	PhatState ret;
-	WChar_p dirname_ptr;
-	WChar_p end_of_dirname = NULL;
-	size_t dirname_len = 0;
+	LBA_t fat_offset = Phat_FAT16EntryOffset(cluster);
+	LBA_t fat_sector = fat_offset >> phat->bytes_per_sector_shift;
+	Phat_SectorCache_p cached_sector;
+	uint8_t *data;
 
-	if (!dir_info || !dirname) return PhatState_InvalidParameter;
+	ret = Phat_GetFATSectorData(phat, FAT_LBA, fat_sector, &data, &cached_sector);
+	if (ret != PhatState_OK) return ret;
+	*(uint16_t *)&data[fat_offset & (phat->bytes_per_sector - 1)] = (uint16_t)write;
+	return Phat_SetFATSectorModified(phat, fat_sector, cached_sector, flush);
+}
 
-	dirname_ptr = dirname;
-	dir_info->cur_diritem = 0;
+static const Phat_FATCodec_t Phat_FAT16Codec =
+{
+	2, 0xFFF8, 0x8000,
+	Phat_FAT16EntryOffset,
+	Phat_ReadFAT16,
+	Phat_WriteFAT16,
+};
+#endif
 
-	for (;;)
-	{
-		if (end_of_dirname == NULL)
-		{
-			end_of_dirname = dirname_ptr;
-			while (*end_of_dirname != 0 && *end_of_dirname != L'/' && *end_of_dirname != L'\\') end_of_dirname++;
-			dirname_len = (size_t)(end_of_dirname - dirname_ptr);
-			if (dirname_len == 0) return PhatState_InvalidParameter;
-		}
-		ret = Phat_NextDirItem(dir_info);
-		if (ret == PhatState_OK)
-		{
-			if (dirname_len == dir_info->LFN_length &&
-				!memcmp(dirname_ptr, dir_info->LFN_name, dirname_len * sizeof(WChar_t)))
-			{
-				Cluster_t dir_cluster;
-				if ((dir_info->attributes & ATTRIB_DIRECTORY) == 0) return PhatState_NotADirectory;
-				dir_cluster = dir_info->first_cluster;
-				if (dir_info->phat->FAT_bits == 32 && dir_cluster == 0) dir_cluster = 2;
-				dir_info->dir_start_cluster = dir_cluster;
-				dir_info->dir_current_cluster = dir_cluster;
-				dir_info->dir_current_cluster_index = 0;
-				dir_info->cur_diritem = 0;
-				if (*end_of_dirname == 0) return PhatState_OK;
-				end_of_dirname++;
-				while (*end_of_dirname == L'/' || *end_of_dirname == L'\\')end_of_dirname++;
-				dirname_ptr = end_of_dirname;
-				end_of_dirname = NULL;
-			}
-		}
-		else if (ret == PhatState_EndOfDirectory)
-		{
-			return PhatState_DirectoryNotFound;
-		}
-		else
-		{
-			return ret;
-		}
-	}
+#if PHAT_SUPPORT_FAT32
+PHAT_STATIC_FUNC LBA_t Phat_FAT32EntryOffset(Cluster_t cluster)
+{
+	return (LBA_t)cluster << 2;
 }
 
-PHAT_FUNC PhatState Phat_OpenDir(Phat_p phat, const WChar_p path, Phat_DirInfo_p dir_info)
+PHAT_STATIC_FUNC PhatState Phat_ReadFAT32(Phat_p phat, Cluster_t cluster, Cluster_t *read_out)
 {
-	WChar_p ptr;
-	if (!phat || !path || !dir_info) return PhatState_InvalidParameter;
-	ptr = path;
-	// Skip starting slash
-	while (*ptr == L'/' || *ptr == L'\\') ptr++;
-	Phat_OpenRootDir(phat, dir_info);
-	if (*ptr)
-		return Phat_ChDir(dir_info, ptr);
-	else
-		return PhatState_OK;
+	PhatState ret;
+	LBA_t fat_offset = Phat_FAT32EntryOffset(cluster);
+	Phat_SectorCache_p cached_sector;
+	uint8_t *data;
+
+	ret = Phat_GetFATSectorData(phat, phat->partition_start_LBA + phat->FAT1_start_LBA, fat_offset >> phat->bytes_per_sector_shift, &data, &cached_sector);
+	if (ret != PhatState_OK) return ret;
+	*read_out = *(uint32_t *)&data[fat_offset & (phat->bytes_per_sector - 1)];
+	return PhatState_OK;
 }
 
-// Open a dir to the path, find the item if can (`PhatState_OK` will be returned), or return `PhatState_EndOfDirectory`
-PHAT_STATIC_FUNC PhatState Phat_FindItem(Phat_p phat, WChar_p path, Phat_DirInfo_p dir_info, WChar_p *next_path)
+PHAT_STATIC_FUNC PhatState Phat_WriteFAT32(Phat_p phat, LBA_t FAT_LBA, Cluster_t cluster, Cluster_t write, PhatBool_t flush)
 {
 	PhatState ret;
-	WChar_p dirname_ptr;
-	WChar_p end_of_dirname = NULL;
-	size_t dirname_len = 0;
+	LBA_t fat_offset = Phat_FAT32EntryOffset(cluster);
+	LBA_t fat_sector = fat_offset >> phat->bytes_per_sector_shift;
+	Phat_SectorCache_p cached_sector;
+	uint8_t *data;
 
-	if (!path) return PhatState_InvalidParameter;
+	ret = Phat_GetFATSectorData(phat, FAT_LBA, fat_sector, &data, &cached_sector);
+	if (ret != PhatState_OK) return ret;
+	*(uint32_t *)&data[fat_offset & (phat->bytes_per_sector - 1)] = write;
+	return Phat_SetFATSectorModified(phat, fat_sector, cached_sector, flush);
+}
 
-	if (phat->FAT_bits == 32 && dir_info->dir_current_cluster < 2) Phat_OpenRootDir(phat, dir_info);
+static const Phat_FATCodec_t Phat_FAT32Codec =
+{
+	4, 0x0FFFFFF8, 0x08000000,
+	Phat_FAT32EntryOffset,
+	Phat_ReadFAT32,
+	Phat_WriteFAT32,
+};
+#endif
 
-	dirname_ptr = path;
-	dir_info->cur_diritem = 0;
+// Pick the FAT entry accessors by `phat->FAT_bits`, `phat->bytes_per_sector` must be set before calling this
+PHAT_STATIC_FUNC PhatState Phat_InstallFATCodec(Phat_p phat)
+{
+	uint8_t shift;
 
-	for (;;)
+	switch (phat->FAT_bits)
 	{
-		if (end_of_dirname == NULL)
-		{
-			if (next_path) *next_path = dirname_ptr;
-			end_of_dirname = dirname_ptr;
-			while (*end_of_dirname != 0 && *end_of_dirname != L'/' && *end_of_dirname != L'\\') end_of_dirname++;
-			dirname_len = (size_t)(end_of_dirname - dirname_ptr);
-			if (dirname_len == 0) return PhatState_InvalidParameter;
-		}
-		ret = Phat_NextDirItem(dir_info);
-		if (ret == PhatState_OK)
-		{
-			if (dirname_len == dir_info->LFN_length &&
-				!memcmp(dirname_ptr, dir_info->LFN_name, dirname_len * sizeof(WChar_t)))
-			{
-				Cluster_t dir_cluster;
-				if (*end_of_dirname == 0)
-				{
-					// Point to the found item's SLN entry
-					dir_info->cur_diritem--;
-					return PhatState_OK;
-				}
-				if ((dir_info->attributes & ATTRIB_DIRECTORY) == 0) return PhatState_NotADirectory;
-				end_of_dirname++;
-				while (*end_of_dirname == L'/' || *end_of_dirname == L'\\')end_of_dirname++;
-				dirname_ptr = end_of_dirname;
-				dir_cluster = dir_info->first_cluster;
-				dir_info->dir_start_cluster = dir_cluster;
-				dir_info->dir_current_cluster = dir_cluster;
-				dir_info->dir_current_cluster_index = 0;
-				dir_info->cur_diritem = 0;
-				end_of_dirname = NULL;
-			}
-		}
-		else if (ret == PhatState_EndOfDirectory)
-		{
-			if (*end_of_dirname == 0) return ret;
-			return PhatState_DirectoryNotFound;
-		}
-		else
-		{
-			return ret;
-		}
+#if PHAT_SUPPORT_FAT12
+	case 12: phat->FAT_codec = &Phat_FAT12Codec; break;
+#endif
+#if PHAT_SUPPORT_FAT16
+	case 16: phat->FAT_codec = &Phat_FAT16Codec; break;
+#endif
+#if PHAT_SUPPORT_FAT32
+	case 32: phat->FAT_codec = &Phat_FAT32Codec; break;
+#endif
+	default: return PhatState_FATTypeNotSupported;
 	}
+	for (shift = 0; ((uint32_t)1 << shift) < phat->bytes_per_sector; shift++);
+	if (((uint32_t)1 << shift) != phat->bytes_per_sector) return PhatState_FSError;
+	phat->bytes_per_sector_shift = shift;
+	phat->end_of_cluster_chain = phat->FAT_codec->end_of_cluster_chain;
+	return PhatState_OK;
 }
 
-PHAT_FUNC PhatBool_t Phat_IsValidFilename(WChar_p filename)
+// Read FAT table by `cluster` starting from 0
+PHAT_STATIC_FUNC PhatState Phat_ReadFAT(Phat_p phat, Cluster_t cluster, Cluster_t *read_out)
 {
-	// Check parameters
-	if (!filename) return PhatState_InvalidParameter;
+	return phat->FAT_codec->read(phat, cluster, read_out);
+}
 
-	size_t length = 0;
-	while (filename[length]) length++;
-	if (length == 0 || length > MAX_LFN) return 0;
-	for (size_t i = 0; i < length; i++)
+// Write FAT table by `cluster` starting from 0
+PHAT_STATIC_FUNC PhatState Phat_WriteFAT(Phat_p phat, Cluster_t cluster, Cluster_t write, PhatBool_t flush)
+{
+	PhatState ret = PhatState_OK;
+	const Phat_FATCodec_t *codec = phat->FAT_codec;
+	LBA_t FAT_LBA = phat->partition_start_LBA + phat->FAT1_start_LBA;
+
+	// The resident FAT window is copied to the other FATs when it's written back
+	if (Phat_IsFATEntryResident(phat, cluster)) return codec->write(phat, FAT_LBA, cluster, write, flush);
+
+	for (LBA_t i = 0; i < phat->num_FATs; i++)
 	{
-		WChar_t ch = filename[i];
-		if (ch == L'\"' || ch == L'*' || ch == L'/' || ch == L':' ||
-			ch == L'<' || ch == L'>' || ch == L'?' || ch == L'\\' ||
-			ch == L'|' || ch < 0x0020)
+		ret = codec->write(phat, FAT_LBA, cluster, write, flush);
+		if (ret != PhatState_OK) return ret;
+		if (!phat->FATs_are_same) break;
+		if (phat->FAT_mirror_deferred)
 		{
-			return 0;
+			PhatBool_t FATs_were_synced = !phat->num_FAT_mirror_ranges;
+			LBA_t fat_offset = codec->entry_offset(cluster);
+			Phat_AddFATMirrorRange(phat, fat_offset >> phat->bytes_per_sector_shift);
+			Phat_AddFATMirrorRange(phat, (fat_offset + codec->entry_size - 1) >> phat->bytes_per_sector_shift);
+			if (FATs_were_synced)
+			{
+				ret = Phat_MarkDirty(phat, 1, 1);
+				if (ret != PhatState_OK) return ret;
+			}
+			break;
 		}
+		FAT_LBA += phat->FAT_size_in_sectors;
 	}
-	if (length == 1 && filename[0] == L'.') return 0;
-	if (length == 2 && filename[0] == L'.' && filename[1] == L'.') return 0;
-	return 1;
+	return PhatState_OK;
 }
 
-PHAT_STATIC_FUNC PhatBool_t Phat_IsFit83(WChar_p filename, uint8_t *sfn83, uint8_t *case_info)
+// A freed cluster could still have sectors in the cache from when it belonged to a directory, drop them without writing back.
+// This keeps the sectors of files out of the cache, so file data can go to the driver directly.
+// The pages of the data cache are dropped too, a freed cluster could become a directory.
+PHAT_STATIC_FUNC void Phat_DiscardCachedCluster(Phat_p phat, Cluster_t cluster)
 {
-	PhatBool_t bn_has_lower = 0;
-	PhatBool_t bn_has_upper = 0;
-	PhatBool_t ext_has_lower = 0;
-	PhatBool_t ext_has_upper = 0;
-	int length = 0;
-	int dot = -1;
-	while (filename[length]) length++;
-	if (length == 0 || length > 11) return 0;
-	for (int i = 0; i < length; i++)
-	{
-		WChar_t ch = filename[i];
-		if (ch == ' ') return 0;
-		if (ch >= L'A' && ch <= L'Z')
-		{
-			if (i < 8) bn_has_upper = 1;
-			else ext_has_upper = 1;
-		}
-		else if (ch >= L'a' && ch <= L'z')
-		{
-			if (i < 8) bn_has_lower = 1;
-			else ext_has_lower = 1;
-		}
-		else if (ch == L'.')
-		{
-			dot = i;
-			if (i > 8) return 0;
-			if ((length - dot) > 4) return 0;
-		}
-		else if (ch >= 128) return 0;
-		if (bn_has_upper && bn_has_lower) return 0;
-		if (ext_has_upper && ext_has_lower) return 0;
-	}
-	if (dot < 0 && length > 8) return 0;
-	memset(sfn83, ' ', 11);
-	*case_info = 0;
-	if (bn_has_lower) *case_info |= CI_BASENAME_IS_LOWER;
-	if (ext_has_lower) *case_info |= CI_EXTENSION_IS_LOWER;
-	if (dot < 0)
+	LBA_t cluster_LBA;
+
+	if (cluster < 2) return;
+	cluster_LBA = Phat_ClusterToLBA(phat, cluster) + phat->partition_start_LBA;
+	for (size_t i = 0; i < PHAT_CACHED_SECTORS; i++)
 	{
-		for(int i = 0; i < length; i++) sfn83[i] = (uint8_t)toupper(filename[i]);
+		Phat_SectorCache_p cached_sector = &phat->cache[i];
+		if (Phat_IsCachedSectorValid(cached_sector) && cached_sector->LBA >= cluster_LBA && cached_sector->LBA < cluster_LBA + phat->sectors_per_cluster)
+			cached_sector->usage &= ~SECTORCACHE_VALID;
 	}
-	else
+	for (size_t i = 0; i < phat->num_data_pages; i++)
 	{
-		for(int i = 0; i < dot; i++) sfn83[i] = (uint8_t)toupper(filename[i]);
-		for(int i = dot + 1; i < length; i++) sfn83[8 + (i - (dot + 1))] = (uint8_t)toupper(filename[i]);
+		Phat_DataPage_p page = &phat->data_pages[i];
+		if (page->LBA >= cluster_LBA && page->LBA < cluster_LBA + phat->sectors_per_cluster)
+			page->usage = 0;
 	}
-	return 1;
 }
 
-PHAT_STATIC_FUNC PhatState Phat_FindShortFileName(Phat_DirInfo_p dir_info, const uint8_t *sfn83, PhatBool_p found)
+// Copy a modified sector of the first FAT to the other FATs, or remember it for the deferred mirroring
+PHAT_STATIC_FUNC PhatState Phat_MirrorFATSector(Phat_p phat, LBA_t FAT_sector, const uint8_t *data)
 {
 	PhatState ret;
+	LBA_t FAT_LBA = phat->partition_start_LBA + phat->FAT1_start_LBA;
+	Phat_SectorCache_p cached_sector;
+	uint8_t *mirror_data;
 
-	*found = 0;
-	dir_info->cur_diritem = 0;
-	for (;;)
+	if (!phat->FATs_are_same) return PhatState_OK;
+	if (phat->FAT_mirror_deferred)
 	{
-		ret = Phat_NextDirItem(dir_info);
-		if (ret == PhatState_EndOfDirectory)
-		{
-			return PhatState_OK;
-		}
-		else if (ret != PhatState_OK)
-		{
-			return ret;
-		}
-		if (!memcmp(dir_info->file_name_8_3, sfn83, 11))
-		{
-			*found = 1;
-			return PhatState_OK;
-		}
+		PhatBool_t FATs_were_synced = !phat->num_FAT_mirror_ranges;
+		Phat_AddFATMirrorRange(phat, FAT_sector);
+		if (FATs_were_synced) return Phat_MarkDirty(phat, 1, 1);
+		return PhatState_OK;
+	}
+
+	// Loading the mirror sectors could evict the sector of the first FAT
+	memcpy(phat->FAT_buffer, data, 512);
+	for (LBA_t i = 1; i < phat->num_FATs; i++)
+	{
+		FAT_LBA += phat->FAT_size_in_sectors;
+		ret = Phat_GetFATSectorData(phat, FAT_LBA, FAT_sector, &mirror_data, &cached_sector);
+		if (ret != PhatState_OK) return ret;
+		memcpy(mirror_data, phat->FAT_buffer, 512);
+		Phat_SetCachedSectorModified(cached_sector);
 	}
+	return PhatState_OK;
 }
 
-PHAT_STATIC_FUNC PhatState Phat_Gen83NameForLongFilename(Phat_DirInfo_p dir_info, const WChar_p longname, uint8_t *sfn83)
+// Free the cluster chain from `cluster`.
+// The FAT16/32 entries of the chain that share a FAT sector are freed together and the sector is mirrored once,
+// FAT12 entries could straddle two sectors and are freed one by one.
+PHAT_STATIC_FUNC PhatState Phat_UnlinkCluster(Phat_p phat, Cluster_t cluster)
 {
-	PhatBool_t found = 0;
 	PhatState ret;
-	WChar_p ext;
+	const Phat_FATCodec_t *codec = phat->FAT_codec;
+	LBA_t FAT_LBA = phat->partition_start_LBA + phat->FAT1_start_LBA;
+	Cluster_t next_sector;
+	Cluster_t end_of_chain = phat->end_of_cluster_chain;
 
-	memset(sfn83, 0x20, 11);
+	// An empty file has no chain, cluster 0 and 1 are the reserved entries
+	if (cluster < 2 || cluster > phat->max_valid_cluster) return PhatState_InvalidParameter;
 
-	// Find extension name
-	ext = Phat_ToEndOfString(longname);
-	while (ext > longname)
+	// The remembered positions could be in the freed clusters
+	memset(phat->chain_hints, 0, sizeof phat->chain_hints);
+	if (phat->FAT_bits == 12)
 	{
-		ext--;
-		if (*ext == L'.')
+		for (;;)
 		{
-			ext++;
-			break;
+			if (cluster < phat->next_free_cluster) phat->next_free_cluster = cluster;
+			ret = Phat_ReadFAT(phat, cluster, &next_sector);
+			if (ret != PhatState_OK) return ret;
+			ret = Phat_WriteFAT(phat, cluster, 0, 0);
+			if (ret != PhatState_OK) return ret;
+			Phat_DiscardCachedCluster(phat, cluster);
+			phat->free_clusters++;
+			phat->FSInfo_modified = 1;
+			if (next_sector >= end_of_chain) break;
+			if (next_sector < 2 || next_sector > phat->max_valid_cluster) return PhatState_FATError;
+			cluster = next_sector;
 		}
+		return PhatState_OK;
 	}
-	if (ext == longname)
+
+	for (;;)
 	{
-		// No extension name
-		for (size_t i = 0; i < 8 && longname[i]; i++)
+		LBA_t FAT_sector = codec->entry_offset(cluster) >> phat->bytes_per_sector_shift;
+		PhatState chain_state = PhatState_OK;
+		Phat_SectorCache_p cached_sector;
+		uint8_t *data;
+
+		ret = Phat_GetFATSectorData(phat, FAT_LBA, FAT_sector, &data, &cached_sector);
+		if (ret != PhatState_OK) return ret;
+		for (;;)
 		{
-			WChar_t ch = (WChar_t)toupper(longname[i]);
-			if (ch == '.') ch = '_';
-			sfn83[i] = (uint8_t)ch;
-		}
-	}
-	else
-	{
-		size_t end = ext - longname;
-		if (end > 8) end = 8;
-		for (size_t i = 0; i < end && longname[i]; i++)
-		{
-			WChar_t ch = (WChar_t)toupper(longname[i]);
-			if (ch == '.') ch = '_';
-			sfn83[i] = (uint8_t)ch;
+			size_t offset = codec->entry_offset(cluster) & (phat->bytes_per_sector - 1);
+			if (codec->entry_size == 2)
+			{
+				next_sector = *(uint16_t *)&data[offset];
+				*(uint16_t *)&data[offset] = 0;
+			}
+			else
+			{
+				next_sector = *(uint32_t *)&data[offset];
+				*(uint32_t *)&data[offset] = 0;
+			}
+			if (cluster < phat->next_free_cluster) phat->next_free_cluster = cluster;
+			Phat_DiscardCachedCluster(phat, cluster);
+			phat->free_clusters++;
+			if (next_sector >= end_of_chain)
+			{
+				chain_state = PhatState_EndOfFATChain;
+				break;
+			}
+			if (next_sector < 2 || next_sector > phat->max_valid_cluster)
+			{
+				chain_state = PhatState_FATError;
+				break;
+			}
+			cluster = next_sector;
+			if (codec->entry_offset(cluster) >> phat->bytes_per_sector_shift != FAT_sector) break;
 		}
-		for (size_t i = 0; i < 3 && ext[i]; i++)
+		phat->FSInfo_modified = 1;
+		ret = Phat_SetFATSectorModified(phat, FAT_sector, cached_sector, 0);
+		if (ret != PhatState_OK) return ret;
+
+		// The resident FAT window is copied to the other FATs when it's written back
+		if (cached_sector)
 		{
-			WChar_t ch = (WChar_t)toupper(ext[i]);
-			sfn83[8 + i] = (uint8_t)ch;
+			ret = Phat_MirrorFATSector(phat, FAT_sector, data);
+			if (ret != PhatState_OK) return ret;
 		}
+		if (chain_state == PhatState_EndOfFATChain) break;
+		if (chain_state != PhatState_OK) return chain_state;
 	}
-	if (sfn83[0] == ' ')
-	{
-		memcpy(sfn83, "NONAME", 6);
-	}
+	return PhatState_OK;
+}
 
-	for (uint32_t index = 1;;)
+// Find a run of up to `max_length` free clusters. The run starting at `hint` is preferred to keep a chain contiguous,
+// otherwise the first free run after `next_free_cluster` is taken, so a fragmented volume is scanned only once
+// by the extents of one allocation instead of once per extent.
+PHAT_STATIC_FUNC PhatState Phat_FindFreeExtent(Phat_p phat, Cluster_t hint, Cluster_t max_length, Cluster_t *start_out, Cluster_t *length_out)
+{
+	PhatState ret;
+	Cluster_t value;
+	Cluster_t cluster;
+	Cluster_t run_length = 0;
+	Cluster_t i;
+
+	if (!max_length) return PhatState_InvalidParameter;
+	if (hint >= 2 && hint <= phat->max_valid_cluster)
 	{
-		ret = Phat_FindShortFileName(dir_info, sfn83, &found);
+		ret = Phat_ReadFAT(phat, hint, &value);
 		if (ret != PhatState_OK) return ret;
-		if (!found) return PhatState_OK;
-		if (index < 10)
-		{
-			sfn83[6] = '~';
-			sfn83[7] = '0' + (uint8_t)index;
-			index++;
-		}
-		else if (index < 100)
-		{
-			sfn83[5] = '~';
-			sfn83[6] = '0' + (uint8_t)(index / 10);
-			sfn83[7] = '0' + (uint8_t)(index % 10);
-			index++;
-		}
-		else if (index < 1000)
-		{
-			sfn83[4] = '~';
-			sfn83[5] = '0' + (uint8_t)(index / 100);
-			sfn83[6] = '0' + (uint8_t)((index / 10) % 10);
-			sfn83[7] = '0' + (uint8_t)(index % 10);
-			index++;
-		}
-		else if (index < 10000)
-		{
-			sfn83[3] = '~';
-			sfn83[4] = '0' + (uint8_t)(index / 1000);
-			sfn83[5] = '0' + (uint8_t)((index / 100) % 10);
-			sfn83[6] = '0' + (uint8_t)((index / 10) % 10);
-			sfn83[7] = '0' + (uint8_t)(index % 10);
-			index++;
-		}
-		else if (index < 100000)
-		{
-			sfn83[2] = '~';
-			sfn83[3] = '0' + (uint8_t)(index / 10000);
-			sfn83[4] = '0' + (uint8_t)((index / 1000) % 10);
-			sfn83[5] = '0' + (uint8_t)((index / 100) % 10);
-			sfn83[6] = '0' + (uint8_t)((index / 10) % 10);
-			sfn83[7] = '0' + (uint8_t)(index % 10);
-			index++;
-		}
-		else if (index < 1000000)
-		{
-			sfn83[1] = '~';
-			sfn83[2] = '0' + (uint8_t)(index / 100000);
-			sfn83[3] = '0' + (uint8_t)((index / 10000) % 10);
-			sfn83[4] = '0' + (uint8_t)((index / 1000) % 10);
-			sfn83[5] = '0' + (uint8_t)((index / 100) % 10);
-			sfn83[6] = '0' + (uint8_t)((index / 10) % 10);
-			sfn83[7] = '0' + (uint8_t)(index % 10);
-			index++;
-		}
-		else
+		if (!value)
 		{
-			return PhatState_FSError;
+			for (run_length = 1; run_length < max_length && hint + run_length <= phat->max_valid_cluster; run_length++)
+			{
+				ret = Phat_ReadFAT(phat, hint + run_length, &value);
+				if (ret != PhatState_OK) return ret;
+				if (value) break;
+			}
+			*start_out = hint;
+			*length_out = run_length;
+			return PhatState_OK;
 		}
 	}
-}
-
-PHAT_STATIC_FUNC PhatState Phat_CreateNewItemInDir(Phat_DirInfo_p dir_info, const WChar_p itemname, uint8_t attrib)
-{
-	PhatState ret = PhatState_OK;
-	uint8_t name83[11];
-	uint8_t case_info = 0;
-	uint8_t items_needed;
-	uint8_t free_count;
-	Cluster_t first_diritem = 0;
-	Cluster_t first_cluster = 0;
-	size_t itemname_len;
-	int only83 = 0;
-	Phat_DirItem_t dir_item;
-	Phat_p phat = dir_info->phat;
-
-	itemname_len = Phat_Wcslen(itemname);
-	if (itemname_len > MAX_LFN) return PhatState_NameTooLong;
-	if (!Phat_IsValidFilename(itemname)) return PhatState_BadFileName;
 
-	ret = Phat_FindItem(phat, itemname, dir_info, NULL);
-	switch (ret)
+	// Walk through the FAT from `next_free_cluster`, wrapping around, until the first free cluster
+	cluster = phat->next_free_cluster;
+	if (cluster < 2 || cluster > phat->max_valid_cluster) cluster = 2;
+	for (i = 2; i <= phat->max_valid_cluster; i++)
 	{
-	case PhatState_OK:
-		if (dir_info->attributes & ATTRIB_DIRECTORY)
-			return PhatState_DirectoryAlreadyExists;
-		else
-			return PhatState_FileAlreadyExists;
-	case PhatState_EndOfDirectory:
-		break;
-	default:
-		return ret;
+		ret = Phat_ReadFAT(phat, cluster, &value);
+		if (ret != PhatState_OK) return ret;
+		if (!value) break;
+		if (++cluster > phat->max_valid_cluster) cluster = 2;
 	}
+	if (i > phat->max_valid_cluster) return PhatState_NotEnoughSpace;
 
-	if (itemname_len <= 11 && Phat_IsFit83(itemname, name83, &case_info))
+	// Every cluster that was skipped is in use, the next search can start from here
+	phat->next_free_cluster = cluster;
+	for (run_length = 1; run_length < max_length && cluster + run_length <= phat->max_valid_cluster; run_length++)
 	{
-		only83 = 1;
-		items_needed = 1;
+		ret = Phat_ReadFAT(phat, cluster + run_length, &value);
+		if (ret != PhatState_OK) return ret;
+		if (value) break;
 	}
-	else
+	*start_out = cluster;
+	*length_out = run_length;
+	return PhatState_OK;
+}
+
+// Allocate a contiguous run of up to `max_length` clusters and link them as a chain, `hint` is the preferred first cluster
+PHAT_STATIC_FUNC PhatState Phat_AllocateExtent(Phat_p phat, Cluster_t hint, Cluster_t max_length, Cluster_t *first_cluster, Cluster_t *length_out)
+{
+	PhatState ret;
+	Cluster_t start;
+	Cluster_t length;
+
+	ret = Phat_FindFreeExtent(phat, hint, max_length, &start, &length);
+	if (ret != PhatState_OK) return ret;
+	for (Cluster_t i = 0; i < length; i++)
 	{
-		ret = Phat_Gen83NameForLongFilename(dir_info, itemname, name83);
+		ret = Phat_WriteFAT(phat, start + i, i + 1 < length ? start + i + 1 : phat->end_of_cluster_chain, 0);
 		if (ret != PhatState_OK) return ret;
-		items_needed = (uint8_t)(1 + ((itemname_len + 12) / 13));
 	}
+	if (phat->free_clusters >= length)
+		phat->free_clusters -= length;
+	else
+		phat->free_clusters = 0;
+
+	// `next_free_cluster` is only a hint of where to start searching, it doesn't need to point to a free cluster
+	if (phat->next_free_cluster >= start && phat->next_free_cluster < start + length)
+		phat->next_free_cluster = start + length > phat->max_valid_cluster ? 2 : start + length;
+	phat->FSInfo_modified = 1;
+	*first_cluster = start;
+	*length_out = length;
+	return PhatState_OK;
+}
 
-	dir_info->cur_diritem = 0;
-	for (;;)
+// Allocate `num_clusters` clusters in as few contiguous runs as possible and append them to the chain ending at `last_cluster`.
+// Pass 0 as `last_cluster` to start a new chain. On failure, nothing stays allocated and the chain is left as it was.
+PHAT_STATIC_FUNC PhatState Phat_AllocateClusters(Phat_p phat, Cluster_t last_cluster, Cluster_t num_clusters, Cluster_t *first_cluster)
+{
+	PhatState ret = PhatState_OK;
+	Cluster_t first = 0;
+	Cluster_t tail = last_cluster;
+	Cluster_t start;
+	Cluster_t length;
+
+	if (!num_clusters) return PhatState_InvalidParameter;
+	while (num_clusters)
 	{
-		free_count = 0;
-		ret = Phat_GetDirItem(dir_info, &dir_item);
-		if (ret != PhatState_OK) return ret;
-		if (dir_item.file_name_8_3[0] == 0x00 || dir_item.file_name_8_3[0] == 0xE5)
+		ret = Phat_AllocateExtent(phat, tail >= 2 ? tail + 1 : 0, num_clusters, &start, &length);
+		if (ret != PhatState_OK) goto FailExit;
+		if (tail >= 2)
 		{
-			first_diritem = dir_info->cur_diritem;
-			free_count = 1;
-			ret = Phat_MoveToNextDirItemWithAllocation(dir_info);
-			if (ret != PhatState_OK) return ret;
-			while (free_count < items_needed)
+			ret = Phat_WriteFAT(phat, tail, start, 0);
+			if (ret != PhatState_OK)
 			{
-				ret = Phat_GetDirItem(dir_info, &dir_item);
-				if (ret != PhatState_OK) return ret;
-				if (dir_item.file_name_8_3[0] == 0x00 || dir_item.file_name_8_3[0] == 0xE5)
-				{
-					free_count++;
-					if (free_count == items_needed)
-						break;
-					ret = Phat_MoveToNextDirItemWithAllocation(dir_info);
-					if (ret != PhatState_OK) return ret;
-				}
-				else
-				{
-					break;
-				}
+				Phat_UnlinkCluster(phat, start);
+				goto FailExit;
 			}
-			if (free_count == items_needed)
-				break;
-		}
-		else
-		{
-			ret = Phat_MoveToNextDirItemWithAllocation(dir_info);
-			if (ret != PhatState_OK) return ret;
 		}
-		if (free_count == items_needed)
-			break;
+		if (!first) first = start;
+		tail = start + length - 1;
+		num_clusters -= length;
 	}
-	dir_info->cur_diritem = first_diritem;
-	ret = Phat_UpdateClusterByDirItemIndex(dir_info, 1);
-	if (ret != PhatState_OK) return ret;
-	if (attrib & ATTRIB_DIRECTORY)
+	*first_cluster = first;
+	return PhatState_OK;
+FailExit:
+	if (first)
 	{
-		Phat_SectorCache_p cached_sector = NULL;
-		Phat_DirItem_p dir_items;
-		Cluster_t dir_start_cluster = dir_info->dir_start_cluster;
-		if (dir_start_cluster == phat->root_dir_cluster) dir_start_cluster = 0;
-		ret = Phat_AllocateCluster(phat, &first_cluster);
-		if (ret != PhatState_OK) return ret;
-		ret = Phat_WipeCluster(phat, first_cluster);
-		if (ret != PhatState_OK) return ret;
-		ret = Phat_ReadSectorThroughCache(phat, Phat_ClusterToLBA(phat, first_cluster) + phat->partition_start_LBA, &cached_sector);
-		if (ret != PhatState_OK) return ret;
-		dir_items = (Phat_DirItem_p)cached_sector->data;
-		memcpy(dir_items[0].file_name_8_3, ".          ", 11);
-		dir_items[0].attributes = ATTRIB_DIRECTORY;
-		dir_items[0].case_info = 0;
-		dir_items[0].creation_time_tenths = 0;
-		dir_items[0].creation_time = Phat_EncodeTime(&phat->cur_time);
-		dir_items[0].creation_date = Phat_EncodeDate(&phat->cur_date);
-		dir_items[0].last_access_date = Phat_EncodeDate(&phat->cur_date);
-		dir_items[0].first_cluster_high = first_cluster >> 16;
-		dir_items[0].last_modification_time = Phat_EncodeTime(&phat->cur_time);
-		dir_items[0].last_modification_date = Phat_EncodeDate(&phat->cur_date);
-		dir_items[0].first_cluster_low = first_cluster & 0xFFFF;
-		dir_items[0].file_size = 0;
-		memcpy(dir_items[1].file_name_8_3, "..         ", 11);
-		dir_items[1].attributes = ATTRIB_DIRECTORY;
-		dir_items[1].case_info = 0;
-		dir_items[1].creation_time_tenths = 0;
-		dir_items[1].creation_time = Phat_EncodeTime(&phat->cur_time);
-		dir_items[1].creation_date = Phat_EncodeDate(&phat->cur_date);
-		dir_items[1].last_access_date = Phat_EncodeDate(&phat->cur_date);
-		dir_items[1].first_cluster_high = dir_start_cluster >> 16;
-		dir_items[1].last_modification_time = Phat_EncodeTime(&phat->cur_time);
-		dir_items[1].last_modification_date = Phat_EncodeDate(&phat->cur_date);
-		dir_items[1].first_cluster_low = dir_start_cluster & 0xFFFF;
-		dir_items[1].file_size = 0;
-		Phat_SetCachedSectorModified(cached_sector);
+		if (last_cluster >= 2) Phat_WriteFAT(phat, last_cluster, phat->end_of_cluster_chain, 0);
+		Phat_UnlinkCluster(phat, first);
 	}
-	if (!only83)
+	return ret;
+}
+
+// `allocated_cluster` could point to a valid cluster that you wish to allocate
+PHAT_STATIC_FUNC PhatState Phat_AllocateCluster(Phat_p phat, Cluster_t *allocated_cluster)
+{
+	Cluster_t length;
+	return Phat_AllocateExtent(phat, *allocated_cluster, 1, allocated_cluster, &length);
+}
+
+// The `cur_cluster` is not an index, it's a cluster number.
+PHAT_STATIC_FUNC PhatState Phat_GetFATNextCluster(Phat_p phat, Cluster_t cur_cluster, Cluster_t *next_cluster)
+{
+	PhatState ret = PhatState_OK;
+	Cluster_t cluster_number;
+	if (cur_cluster < 2) return PhatState_InvalidParameter;
+	if (cur_cluster > phat->max_valid_cluster) return PhatState_InvalidParameter;
+	ret = Phat_ReadFAT(phat, cur_cluster, &cluster_number);
+	if (ret != PhatState_OK) return ret;
+	if (cluster_number >= phat->end_of_cluster_chain) return PhatState_EndOfFATChain;
+	if (cluster_number > phat->max_valid_cluster) return PhatState_FATError;
+	if (cluster_number < 2) return PhatState_FATError;
+	*next_cluster = cluster_number;
+	return PhatState_OK;
+}
+
+PHAT_STATIC_FUNC Phat_Time_t Phat_ParseTime(uint16_t time, uint8_t tenths)
+{
+	Phat_Time_t t =
+	{
+		(time >> 11) & 0x1F,
+		(time >> 5) & 0x3F,
+		(time & 0x1F) * 2,
+		(tenths & 0x3F) * 10,
+	};
+	return t;
+}
+
+PHAT_STATIC_FUNC Phat_Date_t Phat_ParseDate(uint16_t date)
+{
+	Phat_Date_t d =
+	{
+		((date >> 9) & 0x7F) + 1980,
+		(date >> 5) & 0x0F,
+		date & 0x1F,
+	};
+	return d;
+}
+
+PHAT_STATIC_FUNC uint16_t Phat_EncodeTime(Phat_Time_p time)
+{
+	uint16_t raw_time = 0;
+	if (time->hours > 23) time->hours = 23;
+	if (time->minutes > 59) time->minutes = 59;
+	if (time->seconds > 59) time->seconds = 59;
+	raw_time |= (time->hours & 0x1F) << 11;
+	raw_time |= (time->minutes & 0x3F) << 5;
+	raw_time |= (time->seconds / 2) & 0x1F;
+	return raw_time;
+}
+
+PHAT_STATIC_FUNC uint16_t Phat_EncodeDate(Phat_Date_p date)
+{
+	uint16_t raw_date = 0;
+	if (date->year < 1980) date->year = 1980;
+	if (date->year > 2107) date->year = 2107;
+	if (date->month < 1) date->month = 1;
+	if (date->month > 12) date->month = 12;
+	if (date->day < 1) date->day = 1;
+	if (date->day > 31) date->day = 31;
+	raw_date |= ((date->year - 1980) & 0x7F) << 9;
+	raw_date |= (date->month & 0x0F) << 5;
+	raw_date |= date->day & 0x1F;
+	return raw_date;
+}
+
+PHAT_STATIC_FUNC uint8_t Phat_LFN_ChkSum(uint8_t *file_name_8_3)
+{
+	uint8_t sum = 0;
+	for (int i = 0; i < 11; i++) sum = ((sum & 1) ? 0x80 : 0) + (sum >> 1) + *file_name_8_3++;
+	return sum;
+}
+
+PHAT_STATIC_FUNC PhatState Phat_UpdateClusterByDirItemIndex(Phat_DirInfo_p dir_info, PhatBool_t allocate_new_sectors)
+{
+	PhatState ret = PhatState_OK;
+	Phat_p phat = dir_info->phat;
+	Cluster_t cluster_index;
+	Cluster_t next_cluster;
+	Cluster_t end_of_chain_index = (Cluster_t)-1;
+
+	if (phat->FAT_bits != 32)
+	{
+		if (dir_info->dir_start_cluster == 0)
+		{
+			// For root dir, no cluster need to be updated
+			if (dir_info->cur_diritem >= phat->root_dir_entry_count) return PhatState_EndOfDirectory;
+			return PhatState_OK;
+		}
+	}
+	else
+	{
+		if (dir_info->dir_start_cluster < 2) return PhatState_InvalidParameter;
+	}
+	cluster_index = dir_info->cur_diritem / phat->num_diritems_in_a_cluster;
+	if (dir_info->dir_current_cluster_index > cluster_index)
+	{
+		dir_info->dir_current_cluster_index = 0;
+		dir_info->dir_current_cluster = dir_info->dir_start_cluster;
+	}
+	while (dir_info->dir_current_cluster_index < cluster_index)
+	{
+		if (dir_info->dir_current_cluster < 2) return PhatState_InternalError;
+		ret = Phat_GetFATNextCluster(phat, dir_info->dir_current_cluster, &next_cluster);
+		if (ret == PhatState_EndOfFATChain)
+		{
+			if (!allocate_new_sectors) return PhatState_EndOfDirectory;
+			// Allocate all of the clusters needed to reach `cluster_index` at once
+			ret = Phat_AllocateClusters(phat, dir_info->dir_current_cluster, cluster_index - dir_info->dir_current_cluster_index, &next_cluster);
+			if (ret != PhatState_OK) return ret;
+			end_of_chain_index = dir_info->dir_current_cluster_index;
+		}
+		else if (ret != PhatState_OK)
+			return ret;
+		if (next_cluster > phat->max_valid_cluster) return PhatState_FATError;
+		dir_info->dir_current_cluster_index++;
+		dir_info->dir_current_cluster = next_cluster;
+		if (dir_info->dir_current_cluster_index > end_of_chain_index)
+		{
+			ret = Phat_WipeCluster(phat, next_cluster);
+			if (ret != PhatState_OK) return ret;
+		}
+	}
+	return PhatState_OK;
+}
+
+// Get the cached sector that holds the entry `dir_info` is at, and the entry inside it
+PHAT_STATIC_FUNC PhatState Phat_GetDirItemSector(Phat_DirInfo_p dir_info, Phat_SectorCache_p *cached_sector_out, Phat_DirItem_p *dir_item_out)
+{
+	PhatState ret = PhatState_OK;
+	LBA_t dir_sector_LBA;
+	uint8_t item_index_in_sector;
+	Phat_p phat = dir_info->phat;
+	uint16_t cur_diritem_in_cur_cluster;
+
+	if (!phat->num_diritems_in_a_cluster) return PhatState_InternalError;
+	cur_diritem_in_cur_cluster = dir_info->cur_diritem % phat->num_diritems_in_a_cluster;
+	if (phat->FAT_bits == 32)
+	{
+		if (dir_info->dir_start_cluster == 0) return PhatState_EndOfDirectory;
+		ret = Phat_UpdateClusterByDirItemIndex(dir_info, 0);
+		if (ret != PhatState_OK) return ret;
+		dir_sector_LBA = Phat_ClusterToLBA(phat, dir_info->dir_current_cluster) + cur_diritem_in_cur_cluster / phat->num_diritems_in_a_sector;
+	}
+	else // Root directory in FAT12/16
+	{
+		if (dir_info->dir_start_cluster == 0)
+			dir_sector_LBA = phat->root_dir_start_LBA + dir_info->cur_diritem / phat->num_diritems_in_a_sector;
+		else
+		{
+			ret = Phat_UpdateClusterByDirItemIndex(dir_info, 0);
+			if (ret != PhatState_OK) return ret;
+			dir_sector_LBA = Phat_ClusterToLBA(phat, dir_info->dir_current_cluster) + cur_diritem_in_cur_cluster / phat->num_diritems_in_a_sector;
+		}
+	}
+	item_index_in_sector = cur_diritem_in_cur_cluster % phat->num_diritems_in_a_sector;
+	dir_sector_LBA += phat->partition_start_LBA;
+	ret = Phat_ReadSectorThroughCache(phat, dir_sector_LBA, cached_sector_out);
+	if (ret != PhatState_OK) return ret;
+	*dir_item_out = &((Phat_DirItem_p)&(*cached_sector_out)->data[0])[item_index_in_sector];
+	return PhatState_OK;
+}
+
+PHAT_STATIC_FUNC PhatState Phat_GetDirItem(Phat_DirInfo_p dir_info, Phat_DirItem_p dir_item)
+{
+	PhatState ret;
+	Phat_SectorCache_p cached_sector;
+	Phat_DirItem_p cached_item;
+
+	ret = Phat_GetDirItemSector(dir_info, &cached_sector, &cached_item);
+	if (ret != PhatState_OK) return ret;
+	*dir_item = *cached_item;
+	return PhatState_OK;
+}
+
+PHAT_STATIC_FUNC PhatState Phat_PutDirItem(Phat_DirInfo_p dir_info, const Phat_DirItem_p dir_item)
+{
+	PhatState ret;
+	Phat_SectorCache_p cached_sector;
+	Phat_DirItem_p cached_item;
+
+	ret = Phat_GetDirItemSector(dir_info, &cached_sector, &cached_item);
+	if (ret != PhatState_OK) return ret;
+	*cached_item = *dir_item;
+	Phat_SetCachedSectorModified(cached_sector);
+	return PhatState_OK;
+}
+
+PHAT_STATIC_FUNC PhatState Phat_SuckLFNIntoBuffer(Phat_LFN_Entry_p lfn_item, Phat_DirInfo_p buffer)
+{
+	uint8_t order = lfn_item->order & 0x3F;
+	uint16_t write_pos = (order - 1) * 13;
+	if (order < 1) return PhatState_FSError;
+	if (write_pos > MAX_LFN) return PhatState_FSError;
+	for (size_t i = 0; i < 5; i++)
+	{
+		WChar_t wchar = lfn_item->name1[i];
+		if (write_pos > MAX_LFN) goto Ended;
+		buffer->LFN_name[write_pos++] = wchar;
+		if (!wchar) goto Ended;
+	}
+	for (size_t i = 0; i < 6; i++)
+	{
+		WChar_t wchar = lfn_item->name2[i];
+		if (write_pos > MAX_LFN) goto Ended;
+		buffer->LFN_name[write_pos++] = wchar;
+		if (!wchar) goto Ended;
+	}
+	for (size_t i = 0; i < 2; i++)
+	{
+		WChar_t wchar = lfn_item->name3[i];
+		if (write_pos > MAX_LFN) goto Ended;
+		buffer->LFN_name[write_pos++] = wchar;
+		if (!wchar) goto Ended;
+	}
+Ended:
+	if (lfn_item->order & 0x40)
+	{
+		buffer->LFN_length = write_pos % 13 ? write_pos - 1 : write_pos;
+		if (buffer->LFN_length > 0 && !buffer->LFN_name[buffer->LFN_length - 1]) buffer->LFN_length--;
+	}
+	return PhatState_OK;
+}
+
+PHAT_STATIC_FUNC PhatBool_t Phat_IsValidLFNEntry(Phat_DirItem_p lfn_item)
+{
+	Phat_LFN_Entry_p lfne = (Phat_LFN_Entry_p)lfn_item;
+	if (lfne->order == 0xE5) return 0;
+	if (lfne->attributes != ATTRIB_LFN) return 0;
+	if (lfne->type != 0) return 0;
+	if (lfne->first_cluster_low != 0) return 0;
+	return 1;
+}
+
+PHAT_STATIC_FUNC PhatState Phat_MoveToNextDirItem(Phat_DirInfo_p dir_info)
+{
+	dir_info->cur_diritem++;
+	return Phat_UpdateClusterByDirItemIndex(dir_info, 0);
+}
+
+PHAT_STATIC_FUNC PhatState Phat_MoveToNextDirItemWithAllocation(Phat_DirInfo_p dir_info)
+{
+	dir_info->cur_diritem++;
+	return Phat_UpdateClusterByDirItemIndex(dir_info, 1);
+}
+
+PHAT_FUNC PhatState Phat_NextDirItem(Phat_DirInfo_p dir_info)
+{
+	PhatState ret = PhatState_OK;
+	Phat_DirItem_t diritem;
+	Phat_LFN_Entry_p lfnitem;
+	PhatBool_t no_checksum = 1;
+	uint8_t checksum;
+
+	// Check parameters
+	if (!dir_info) return PhatState_InvalidParameter;
+
+	lfnitem = (Phat_LFN_Entry_p)&diritem;
+	dir_info->LFN_length = 0;
+	for (;;)
+	{
+		ret = Phat_GetDirItem(dir_info, &diritem);
+		if (ret != PhatState_OK) return ret;
+		if (Phat_IsValidLFNEntry(&diritem))
+		{
+			// LFN entry
+			if (no_checksum)
+			{
+				no_checksum = 0;
+				dir_info->sfn_checksum = lfnitem->checksum;
+			}
+			else if (lfnitem->checksum != dir_info->sfn_checksum)
+			{
+				dir_info->sfn_checksum = lfnitem->checksum;
+				dir_info->LFN_length = 0;
+			}
+			ret = Phat_SuckLFNIntoBuffer(lfnitem, dir_info);
+			if (ret != PhatState_OK) return ret;
+			ret = Phat_MoveToNextDirItem(dir_info);
+			if (ret != PhatState_OK) return ret;
+		}
+		else if (diritem.file_name_8_3[0] == 0xE5)
+		{
+			// Deleted entry
+			dir_info->LFN_length = 0;
+			no_checksum = 1;
+			ret = Phat_MoveToNextDirItem(dir_info);
+			if (ret != PhatState_OK) return ret;
+		}
+		else if (diritem.file_name_8_3[0] == 0x00)
+		{
+			// End of directory
+			dir_info->LFN_length = 0;
+			return PhatState_EndOfDirectory;
+		}
+		else
+		{
+			// Standard entry
+			checksum = Phat_LFN_ChkSum(diritem.file_name_8_3);
+			if (!no_checksum && checksum != dir_info->sfn_checksum)
+			{
+				dir_info->LFN_length = 0;
+			}
+			memcpy(dir_info->file_name_8_3, diritem.file_name_8_3, 11);
+			dir_info->attributes = diritem.attributes;
+			dir_info->ctime = Phat_ParseTime(diritem.creation_time, diritem.creation_time_tenths);
+			dir_info->cdate = Phat_ParseDate(diritem.creation_date);
+			dir_info->mtime = Phat_ParseTime(diritem.last_modification_time, 0);
+			dir_info->mdate = Phat_ParseDate(diritem.last_modification_date);
+			dir_info->adate = Phat_ParseDate(diritem.last_access_date);
+			dir_info->file_size = diritem.file_size;
+			dir_info->first_cluster = ((uint32_t)diritem.first_cluster_high << 16) | diritem.first_cluster_low;
+			if (dir_info->LFN_length == 0)
+			{
+				// No valid LFN, generate from 8.3 name
+				size_t copy_to = 0;
+				for (size_t i = 0; i < 8; i++)
+				{
+					uint8_t ch = diritem.file_name_8_3[i];
+					if (!ch) break;
+					if (ch != ' ') copy_to = i;
+				}
+				for (size_t i = 0; i <= copy_to; i++)
+				{
+					uint8_t ch = diritem.file_name_8_3[i];
+					if (diritem.case_info & CI_BASENAME_IS_LOWER)
+						ch = (uint8_t)tolower(ch);
+					dir_info->LFN_name[dir_info->LFN_length++] = Cp437_To_Unicode(ch);
+				}
+				if (diritem.file_name_8_3[8] != ' ')
+				{
+					dir_info->LFN_name[dir_info->LFN_length++] = L'.';
+					for (size_t i = 8; i < 11; i++)
+					{
+						uint8_t ch = diritem.file_name_8_3[i];
+						if (!ch) break;
+						if (ch != ' ') copy_to = i;
+					}
+				}
+				for (size_t i = 8; i <= copy_to; i++)
+				{
+					uint8_t ch = diritem.file_name_8_3[i];
+					if (diritem.case_info & CI_EXTENSION_IS_LOWER)
+						ch = (uint8_t)tolower(ch);
+					dir_info->LFN_name[dir_info->LFN_length++] = Cp437_To_Unicode(ch);
+				}
+			}
+			dir_info->LFN_name[dir_info->LFN_length] = L'\0';
+			Phat_MoveToNextDirItem(dir_info);
+			return PhatState_OK;
+		}
+	}
+}
+
+PHAT_STATIC_FUNC PhatState Phat_FindFirstLFNEntry(Phat_DirInfo_p dir_info)
+{
+	PhatState ret;
+	Phat_DirItem_t diritem;
+	Phat_LFN_Entry_p lfnitem;
+	uint8_t sfn_checksum;
+
+	lfnitem = (Phat_LFN_Entry_p)&diritem;
+	ret = Phat_GetDirItem(dir_info, &diritem);
+	if (ret != PhatState_OK) return ret;
+	if (Phat_IsValidLFNEntry(&diritem)) return PhatState_InvalidParameter;
+	else if (diritem.file_name_8_3[0] == 0xE5)
+	{
+		// Deleted entry
+		return PhatState_InvalidParameter;
+	}
+	else if (diritem.file_name_8_3[0] == 0x00)
+	{
+		// End of directory
+		return PhatState_InvalidParameter;
+	}
+	else
+	{
+		sfn_checksum = Phat_LFN_ChkSum(diritem.file_name_8_3);
+		for (;;)
+		{
+			// The first entry of the root directory has nothing before it
+			if (!dir_info->cur_diritem) return PhatState_OK;
+			dir_info->cur_diritem--;
+			ret = Phat_GetDirItem(dir_info, &diritem);
+			if (ret != PhatState_OK) return ret;
+			if (lfnitem->attributes != ATTRIB_LFN || lfnitem->order == 0xE5)
+			{
+				dir_info->cur_diritem++;
+				return PhatState_OK;
+			}
+			if (lfnitem->checksum != sfn_checksum || !Phat_IsValidLFNEntry(&diritem)) return PhatState_FSError;
+			if (lfnitem->order & 0x40) return PhatState_OK;
+		}
+	}
+}
+
+PHAT_FUNC void Phat_CloseDir(Phat_DirInfo_p dir_info)
+{
+	// Check parameters
+	if (!dir_info) return;
+
+	memset(dir_info, 0, sizeof * dir_info);
+}
+
+PHAT_FUNC void Phat_OpenRootDir(Phat_p phat, Phat_DirInfo_p dir_info)
+{
+	// Check parameters
+	if (!phat || !dir_info) return;
+
+	memset(dir_info, 0, sizeof * dir_info);
+	dir_info->phat = phat;
+	dir_info->dir_start_cluster = phat->root_dir_cluster;
+	dir_info->dir_current_cluster = phat->root_dir_cluster;
+	dir_info->dir_current_cluster_index = 0;
+	dir_info->cur_diritem = 0;
+}
+
+PHAT_FUNC PhatState Phat_ChDir(Phat_DirInfo_p dir_info, const WChar_p dirname)
+{
+	PhatState ret;
+	WChar_p dirname_ptr;
+	WChar_p end_of_dirname = NULL;
+	size_t dirname_len = 0;
+
+	if (!dir_info || !dirname) return PhatState_InvalidParameter;
+
+	dirname_ptr = dirname;
+	dir_info->cur_diritem = 0;
+
+	for (;;)
+	{
+		if (end_of_dirname == NULL)
+		{
+			end_of_dirname = dirname_ptr;
+			while (*end_of_dirname != 0 && *end_of_dirname != L'/' && *end_of_dirname != L'\\') end_of_dirname++;
+			dirname_len = (size_t)(end_of_dirname - dirname_ptr);
+			if (dirname_len == 0) return PhatState_InvalidParameter;
+		}
+		ret = Phat_NextDirItem(dir_info);
+		if (ret == PhatState_OK)
+		{
+			if (dirname_len == dir_info->LFN_length &&
+				!memcmp(dirname_ptr, dir_info->LFN_name, dirname_len * sizeof(WChar_t)))
+			{
+				Cluster_t dir_cluster;
+				if ((dir_info->attributes & ATTRIB_DIRECTORY) == 0) return PhatState_NotADirectory;
+				dir_cluster = dir_info->first_cluster;
+				if (dir_info->phat->FAT_bits == 32 && dir_cluster == 0) dir_cluster = 2;
+				dir_info->dir_start_cluster = dir_cluster;
+				dir_info->dir_current_cluster = dir_cluster;
+				dir_info->dir_current_cluster_index = 0;
+				dir_info->cur_diritem = 0;
+				if (*end_of_dirname == 0) return PhatState_OK;
+				end_of_dirname++;
+				while (*end_of_dirname == L'/' || *end_of_dirname == L'\\')end_of_dirname++;
+				dirname_ptr = end_of_dirname;
+				end_of_dirname = NULL;
+			}
+		}
+		else if (ret == PhatState_EndOfDirectory)
+		{
+			return PhatState_DirectoryNotFound;
+		}
+		else
+		{
+			return ret;
+		}
+	}
+}
+
+PHAT_FUNC PhatState Phat_OpenDir(Phat_p phat, const WChar_p path, Phat_DirInfo_p dir_info)
+{
+	WChar_p ptr;
+	if (!phat || !path || !dir_info) return PhatState_InvalidParameter;
+	ptr = path;
+	// Skip starting slash
+	while (*ptr == L'/' || *ptr == L'\\') ptr++;
+	Phat_OpenRootDir(phat, dir_info);
+	if (*ptr)
+		return Phat_ChDir(dir_info, ptr);
+	else
+		return PhatState_OK;
+}
+
+// Open a dir to the path, find the item if can (`PhatState_OK` will be returned), or return `PhatState_EndOfDirectory`
+PHAT_STATIC_FUNC PhatState Phat_FindItem(Phat_p phat, WChar_p path, Phat_DirInfo_p dir_info, WChar_p *next_path)
+{
+	PhatState ret;
+	WChar_p dirname_ptr;
+	WChar_p end_of_dirname = NULL;
+	size_t dirname_len = 0;
+
+	if (!path) return PhatState_InvalidParameter;
+
+	if (phat->FAT_bits == 32 && dir_info->dir_current_cluster < 2) Phat_OpenRootDir(phat, dir_info);
+
+	dirname_ptr = path;
+	dir_info->cur_diritem = 0;
+
+	for (;;)
+	{
+		if (end_of_dirname == NULL)
+		{
+			if (next_path) *next_path = dirname_ptr;
+			end_of_dirname = dirname_ptr;
+			while (*end_of_dirname != 0 && *end_of_dirname != L'/' && *end_of_dirname != L'\\') end_of_dirname++;
+			dirname_len = (size_t)(end_of_dirname - dirname_ptr);
+			if (dirname_len == 0) return PhatState_InvalidParameter;
+		}
+		ret = Phat_NextDirItem(dir_info);
+		if (ret == PhatState_OK)
+		{
+			if (dirname_len == dir_info->LFN_length &&
+				!memcmp(dirname_ptr, dir_info->LFN_name, dirname_len * sizeof(WChar_t)))
+			{
+				Cluster_t dir_cluster;
+				if (*end_of_dirname == 0)
+				{
+					// Point to the found item's SLN entry
+					dir_info->cur_diritem--;
+					return PhatState_OK;
+				}
+				if ((dir_info->attributes & ATTRIB_DIRECTORY) == 0) return PhatState_NotADirectory;
+				end_of_dirname++;
+				while (*end_of_dirname == L'/' || *end_of_dirname == L'\\')end_of_dirname++;
+				dirname_ptr = end_of_dirname;
+				dir_cluster = dir_info->first_cluster;
+				dir_info->dir_start_cluster = dir_cluster;
+				dir_info->dir_current_cluster = dir_cluster;
+				dir_info->dir_current_cluster_index = 0;
+				dir_info->cur_diritem = 0;
+				end_of_dirname = NULL;
+			}
+		}
+		else if (ret == PhatState_EndOfDirectory)
+		{
+			if (*end_of_dirname == 0) return ret;
+			return PhatState_DirectoryNotFound;
+		}
+		else
+		{
+			return ret;
+		}
+	}
+}
+
+PHAT_FUNC PhatBool_t Phat_IsValidFilename(WChar_p filename)
+{
+	// Check parameters
+	if (!filename) return PhatState_InvalidParameter;
+
+	size_t length = 0;
+	while (filename[length]) length++;
+	if (length == 0 || length > MAX_LFN) return 0;
+	for (size_t i = 0; i < length; i++)
+	{
+		WChar_t ch = filename[i];
+		if (ch == L'\"' || ch == L'*' || ch == L'/' || ch == L':' ||
+			ch == L'<' || ch == L'>' || ch == L'?' || ch == L'\\' ||
+			ch == L'|' || ch < 0x0020)
+		{
+			return 0;
+		}
+	}
+	if (length == 1 && filename[0] == L'.') return 0;
+	if (length == 2 && filename[0] == L'.' && filename[1] == L'.') return 0;
+	return 1;
+}
+
+PHAT_STATIC_FUNC PhatBool_t Phat_IsFit83(WChar_p filename, uint8_t *sfn83, uint8_t *case_info)
+{
+	PhatBool_t bn_has_lower = 0;
+	PhatBool_t bn_has_upper = 0;
+	PhatBool_t ext_has_lower = 0;
+	PhatBool_t ext_has_upper = 0;
+	int length = 0;
+	int dot = -1;
+	while (filename[length]) length++;
+	if (length == 0 || length > 11) return 0;
+	for (int i = 0; i < length; i++)
+	{
+		WChar_t ch = filename[i];
+		if (ch == ' ') return 0;
+		if (ch >= L'A' && ch <= L'Z')
+		{
+			if (i < 8) bn_has_upper = 1;
+			else ext_has_upper = 1;
+		}
+		else if (ch >= L'a' && ch <= L'z')
+		{
+			if (i < 8) bn_has_lower = 1;
+			else ext_has_lower = 1;
+		}
+		else if (ch == L'.')
+		{
+			dot = i;
+			if (i > 8) return 0;
+			if ((length - dot) > 4) return 0;
+		}
+		else if (ch >= 128) return 0;
+		if (bn_has_upper && bn_has_lower) return 0;
+		if (ext_has_upper && ext_has_lower) return 0;
+	}
+	if (dot < 0 && length > 8) return 0;
+	memset(sfn83, ' ', 11);
+	*case_info = 0;
+	if (bn_has_lower) *case_info |= CI_BASENAME_IS_LOWER;
+	if (ext_has_lower) *case_info |= CI_EXTENSION_IS_LOWER;
+	if (dot < 0)
+	{
+		for(int i = 0; i < length; i++) sfn83[i] = (uint8_t)toupper(filename[i]);
+	}
+	else
+	{
+		for(int i = 0; i < dot; i++) sfn83[i] = (uint8_t)toupper(filename[i]);
+		for(int i = dot + 1; i < length; i++) sfn83[8 + (i - (dot + 1))] = (uint8_t)toupper(filename[i]);
+	}
+	return 1;
+}
+
+PHAT_STATIC_FUNC PhatState Phat_FindShortFileName(Phat_DirInfo_p dir_info, const uint8_t *sfn83, PhatBool_p found)
+{
+	PhatState ret;
+
+	*found = 0;
+	dir_info->cur_diritem = 0;
+	for (;;)
+	{
+		ret = Phat_NextDirItem(dir_info);
+		if (ret == PhatState_EndOfDirectory)
+		{
+			return PhatState_OK;
+		}
+		else if (ret != PhatState_OK)
+		{
+			return ret;
+		}
+		if (!memcmp(dir_info->file_name_8_3, sfn83, 11))
+		{
+			*found = 1;
+			return PhatState_OK;
+		}
+	}
+}
+
+PHAT_STATIC_FUNC PhatState Phat_Gen83NameForLongFilename(Phat_DirInfo_p dir_info, const WChar_p longname, uint8_t *sfn83)
+{
+	PhatBool_t found = 0;
+	PhatState ret;
+	WChar_p ext;
+
+	memset(sfn83, 0x20, 11);
+
+	// Find extension name
+	ext = Phat_ToEndOfString(longname);
+	while (ext > longname)
+	{
+		ext--;
+		if (*ext == L'.')
+		{
+			ext++;
+			break;
+		}
+	}
+	if (ext == longname)
+	{
+		// No extension name
+		for (size_t i = 0; i < 8 && longname[i]; i++)
+		{
+			WChar_t ch = (WChar_t)toupper(longname[i]);
+			if (ch == '.') ch = '_';
+			sfn83[i] = (uint8_t)ch;
+		}
+	}
+	else
+	{
+		size_t end = ext - longname;
+		if (end > 8) end = 8;
+		for (size_t i = 0; i < end && longname[i]; i++)
+		{
+			WChar_t ch = (WChar_t)toupper(longname[i]);
+			if (ch == '.') ch = '_';
+			sfn83[i] = (uint8_t)ch;
+		}
+		for (size_t i = 0; i < 3 && ext[i]; i++)
+		{
+			WChar_t ch = (WChar_t)toupper(ext[i]);
+			sfn83[8 + i] = (uint8_t)ch;
+		}
+	}
+	if (sfn83[0] == ' ')
+	{
+		memcpy(sfn83, "NONAME", 6);
+	}
+
+	for (uint32_t index = 1;;)
+	{
+		ret = Phat_FindShortFileName(dir_info, sfn83, &found);
+		if (ret != PhatState_OK) return ret;
+		if (!found) return PhatState_OK;
+		if (index < 10)
+		{
+			sfn83[6] = '~';
+			sfn83[7] = '0' + (uint8_t)index;
+			index++;
+		}
+		else if (index < 100)
+		{
+			sfn83[5] = '~';
+			sfn83[6] = '0' + (uint8_t)(index / 10);
+			sfn83[7] = '0' + (uint8_t)(index % 10);
+			index++;
+		}
+		else if (index < 1000)
+		{
+			sfn83[4] = '~';
+			sfn83[5] = '0' + (uint8_t)(index / 100);
+			sfn83[6] = '0' + (uint8_t)((index / 10) % 10);
+			sfn83[7] = '0' + (uint8_t)(index % 10);
+			index++;
+		}
+		else if (index < 10000)
+		{
+			sfn83[3] = '~';
+			sfn83[4] = '0' + (uint8_t)(index / 1000);
+			sfn83[5] = '0' + (uint8_t)((index / 100) % 10);
+			sfn83[6] = '0' + (uint8_t)((index / 10) % 10);
+			sfn83[7] = '0' + (uint8_t)(index % 10);
+			index++;
+		}
+		else if (index < 100000)
+		{
+			sfn83[2] = '~';
+			sfn83[3] = '0' + (uint8_t)(index / 10000);
+			sfn83[4] = '0' + (uint8_t)((index / 1000) % 10);
+			sfn83[5] = '0' + (uint8_t)((index / 100) % 10);
+			sfn83[6] = '0' + (uint8_t)((index / 10) % 10);
+			sfn83[7] = '0' + (uint8_t)(index % 10);
+			index++;
+		}
+		else if (index < 1000000)
+		{
+			sfn83[1] = '~';
+			sfn83[2] = '0' + (uint8_t)(index / 100000);
+			sfn83[3] = '0' + (uint8_t)((index / 10000) % 10);
+			sfn83[4] = '0' + (uint8_t)((index / 1000) % 10);
+			sfn83[5] = '0' + (uint8_t)((index / 100) % 10);
+			sfn83[6] = '0' + (uint8_t)((index / 10) % 10);
+			sfn83[7] = '0' + (uint8_t)(index % 10);
+			index++;
+		}
+		else
+		{
+			return PhatState_FSError;
+		}
+	}
+}
+
+// Write the LFN entries and the SFN entry of a new item into free slots of the directory, the name must have been checked not to exist.
+// The SFN entry carries `first_cluster` and `file_size`, `dir_info` points to it on return.
+PHAT_STATIC_FUNC PhatState Phat_PutNewItemInDir(Phat_DirInfo_p dir_info, const WChar_p itemname, uint8_t attrib, Cluster_t first_cluster, FileSize_t file_size)
+{
+	PhatState ret = PhatState_OK;
+	uint8_t name83[11];
+	uint8_t case_info = 0;
+	uint8_t items_needed;
+	uint8_t free_count;
+	Cluster_t first_diritem = 0;
+	size_t itemname_len;
+	int only83 = 0;
+	Phat_DirItem_t dir_item;
+	Phat_p phat = dir_info->phat;
+
+	itemname_len = Phat_Wcslen(itemname);
+	if (itemname_len <= 11 && Phat_IsFit83(itemname, name83, &case_info))
+	{
+		only83 = 1;
+		items_needed = 1;
+	}
+	else
+	{
+		ret = Phat_Gen83NameForLongFilename(dir_info, itemname, name83);
+		if (ret != PhatState_OK) return ret;
+		items_needed = (uint8_t)(1 + ((itemname_len + 12) / 13));
+	}
+
+	dir_info->cur_diritem = 0;
+	for (;;)
+	{
+		free_count = 0;
+		ret = Phat_GetDirItem(dir_info, &dir_item);
+		if (ret != PhatState_OK) return ret;
+		if (dir_item.file_name_8_3[0] == 0x00 || dir_item.file_name_8_3[0] == 0xE5)
+		{
+			first_diritem = dir_info->cur_diritem;
+			free_count = 1;
+			ret = Phat_MoveToNextDirItemWithAllocation(dir_info);
+			if (ret != PhatState_OK) return ret;
+			while (free_count < items_needed)
+			{
+				ret = Phat_GetDirItem(dir_info, &dir_item);
+				if (ret != PhatState_OK) return ret;
+				if (dir_item.file_name_8_3[0] == 0x00 || dir_item.file_name_8_3[0] == 0xE5)
+				{
+					free_count++;
+					if (free_count == items_needed)
+						break;
+					ret = Phat_MoveToNextDirItemWithAllocation(dir_info);
+					if (ret != PhatState_OK) return ret;
+				}
+				else
+				{
+					break;
+				}
+			}
+			if (free_count == items_needed)
+				break;
+		}
+		else
+		{
+			ret = Phat_MoveToNextDirItemWithAllocation(dir_info);
+			if (ret != PhatState_OK) return ret;
+		}
+		if (free_count == items_needed)
+			break;
+	}
+	dir_info->cur_diritem = first_diritem;
+	ret = Phat_UpdateClusterByDirItemIndex(dir_info, 1);
+	if (ret != PhatState_OK) return ret;
+	if (!only83)
 	{
 		uint8_t checksum = Phat_LFN_ChkSum(name83);
 		uint8_t lfn_entries_needed = (uint8_t)(items_needed - 1);
 		for (uint8_t i = lfn_entries_needed; i > 0; i--)
 		{
-			Phat_LFN_Entry_t lfn_entry;
-			size_t copy_len = 13;
-			size_t offset = (size_t)(i - 1) * 13;
-			if (itemname_len - offset < 13) copy_len = itemname_len - offset;
-			memset(&lfn_entry, 0, sizeof lfn_entry);
-			lfn_entry.order = i;
-			if (i == lfn_entries_needed) lfn_entry.order |= 0x40;
-			lfn_entry.attributes = ATTRIB_LFN;
-			lfn_entry.type = 0;
-			lfn_entry.first_cluster_low = 0;
-			lfn_entry.checksum = checksum;
-			for (size_t j = 0; j < 13; j++)
-			{
-				WChar_t ch = 0xFFFF;
-				if (j < copy_len) ch = itemname[offset + j];
-				if (j == copy_len) ch = 0;
-				if (j < 5)
-					lfn_entry.name1[j] = ch;
-				else if (j < 11)
-					lfn_entry.name2[j - 5] = ch;
-				else
-					lfn_entry.name3[j - 11] = ch;
-			}
-			ret = Phat_PutDirItem(dir_info, (Phat_DirItem_p)&lfn_entry);
+			Phat_LFN_Entry_t lfn_entry;
+			size_t copy_len = 13;
+			size_t offset = (size_t)(i - 1) * 13;
+			if (itemname_len - offset < 13) copy_len = itemname_len - offset;
+			memset(&lfn_entry, 0, sizeof lfn_entry);
+			lfn_entry.order = i;
+			if (i == lfn_entries_needed) lfn_entry.order |= 0x40;
+			lfn_entry.attributes = ATTRIB_LFN;
+			lfn_entry.type = 0;
+			lfn_entry.first_cluster_low = 0;
+			lfn_entry.checksum = checksum;
+			for (size_t j = 0; j < 13; j++)
+			{
+				WChar_t ch = 0xFFFF;
+				if (j < copy_len) ch = itemname[offset + j];
+				if (j == copy_len) ch = 0;
+				if (j < 5)
+					lfn_entry.name1[j] = ch;
+				else if (j < 11)
+					lfn_entry.name2[j - 5] = ch;
+				else
+					lfn_entry.name3[j - 11] = ch;
+			}
+			ret = Phat_PutDirItem(dir_info, (Phat_DirItem_p)&lfn_entry);
+			if (ret != PhatState_OK) return ret;
+			ret = Phat_MoveToNextDirItem(dir_info);
+			if (ret != PhatState_OK) return ret;
+		}
+	}
+	memset(&dir_item, 0, sizeof dir_item);
+	memcpy(dir_item.file_name_8_3, name83, 11);
+	dir_item.attributes = attrib;
+	dir_item.creation_date = Phat_EncodeDate(&phat->cur_date);
+	dir_item.creation_time = Phat_EncodeTime(&phat->cur_time);
+	dir_item.creation_time_tenths = 0;
+	dir_item.last_modification_date = Phat_EncodeDate(&phat->cur_date);
+	dir_item.last_modification_time = Phat_EncodeTime(&phat->cur_time);
+	dir_item.last_access_date = Phat_EncodeDate(&phat->cur_date);
+	dir_item.first_cluster_low = first_cluster & 0xFFFF;
+	dir_item.first_cluster_high = first_cluster >> 16;
+	dir_item.file_size = file_size;
+	return Phat_PutDirItem(dir_info, &dir_item);
+}
+
+PHAT_STATIC_FUNC PhatState Phat_CreateNewItemInDir(Phat_DirInfo_p dir_info, const WChar_p itemname, uint8_t attrib)
+{
+	PhatState ret = PhatState_OK;
+	Cluster_t first_cluster = 0;
+	size_t itemname_len;
+	Phat_p phat = dir_info->phat;
+
+	itemname_len = Phat_Wcslen(itemname);
+	if (itemname_len > MAX_LFN) return PhatState_NameTooLong;
+	if (!Phat_IsValidFilename(itemname)) return PhatState_BadFileName;
+
+	ret = Phat_FindItem(phat, itemname, dir_info, NULL);
+	switch (ret)
+	{
+	case PhatState_OK:
+		if (dir_info->attributes & ATTRIB_DIRECTORY)
+			return PhatState_DirectoryAlreadyExists;
+		else
+			return PhatState_FileAlreadyExists;
+	case PhatState_EndOfDirectory:
+		break;
+	default:
+		return ret;
+	}
+
+	if (attrib & ATTRIB_DIRECTORY)
+	{
+		Phat_SectorCache_p cached_sector = NULL;
+		Phat_DirItem_p dir_items;
+		Cluster_t dir_start_cluster = dir_info->dir_start_cluster;
+		if (dir_start_cluster == phat->root_dir_cluster) dir_start_cluster = 0;
+		ret = Phat_AllocateCluster(phat, &first_cluster);
+		if (ret != PhatState_OK) return ret;
+		ret = Phat_WipeCluster(phat, first_cluster);
+		if (ret != PhatState_OK) return ret;
+		ret = Phat_ReadSectorThroughCache(phat, Phat_ClusterToLBA(phat, first_cluster) + phat->partition_start_LBA, &cached_sector);
+		if (ret != PhatState_OK) return ret;
+		dir_items = (Phat_DirItem_p)cached_sector->data;
+		memcpy(dir_items[0].file_name_8_3, ".          ", 11);
+		dir_items[0].attributes = ATTRIB_DIRECTORY;
+		dir_items[0].case_info = 0;
+		dir_items[0].creation_time_tenths = 0;
+		dir_items[0].creation_time = Phat_EncodeTime(&phat->cur_time);
+		dir_items[0].creation_date = Phat_EncodeDate(&phat->cur_date);
+		dir_items[0].last_access_date = Phat_EncodeDate(&phat->cur_date);
+		dir_items[0].first_cluster_high = first_cluster >> 16;
+		dir_items[0].last_modification_time = Phat_EncodeTime(&phat->cur_time);
+		dir_items[0].last_modification_date = Phat_EncodeDate(&phat->cur_date);
+		dir_items[0].first_cluster_low = first_cluster & 0xFFFF;
+		dir_items[0].file_size = 0;
+		memcpy(dir_items[1].file_name_8_3, "..         ", 11);
+		dir_items[1].attributes = ATTRIB_DIRECTORY;
+		dir_items[1].case_info = 0;
+		dir_items[1].creation_time_tenths = 0;
+		dir_items[1].creation_time = Phat_EncodeTime(&phat->cur_time);
+		dir_items[1].creation_date = Phat_EncodeDate(&phat->cur_date);
+		dir_items[1].last_access_date = Phat_EncodeDate(&phat->cur_date);
+		dir_items[1].first_cluster_high = dir_start_cluster >> 16;
+		dir_items[1].last_modification_time = Phat_EncodeTime(&phat->cur_time);
+		dir_items[1].last_modification_date = Phat_EncodeDate(&phat->cur_date);
+		dir_items[1].first_cluster_low = dir_start_cluster & 0xFFFF;
+		dir_items[1].file_size = 0;
+		Phat_SetCachedSectorModified(cached_sector);
+	}
+	ret = Phat_PutNewItemInDir(dir_info, itemname, attrib, first_cluster, 0);
+	if (ret != PhatState_OK)
+	{
+		if (first_cluster >= 2) Phat_UnlinkCluster(phat, first_cluster);
+		return ret;
+	}
+	return PhatState_OK;
+}
+
+// Get the cached sector that holds the directory entry of an opened file, and the entry inside it
+PHAT_STATIC_FUNC PhatState Phat_GetFileDirItemSector(Phat_FileInfo_p file_info, Phat_SectorCache_p *cached_sector_out, Phat_DirItem_p *dir_item_out)
+{
+	PhatState ret;
+	Phat_p phat = file_info->phat;
+
+	ret = Phat_ReadSectorThroughCache(phat, file_info->dir_item_LBA, cached_sector_out);
+	if (ret != PhatState_OK) return ret;
+	*dir_item_out = &((Phat_DirItem_p)&(*cached_sector_out)->data[0])[file_info->dir_item_index % phat->num_diritems_in_a_sector];
+	return PhatState_OK;
+}
+
+// The sector buffer lent to the file, NULL if it has none or another file has taken it
+PHAT_STATIC_FUNC Phat_FileSectorBuffer_p Phat_GetFileSectorBuffer(Phat_FileInfo_p file_info)
+{
+	Phat_FileSectorBuffer_p buffer = file_info->sector_buffer;
+	if (buffer && buffer->owner == file_info) return buffer;
+	return NULL;
+}
+
+// Give the sector buffer of the file back to the pool
+PHAT_STATIC_FUNC void Phat_DropFileSectorBuffer(Phat_FileInfo_p file_info)
+{
+	Phat_FileSectorBuffer_p buffer = Phat_GetFileSectorBuffer(file_info);
+	if (buffer) buffer->owner = NULL;
+	file_info->sector_buffer = NULL;
+}
+
+// Get a sector buffer that holds `LBA`, borrowed from the pool if the file has none.
+// A free buffer is taken first, then the buffers of the other files in turn. If `read` is zero, the sector is not
+// read and the buffer is zeroed instead, for a sector that is beyond the end of the file.
+PHAT_STATIC_FUNC PhatState Phat_LoadFileSectorBuffer(Phat_FileInfo_p file_info, LBA_t LBA, PhatBool_t read, uint8_t **data_out)
+{
+	PhatState ret;
+	Phat_p phat = file_info->phat;
+	Phat_FileSectorBuffer_p buffer = Phat_GetFileSectorBuffer(file_info);
+
+	if (buffer && buffer->LBA == LBA)
+	{
+		*data_out = buffer->data;
+		return PhatState_OK;
+	}
+	if (!buffer)
+	{
+		for (size_t i = 0; i < PHAT_FILE_SECTOR_BUFFERS; i++)
+		{
+			if (!phat->file_sector_buffers[i].owner)
+			{
+				buffer = &phat->file_sector_buffers[i];
+				break;
+			}
+		}
+		if (!buffer)
+		{
+			buffer = &phat->file_sector_buffers[phat->file_sector_buffer_next];
+			if (++phat->file_sector_buffer_next >= PHAT_FILE_SECTOR_BUFFERS) phat->file_sector_buffer_next = 0;
+		}
+		buffer->owner = file_info;
+		file_info->sector_buffer = buffer;
+	}
+	if (read)
+	{
+		ret = Phat_ReadFileSectors(phat, LBA, 1, buffer->data);
+		if (ret != PhatState_OK)
+		{
+			Phat_DropFileSectorBuffer(file_info);
+			return ret;
+		}
+	}
+	else
+		memset(buffer->data, 0, sizeof buffer->data);
+	buffer->LBA = LBA;
+	*data_out = buffer->data;
+	return PhatState_OK;
+}
+
+// Copy the state of a handle into the record of its file in the open-file table
+PHAT_STATIC_FUNC void Phat_StoreSharedFileState(Phat_FileInfo_p file_info)
+{
+	Phat_OpenFileRecord_p record = file_info->shared;
+
+	record->first_cluster = file_info->first_cluster;
+	record->file_size = file_info->file_size;
+	record->unsynced_from = file_info->unsynced_from;
+	record->modified = file_info->modified;
+	record->release_unused = file_info->release_unused;
+}
+
+// Make the handle hold the shared state of its file, called by the file functions before they use the state.
+// The handle that held it before writes back its collected data, so that this handle could read it. This handle drops
+// what it has buffered from the file if the file was written since, and goes back to the start of the cluster chain
+// if the chain was replaced or cut. A read-only handle only takes a copy of the state and leaves the record without
+// a holder, so a read-only handle that is never closed doesn't leave a dangling holder behind.
+PHAT_STATIC_FUNC PhatState Phat_AcquireSharedFile(Phat_FileInfo_p file_info)
+{
+	PhatState ret;
+	Phat_OpenFileRecord_p record = file_info->shared;
+
+	if (!record || record->holder == file_info) return PhatState_OK;
+	if (record->holder)
+	{
+		ret = Phat_FlushWriteBehind(record->holder);
+		if (ret != PhatState_OK) return ret;
+		Phat_StoreSharedFileState(record->holder);
+	}
+	record->holder = file_info->readonly ? NULL : file_info;
+	file_info->file_size = record->file_size;
+	file_info->unsynced_from = record->unsynced_from;
+	file_info->modified = record->modified;
+	file_info->release_unused = record->release_unused;
+	if (file_info->seen_change_count != record->change_count)
+	{
+		file_info->seen_change_count = record->change_count;
+		Phat_DropFileSectorBuffer(file_info);
+		file_info->read_ahead_sectors = 0;
+	}
+	if (file_info->first_cluster != record->first_cluster || file_info->seen_release_count != record->release_count)
+	{
+		file_info->seen_release_count = record->release_count;
+		file_info->first_cluster = record->first_cluster;
+		file_info->cur_cluster = record->first_cluster;
+		file_info->cur_cluster_index = 0;
+		file_info->at_cluster = record->first_cluster;
+		file_info->at_cluster_index = 0;
+	}
+	return PhatState_OK;
+}
+
+// The size of the file as the other handles of it see it, without taking the shared state over
+PHAT_STATIC_FUNC FileSize_t Phat_GetSharedFileSize(Phat_FileInfo_p file_info)
+{
+	Phat_OpenFileRecord_p record = file_info->shared;
+
+	if (!record || record->holder == file_info) return file_info->file_size;
+	if (record->holder) return record->holder->file_size;
+	return record->file_size;
+}
+
+// Join the record of the file in the open-file table, or take a free record
+PHAT_STATIC_FUNC PhatState Phat_AttachSharedFile(Phat_FileInfo_p file_info)
+{
+#if PHAT_OPEN_FILES
+	Phat_p phat = file_info->phat;
+	Phat_OpenFileRecord_p free_record = NULL;
+
+	for (size_t i = 0; i < PHAT_OPEN_FILES; i++)
+	{
+		Phat_OpenFileRecord_p record = &phat->open_files[i];
+		if (!record->num_handles)
+		{
+			if (!free_record) free_record = record;
+			continue;
+		}
+		if (record->dir_item_LBA != file_info->dir_item_LBA || record->dir_item_index != file_info->dir_item_index) continue;
+		if (record->num_handles == UINT8_MAX) return PhatState_TooManyOpenFiles;
+		record->num_handles++;
+		file_info->shared = record;
+		file_info->seen_change_count = record->change_count;
+		file_info->seen_release_count = record->release_count;
+		return Phat_AcquireSharedFile(file_info);
+	}
+	if (!free_record) return PhatState_TooManyOpenFiles;
+	memset(free_record, 0, sizeof * free_record);
+	free_record->dir_item_LBA = file_info->dir_item_LBA;
+	free_record->dir_item_index = file_info->dir_item_index;
+	free_record->num_handles = 1;
+	file_info->shared = free_record;
+	Phat_StoreSharedFileState(file_info);
+	free_record->holder = file_info->readonly ? NULL : file_info;
+#else
+	(void)file_info;
+#endif
+	return PhatState_OK;
+}
+
+// Leave the open-file table, the record keeps the state for the other handles of the file
+PHAT_STATIC_FUNC void Phat_DetachSharedFile(Phat_FileInfo_p file_info)
+{
+	Phat_OpenFileRecord_p record = file_info->shared;
+
+	if (!record) return;
+	if (record->holder == file_info)
+	{
+		Phat_StoreSharedFileState(file_info);
+		record->holder = NULL;
+	}
+	record->num_handles--;
+	file_info->shared = NULL;
+}
+
+PHAT_FUNC PhatState Phat_OpenFile(Phat_DirInfo_p dir_info, const WChar_p path, uint8_t open_mode, Phat_FileInfo_p file_info)
+{
+	Phat_p phat;
+	PhatState ret;
+	WChar_p p;
+	WChar_p ch;
+	size_t dirname_len;
+	PhatBool_t readonly = (open_mode & PHAT_OPEN_READONLY) != 0;
+
+	// Check parameters
+	if (!dir_info || !path || !file_info) return PhatState_InvalidParameter;
+
+	phat = dir_info->phat;
+
+	// A closed handle gives its sector buffer back, but a handle that wasn't closed may still own one at this address
+	for (size_t i = 0; i < PHAT_FILE_SECTOR_BUFFERS; i++)
+	{
+		if (phat->file_sector_buffers[i].owner == file_info) phat->file_sector_buffers[i].owner = NULL;
+	}
+#if PHAT_OPEN_FILES
+	// The same goes for the record of its file, the state it held is lost with it
+	for (size_t i = 0; i < PHAT_OPEN_FILES; i++)
+	{
+		Phat_OpenFileRecord_p record = &phat->open_files[i];
+		if (record->num_handles && record->holder == file_info)
+		{
+			record->holder = NULL;
+			record->num_handles--;
+		}
+	}
+#endif
+	memset(file_info, 0, sizeof * file_info);
+	file_info->phat = phat;
+	ret = Phat_FindItem(phat, path, dir_info, &p);
+	if (ret == PhatState_EndOfDirectory)
+	{
+		if (readonly) return PhatState_FileNotFound;
+		for (;;)
+		{
+			ch = p;
+			while (*ch && *ch != L'/' && *ch != L'\\') ch++;
+			dirname_len = (size_t)(ch - p);
+			if (dirname_len > MAX_LFN) return PhatState_NameTooLong;
+			if (*ch)
+			{
+				Phat_CloseDir(dir_info);
+				return PhatState_DirectoryNotFound;
+			}
+			else
+			{
+				ret = Phat_MarkDirty(phat, 1, 1);
+				if (ret != PhatState_OK) return ret;
+				memcpy(phat->filename_buffer, p, dirname_len * sizeof(WChar_t));
+				phat->filename_buffer[dirname_len] = 0;
+				ret = Phat_CreateNewItemInDir(dir_info, phat->filename_buffer, 0);
+				if (ret != PhatState_OK) return ret;
+				ret = Phat_FindItem(phat, phat->filename_buffer, dir_info, NULL);
+				if (ret != PhatState_OK) return ret;
+				break;
+			}
+		}
+	}
+	else if (ret == PhatState_OK)
+	{
+		if (dir_info->attributes & ATTRIB_DIRECTORY)
+		{
+			Phat_CloseDir(dir_info);
+			return PhatState_IsADirectory;
+		}
+	}
+	else
+	{
+		// Error
+		Phat_CloseDir(dir_info);
+		return ret;
+	}
+	// Only the location of the directory entry is kept, the directory iterator is free to move on
+	{
+		Phat_SectorCache_p cached_sector;
+		Phat_DirItem_p dir_item;
+		ret = Phat_GetDirItemSector(dir_info, &cached_sector, &dir_item);
+		if (ret != PhatState_OK)
+		{
+			Phat_CloseDir(dir_info);
+			return ret;
+		}
+		file_info->dir_item_LBA = cached_sector->LBA;
+	}
+	file_info->dir_start_cluster = dir_info->dir_start_cluster;
+	file_info->dir_item_index = dir_info->cur_diritem;
+	file_info->attributes = dir_info->attributes;
+	file_info->modified = 0;
+	file_info->first_cluster = dir_info->first_cluster;
+	file_info->cur_cluster = dir_info->first_cluster;
+	file_info->file_size = dir_info->file_size;
+	file_info->readonly = readonly || ((dir_info->attributes & ATTRIB_READ_ONLY) != 0);
+	file_info->file_pointer = 0;
+	file_info->cur_cluster_index = 0;
+	file_info->at_cluster = dir_info->first_cluster;
+	file_info->at_cluster_index = 0;
+	file_info->sector_buffer = NULL;
+	file_info->read_ahead_buffer = NULL;
+	file_info->read_ahead_buffer_sectors = 0;
+	file_info->read_ahead_sectors = 0;
+	file_info->write_behind_buffer = NULL;
+	file_info->write_behind_buffer_size = 0;
+	file_info->write_behind_bytes = 0;
+	file_info->append = 0;
+	file_info->release_unused = 0;
+	file_info->unsynced_from = (FileSize_t)-1;
+	ret = Phat_AttachSharedFile(file_info);
+	if (ret != PhatState_OK)
+	{
+		Phat_DetachSharedFile(file_info);
+		Phat_CloseDir(dir_info);
+		return ret;
+	}
+	if (open_mode & PHAT_OPEN_TRUNCATE)
+	{
+		// Keep the cluster chain for the following writes to reuse, the unused part is freed when closing
+		if (file_info->readonly)
+		{
+			Phat_DetachSharedFile(file_info);
+			Phat_CloseDir(dir_info);
+			return PhatState_ReadOnly;
+		}
+		file_info->file_size = 0;
+		file_info->modified = 1;
+		file_info->release_unused = 1;
+		file_info->unsynced_from = 0;
+	}
+	if (open_mode & PHAT_OPEN_APPEND)
+	{
+		file_info->append = 1;
+		ret = Phat_SeekFileTail(file_info);
+		if (ret != PhatState_OK)
+		{
+			Phat_DetachSharedFile(file_info);
+			Phat_CloseDir(dir_info);
+			return ret;
+		}
+	}
+	return PhatState_OK;
+}
+
+PHAT_FUNC PhatState Phat_OpenFileFromRoot(Phat_p phat, const WChar_p path, uint8_t open_mode, Phat_FileInfo_p file_info)
+{
+	Phat_DirInfo_t dir_info;
+
+	// Check parameters
+	if (!phat || !path || !file_info) return PhatState_InvalidParameter;
+	file_info->phat = phat;
+	if (!(open_mode & PHAT_OPEN_READONLY) && !phat->write_enable) return PhatState_ReadOnly;
+
+	Phat_OpenRootDir(phat, &dir_info);
+	return Phat_OpenFile(&dir_info, path, open_mode, file_info);
+}
+
+// Remember the cluster cursor of a file, so that the next time the file is opened the walk could start from there
+PHAT_STATIC_FUNC void Phat_SaveChainHint(Phat_FileInfo_p file_info)
+{
+	Phat_p phat = file_info->phat;
+	Phat_ChainHint_p hint = NULL;
+
+	if (file_info->first_cluster < 2 || file_info->cur_cluster < 2 || !file_info->cur_cluster_index) return;
+	for (size_t i = 0; i < PHAT_CHAIN_HINTS; i++)
+	{
+		if (phat->chain_hints[i].first_cluster == file_info->first_cluster)
+		{
+			hint = &phat->chain_hints[i];
+			break;
+		}
+	}
+	if (!hint)
+	{
+		hint = &phat->chain_hints[phat->chain_hint_next];
+		if (++phat->chain_hint_next >= PHAT_CHAIN_HINTS) phat->chain_hint_next = 0;
+	}
+	hint->first_cluster = file_info->first_cluster;
+	hint->cluster = file_info->cur_cluster;
+	hint->cluster_index = file_info->cur_cluster_index;
+}
+
+// Move the cluster cursor to a remembered position of the chain that is closer to `cluster_index`
+PHAT_STATIC_FUNC void Phat_LoadChainHint(Phat_FileInfo_p file_info, Cluster_t cluster_index)
+{
+	Phat_p phat = file_info->phat;
+	Phat_OpenFileRecord_p record = file_info->shared;
+
+	for (size_t i = 0; i < PHAT_CHAIN_HINTS; i++)
+	{
+		Phat_ChainHint_p hint = &phat->chain_hints[i];
+		if (hint->first_cluster != file_info->first_cluster || hint->cluster_index > cluster_index) continue;
+		if (file_info->cur_cluster_index > cluster_index || hint->cluster_index > file_info->cur_cluster_index)
+		{
+			file_info->cur_cluster = hint->cluster;
+			file_info->cur_cluster_index = hint->cluster_index;
+		}
+	}
+
+	// The furthest position reached by any handle of the file
+	if (record && record->cluster >= 2 && record->cluster_index <= cluster_index)
+	{
+		if (file_info->cur_cluster_index > cluster_index || record->cluster_index > file_info->cur_cluster_index)
+		{
+			file_info->cur_cluster = record->cluster;
+			file_info->cur_cluster_index = record->cluster_index;
+		}
+	}
+}
+
+PHAT_STATIC_FUNC PhatState Phat_UpdateClusterByFilePointer(Phat_FileInfo_p file_info, PhatBool_t allocate_new_sectors)
+{
+	PhatState ret = PhatState_OK;
+	Phat_p phat = file_info->phat;
+	Cluster_t cluster_index;
+	Cluster_t next_cluster;
+	Cluster_t end_of_chain_index = (Cluster_t)-1;
+	cluster_index = file_info->file_pointer / ((Cluster_t)phat->sectors_per_cluster * phat->bytes_per_sector);
+	if (file_info->cur_cluster_index != cluster_index && file_info->first_cluster >= 2) Phat_LoadChainHint(file_info, cluster_index);
+	if (file_info->cur_cluster_index > cluster_index)
+	{
+		file_info->cur_cluster_index = 0;
+		file_info->cur_cluster = file_info->first_cluster;
+	}
+	while (file_info->cur_cluster_index < cluster_index)
+	{
+		ret = Phat_GetFATNextCluster(phat, file_info->cur_cluster, &next_cluster);
+		if (ret == PhatState_EndOfFATChain)
+		{
+			if (!allocate_new_sectors) return PhatState_EndOfFile;
+			// Allocate all of the clusters needed to reach `cluster_index` at once
+			ret = Phat_AllocateClusters(phat, file_info->cur_cluster, cluster_index - file_info->cur_cluster_index, &next_cluster);
+			if (ret != PhatState_OK) return ret;
+			end_of_chain_index = file_info->cur_cluster_index;
+		}
+		else if (ret != PhatState_OK)
+			return ret;
+		file_info->cur_cluster_index++;
+		file_info->cur_cluster = next_cluster;
+		if (file_info->cur_cluster_index > end_of_chain_index)
+		{
+			ret = Phat_WipeCluster(phat, next_cluster);
+			if (ret != PhatState_OK) return ret;
+		}
+	}
+	if (file_info->shared && file_info->cur_cluster_index > file_info->shared->cluster_index)
+	{
+		file_info->shared->cluster = file_info->cur_cluster;
+		file_info->shared->cluster_index = file_info->cur_cluster_index;
+	}
+	return PhatState_OK;
+}
+
+PHAT_STATIC_FUNC PhatState Phat_GetCurFilePointerLBA(Phat_FileInfo_p file_info, LBA_p LBA_out, PhatBool_t allocate_new_sectors)
+{
+	PhatState ret = Phat_UpdateClusterByFilePointer(file_info, allocate_new_sectors);
+	if (ret != PhatState_OK) return ret;
+	file_info->offset_in_cluster = (file_info->file_pointer / file_info->phat->bytes_per_sector) % file_info->phat->sectors_per_cluster;
+	*LBA_out = Phat_ClusterToLBA(file_info->phat, file_info->cur_cluster) + file_info->offset_in_cluster + file_info->phat->partition_start_LBA;
+	return PhatState_OK;
+}
+
+// Move the file pointer to the end of the file for appending, with the cluster cursor on the last cluster.
+// The partial last sector is loaded into the sector buffer for the first write to complete it.
+PHAT_STATIC_FUNC PhatState Phat_SeekFileTail(Phat_FileInfo_p file_info)
+{
+	PhatState ret;
+	LBA_t FPLBA;
+
+	file_info->file_pointer = file_info->file_size;
+	if (!file_info->file_size || file_info->first_cluster < 2) return PhatState_OK;
+
+	// The cluster of the last byte exists even if the file ends at a cluster boundary
+	file_info->file_pointer = file_info->file_size - 1;
+	ret = Phat_GetCurFilePointerLBA(file_info, &FPLBA, 0);
+	file_info->file_pointer = file_info->file_size;
+	if (ret == PhatState_EndOfFile) return PhatState_FATError;
+	if (ret != PhatState_OK) return ret;
+	Phat_SaveChainHint(file_info);
+	if (file_info->file_size % 512 && !file_info->readonly)
+	{
+		uint8_t *sector_buffer;
+		ret = Phat_LoadFileSectorBuffer(file_info, FPLBA, 1, &sector_buffer);
+		if (ret != PhatState_OK) return ret;
+	}
+	return PhatState_OK;
+}
+
+// Count the sectors from the file pointer that are physically contiguous, following the cluster chain without extending it.
+// `Phat_GetCurFilePointerLBA()` must be called first.
+PHAT_STATIC_FUNC PhatState Phat_GetContiguousSectors(Phat_FileInfo_p file_info, size_t max_sectors, size_t *num_sectors_out)
+{
+	PhatState ret;
+	Phat_p phat = file_info->phat;
+	Cluster_t cluster = file_info->cur_cluster;
+	Cluster_t next_cluster;
+	size_t num_sectors = phat->sectors_per_cluster - file_info->offset_in_cluster;
+
+	if (max_sectors > PHAT_MAX_TRANSFER_SECTORS) max_sectors = PHAT_MAX_TRANSFER_SECTORS;
+	while (num_sectors < max_sectors)
+	{
+		ret = Phat_GetFATNextCluster(phat, cluster, &next_cluster);
+		if (ret == PhatState_EndOfFATChain) break;
+		if (ret != PhatState_OK) return ret;
+		if (next_cluster != cluster + 1) break;
+		cluster = next_cluster;
+		num_sectors += phat->sectors_per_cluster;
+	}
+	if (num_sectors > max_sectors) num_sectors = max_sectors;
+	*num_sectors_out = num_sectors;
+	return PhatState_OK;
+}
+
+// Serve the read from the read-ahead buffer, and refill the buffer with a growing window while the reads are sequential.
+// The rest of the read is left to `Phat_ReadFile()`.
+PHAT_STATIC_FUNC PhatState Phat_ReadFileAhead(Phat_FileInfo_p file_info, void **buffer, size_t *bytes_to_read, size_t *bytes_read)
+{
+	PhatState ret;
+	Phat_p phat = file_info->phat;
+	PhatBool_t sequential = file_info->file_pointer == file_info->read_ahead_next;
+	LBA_t FPLBA;
+	size_t offset;
+	size_t to_copy;
+	size_t sectors_to_read;
+
+	file_info->read_ahead_next = file_info->file_pointer + (FileSize_t)*bytes_to_read;
+	if (!sequential) file_info->read_ahead_window = 0;
+	while (*bytes_to_read)
+	{
+		if (file_info->file_pointer >= file_info->read_ahead_position &&
+			file_info->file_pointer - file_info->read_ahead_position < file_info->read_ahead_sectors * 512)
+		{
+			offset = file_info->file_pointer - file_info->read_ahead_position;
+			to_copy = file_info->read_ahead_sectors * 512 - offset;
+			if (to_copy > *bytes_to_read) to_copy = *bytes_to_read;
+			memcpy(*buffer, &file_info->read_ahead_buffer[offset], to_copy);
+			*buffer = (uint8_t *)*buffer + to_copy;
+			*bytes_to_read -= to_copy;
+			*bytes_read += to_copy;
+			file_info->file_pointer += (FileSize_t)to_copy;
+			continue;
+		}
+		if (!sequential || *bytes_to_read >= file_info->read_ahead_buffer_sectors * 512) break;
+
+		// Grow the window and refill the buffer from the sector of the file pointer
+		if (!file_info->read_ahead_window)
+			file_info->read_ahead_window = phat->sectors_per_cluster;
+		else
+			file_info->read_ahead_window *= 2;
+		if (file_info->read_ahead_window > file_info->read_ahead_buffer_sectors)
+			file_info->read_ahead_window = file_info->read_ahead_buffer_sectors;
+		sectors_to_read = (file_info->file_size - 1) / 512 - file_info->file_pointer / 512 + 1;
+		if (sectors_to_read > file_info->read_ahead_window) sectors_to_read = file_info->read_ahead_window;
+		ret = Phat_GetCurFilePointerLBA(file_info, &FPLBA, 0);
+		if (ret != PhatState_OK) return ret;
+		ret = Phat_GetContiguousSectors(file_info, sectors_to_read, &sectors_to_read);
+		if (ret != PhatState_OK) return ret;
+		file_info->read_ahead_sectors = 0;
+		ret = Phat_ReadFileSectors(phat, FPLBA, sectors_to_read, file_info->read_ahead_buffer);
+		if (ret != PhatState_OK) return ret;
+		file_info->read_ahead_position = file_info->file_pointer - file_info->file_pointer % 512;
+		file_info->read_ahead_sectors = sectors_to_read;
+	}
+	return PhatState_OK;
+}
+
+// Remember the lowest offset of the file that changed since the last `Phat_SyncFile()`
+PHAT_STATIC_FUNC void Phat_SetFileUnsynced(Phat_FileInfo_p file_info, FileSize_t offset)
+{
+	if (offset < file_info->unsynced_from) file_info->unsynced_from = offset;
+
+	// The other handles of the file drop what they have buffered from it
+	if (file_info->shared) file_info->seen_change_count = ++file_info->shared->change_count;
+}
+
+// Positional I/O runs on its own cluster cursor, this swaps it with the sequential one and sets the file pointer.
+// Call it again with the same variable to swap back.
+PHAT_STATIC_FUNC void Phat_SwapFileCursor(Phat_FileInfo_p file_info, FileSize_t *file_pointer)
+{
+	FileSize_t position = file_info->file_pointer;
+	Cluster_t cluster = file_info->cur_cluster;
+	Cluster_t cluster_index = file_info->cur_cluster_index;
+	uint8_t offset_in_cluster = file_info->offset_in_cluster;
+
+	file_info->file_pointer = *file_pointer;
+	file_info->cur_cluster = file_info->at_cluster;
+	file_info->cur_cluster_index = file_info->at_cluster_index;
+	file_info->offset_in_cluster = file_info->at_offset_in_cluster;
+	*file_pointer = position;
+	file_info->at_cluster = cluster;
+	file_info->at_cluster_index = cluster_index;
+	file_info->at_offset_in_cluster = offset_in_cluster;
+}
+
+// Read the data from the disk from the file pointer, `bytes_to_read` must not go past the end of the file
+PHAT_STATIC_FUNC PhatState Phat_ReadFileData(Phat_FileInfo_p file_info, void *buffer, size_t bytes_to_read, size_t *bytes_read)
+{
+	PhatState ret = PhatState_OK;
+	Phat_p phat = file_info->phat;
+	uint16_t offset_in_sector;
+	LBA_t FPLBA;
+	size_t sectors_to_read;
+	uint8_t *sector_buffer;
+	Phat_FileSectorBuffer_p cached_buffer;
+
+	offset_in_sector = file_info->file_pointer % 512;
+	if (offset_in_sector && bytes_to_read)
+	{
+		size_t to_copy;
+		ret = Phat_GetCurFilePointerLBA(file_info, &FPLBA, 0);
+		if (ret != PhatState_OK) return ret;
+		ret = Phat_LoadFileSectorBuffer(file_info, FPLBA, 1, &sector_buffer);
+		if (ret != PhatState_OK) return ret;
+		to_copy = 512 - offset_in_sector;
+		if (to_copy > bytes_to_read) to_copy = bytes_to_read;
+		memcpy(buffer, &sector_buffer[offset_in_sector], to_copy);
+		buffer = (uint8_t *)buffer + to_copy;
+		bytes_to_read -= to_copy;
+		file_info->file_pointer += (FileSize_t)to_copy;
+		*bytes_read += to_copy;
+	}
+	sectors_to_read = bytes_to_read / 512;
+	while (sectors_to_read)
+	{
+		size_t continuous_sectors;
+		ret = Phat_GetCurFilePointerLBA(file_info, &FPLBA, 0);
+		if (ret != PhatState_OK) return ret;
+		cached_buffer = Phat_GetFileSectorBuffer(file_info);
+		if (cached_buffer && cached_buffer->LBA == FPLBA)
+		{
+			continuous_sectors = 1;
+			memcpy(buffer, cached_buffer->data, 512);
+		}
+		else
+		{
+			// Read the physically adjacent clusters with one driver call
+			ret = Phat_GetContiguousSectors(file_info, sectors_to_read, &continuous_sectors);
+			if (ret != PhatState_OK) return ret;
+			ret = Phat_ReadFileSectors(phat, FPLBA, continuous_sectors, buffer);
+			if (ret != PhatState_OK) return ret;
+		}
+		sectors_to_read -= continuous_sectors;
+		buffer = (uint8_t *)buffer + 512 * continuous_sectors;
+		file_info->file_pointer += 512 * continuous_sectors;
+		*bytes_read += 512 * continuous_sectors;
+		bytes_to_read -= 512 * continuous_sectors;
+	}
+	if (bytes_to_read)
+	{
+		ret = Phat_GetCurFilePointerLBA(file_info, &FPLBA, 0);
+		if (ret != PhatState_OK) return ret;
+		ret = Phat_LoadFileSectorBuffer(file_info, FPLBA, 1, &sector_buffer);
+		if (ret != PhatState_OK) return ret;
+		memcpy(buffer, sector_buffer, bytes_to_read);
+		file_info->file_pointer += (FileSize_t)bytes_to_read;
+		*bytes_read += bytes_to_read;
+	}
+	return PhatState_OK;
+}
+
+PHAT_FUNC PhatState Phat_ReadFile(Phat_FileInfo_p file_info, void *buffer, size_t bytes_to_read, size_t *bytes_read)
+{
+	PhatState ret = PhatState_OK;
+	static size_t dummy;
+
+	// Check parameters
+	if (!file_info || !buffer || !bytes_to_read) return PhatState_InvalidParameter;
+	if (!bytes_read) bytes_read = &dummy;
+	*bytes_read = 0;
+	ret = Phat_AcquireSharedFile(file_info);
+	if (ret != PhatState_OK) return ret;
+	ret = Phat_FlushWriteBehind(file_info);
+	if (ret != PhatState_OK) return ret;
+	if (file_info->first_cluster == 0) return PhatState_EndOfFile;
+	if (file_info->file_pointer >= file_info->file_size) return PhatState_EndOfFile;
+	if (file_info->file_pointer + bytes_to_read > file_info->file_size)
+		bytes_to_read = file_info->file_size - file_info->file_pointer;
+	if (file_info->read_ahead_buffer)
+	{
+		ret = Phat_ReadFileAhead(file_info, &buffer, &bytes_to_read, bytes_read);
+		if (ret != PhatState_OK) return ret;
+	}
+	ret = Phat_ReadFileData(file_info, buffer, bytes_to_read, bytes_read);
+	if (ret != PhatState_OK) return ret;
+	return file_info->file_pointer >= file_info->file_size ? PhatState_EndOfFile : PhatState_OK;
+}
+
+PHAT_FUNC PhatState Phat_ReadFileAt(Phat_FileInfo_p file_info, FileSize_t offset, void *buffer, size_t bytes_to_read, size_t *bytes_read)
+{
+	PhatState ret = PhatState_OK;
+	FileSize_t file_pointer = offset;
+	static size_t dummy;
+
+	// Check parameters
+	if (!file_info || !buffer || !bytes_to_read) return PhatState_InvalidParameter;
+	if (!bytes_read) bytes_read = &dummy;
+	*bytes_read = 0;
+	ret = Phat_AcquireSharedFile(file_info);
+	if (ret != PhatState_OK) return ret;
+	ret = Phat_FlushWriteBehind(file_info);
+	if (ret != PhatState_OK) return ret;
+	if (file_info->first_cluster == 0) return PhatState_EndOfFile;
+	if (offset >= file_info->file_size) return PhatState_EndOfFile;
+	if (offset + bytes_to_read > file_info->file_size)
+		bytes_to_read = file_info->file_size - offset;
+
+	Phat_SwapFileCursor(file_info, &file_pointer);
+	ret = Phat_ReadFileData(file_info, buffer, bytes_to_read, bytes_read);
+	Phat_SwapFileCursor(file_info, &file_pointer);
+	if (ret != PhatState_OK) return ret;
+	return offset + bytes_to_read >= file_info->file_size ? PhatState_EndOfFile : PhatState_OK;
+}
+
+PHAT_FUNC PhatState Phat_SetFileReadAhead(Phat_FileInfo_p file_info, void *buffer, size_t buffer_size)
+{
+	// Check parameters
+	if (!file_info) return PhatState_InvalidParameter;
+	if (buffer && buffer_size < 512) return PhatState_InvalidParameter;
+
+	file_info->read_ahead_buffer = buffer;
+	file_info->read_ahead_buffer_sectors = buffer ? buffer_size / 512 : 0;
+	file_info->read_ahead_window = 0;
+	file_info->read_ahead_sectors = 0;
+	file_info->read_ahead_next = file_info->file_pointer;
+	return PhatState_OK;
+}
+
+PHAT_FUNC PhatState Phat_ReadFileDirect(Phat_FileInfo_p file_info, void *buffer, size_t bytes_to_read, size_t *bytes_read)
+{
+	PhatState ret = PhatState_OK;
+	Phat_p phat;
+	LBA_t FPLBA;
+	size_t sectors_to_read;
+	size_t continuous_sectors;
+	static size_t dummy;
+
+	// Check parameters
+	if (!file_info || !buffer || !bytes_to_read) return PhatState_InvalidParameter;
+	if (file_info->file_pointer % 512 || bytes_to_read % 512) return PhatState_InvalidParameter;
+	phat = file_info->phat;
+	if (!bytes_read) bytes_read = &dummy;
+	*bytes_read = 0;
+	ret = Phat_AcquireSharedFile(file_info);
+	if (ret != PhatState_OK) return ret;
+	ret = Phat_FlushWriteBehind(file_info);
+	if (ret != PhatState_OK) return ret;
+	if (file_info->first_cluster == 0) return PhatState_EndOfFile;
+	if (file_info->file_pointer >= file_info->file_size) return PhatState_EndOfFile;
+	if (file_info->file_pointer + bytes_to_read > file_info->file_size)
+		bytes_to_read = file_info->file_size - file_info->file_pointer;
+
+	// The last sector is read whole even if the file ends inside of it
+	sectors_to_read = (bytes_to_read + 511) / 512;
+	while (sectors_to_read)
+	{
+		ret = Phat_GetCurFilePointerLBA(file_info, &FPLBA, 0);
+		if (ret != PhatState_OK) return ret;
+		ret = Phat_GetContiguousSectors(file_info, sectors_to_read, &continuous_sectors);
+		if (ret != PhatState_OK) return ret;
+		if (!phat->driver.fn_read_sector(buffer, FPLBA, continuous_sectors, phat->driver.userdata))
+		{
+			return PhatState_ReadFail;
+		}
+		Phat_OverlayModifiedDataPages(phat, FPLBA, continuous_sectors, buffer);
+		sectors_to_read -= continuous_sectors;
+		buffer = (uint8_t *)buffer + 512 * continuous_sectors;
+		file_info->file_pointer += 512 * continuous_sectors;
+	}
+	file_info->file_pointer -= (FileSize_t)((512 - bytes_to_read % 512) % 512);
+	*bytes_read = bytes_to_read;
+	return file_info->file_pointer >= file_info->file_size ? PhatState_EndOfFile : PhatState_OK;
+}
+
+// Give an empty file its first cluster and record it in the directory item
+PHAT_STATIC_FUNC PhatState Phat_SetFileFirstCluster(Phat_FileInfo_p file_info, Cluster_t first_cluster)
+{
+	PhatState ret;
+	Phat_SectorCache_p cached_sector;
+	Phat_DirItem_p dir_item;
+
+	ret = Phat_GetFileDirItemSector(file_info, &cached_sector, &dir_item);
+	if (ret != PhatState_OK) return ret;
+	dir_item->first_cluster_low = first_cluster & 0xFFFF;
+	dir_item->first_cluster_high = first_cluster >> 16;
+	Phat_SetCachedSectorModified(cached_sector);
+	file_info->first_cluster = first_cluster;
+	file_info->cur_cluster = first_cluster;
+	file_info->cur_cluster_index = 0;
+	file_info->at_cluster = first_cluster;
+	file_info->at_cluster_index = 0;
+	return PhatState_OK;
+}
+
+// Make sure the cluster chain covers the file up to `end_pointer`, so that the data could be written in large runs.
+// The new clusters are not wiped, the write covers them and `Phat_ZeroFileGap()` zeroes the rest. The cluster cursor of the file is not moved.
+PHAT_STATIC_FUNC PhatState Phat_ReserveFileClusters(Phat_FileInfo_p file_info, FileSize_t end_pointer)
+{
+	PhatState ret;
+	Phat_p phat = file_info->phat;
+	Cluster_t cluster_size = (Cluster_t)phat->sectors_per_cluster * phat->bytes_per_sector;
+	Cluster_t last_index;
+	Cluster_t cluster_index;
+	Cluster_t cluster;
+	Cluster_t next_cluster;
+
+	if (!end_pointer) return PhatState_OK;
+	last_index = (end_pointer - 1) / cluster_size;
+	if (file_info->first_cluster == 0)
+	{
+		// Allocate the whole chain for an empty file
+		ret = Phat_AllocateClusters(phat, 0, last_index + 1, &cluster);
+		if (ret != PhatState_OK) return ret;
+		ret = Phat_SetFileFirstCluster(file_info, cluster);
+		if (ret != PhatState_OK)
+		{
+			Phat_UnlinkCluster(phat, cluster);
+			return ret;
+		}
+		cluster_index = 0;
+	}
+	else
+	{
+		// Find the end of the chain, starting from the cluster cursor
+		cluster = file_info->cur_cluster;
+		cluster_index = file_info->cur_cluster_index;
+		while (cluster_index < last_index)
+		{
+			ret = Phat_GetFATNextCluster(phat, cluster, &next_cluster);
+			if (ret == PhatState_EndOfFATChain) break;
 			if (ret != PhatState_OK) return ret;
-			ret = Phat_MoveToNextDirItem(dir_info);
+			cluster = next_cluster;
+			cluster_index++;
+		}
+		if (cluster_index >= last_index) return PhatState_OK;
+		ret = Phat_AllocateClusters(phat, cluster, last_index - cluster_index, &cluster);
+		if (ret != PhatState_OK) return ret;
+	}
+	return PhatState_OK;
+}
+
+// Write zeros from the end of the file to the file pointer, the gap left by seeking past the end of the file.
+// The clusters must have been reserved. The whole sector that contains the file pointer is zeroed.
+PHAT_STATIC_FUNC PhatState Phat_ZeroFileGap(Phat_FileInfo_p file_info)
+{
+	PhatState ret;
+	Phat_p phat = file_info->phat;
+	FileSize_t file_pointer = file_info->file_pointer;
+	uint16_t offset_in_sector;
+	LBA_t FPLBA;
+	size_t sectors_to_zero;
+	uint8_t *sector_buffer;
+	Phat_FileSectorBuffer_p cached_buffer;
+
+	file_info->file_pointer = file_info->file_size;
+	offset_in_sector = file_info->file_pointer % 512;
+	if (offset_in_sector)
+	{
+		// Keep the end of the file and zero the rest of its last sector
+		ret = Phat_GetCurFilePointerLBA(file_info, &FPLBA, 0);
+		if (ret != PhatState_OK) goto FailExit;
+		ret = Phat_LoadFileSectorBuffer(file_info, FPLBA, 1, &sector_buffer);
+		if (ret != PhatState_OK) goto FailExit;
+		memset(&sector_buffer[offset_in_sector], 0, 512 - offset_in_sector);
+		ret = Phat_WriteFileSectors(phat, FPLBA, 1, sector_buffer);
+		if (ret != PhatState_OK) goto FailExit;
+		file_info->file_pointer += 512 - offset_in_sector;
+	}
+	while (file_info->file_pointer < file_pointer)
+	{
+		ret = Phat_GetCurFilePointerLBA(file_info, &FPLBA, 0);
+		if (ret != PhatState_OK) goto FailExit;
+		ret = Phat_GetContiguousSectors(file_info, (file_pointer - file_info->file_pointer + 511) / 512, &sectors_to_zero);
+		if (ret != PhatState_OK) goto FailExit;
+		ret = Phat_WriteZeroSectors(phat, FPLBA, sectors_to_zero);
+		if (ret != PhatState_OK) goto FailExit;
+		cached_buffer = Phat_GetFileSectorBuffer(file_info);
+		if (cached_buffer && cached_buffer->LBA >= FPLBA && cached_buffer->LBA - FPLBA < sectors_to_zero)
+		{
+			memset(cached_buffer->data, 0, sizeof cached_buffer->data);
+		}
+		file_info->file_pointer += (FileSize_t)(512 * sectors_to_zero);
+	}
+	ret = PhatState_OK;
+FailExit:
+	file_info->file_pointer = file_pointer;
+	return ret;
+}
+
+// Write the data to the disk from the file pointer
+PHAT_STATIC_FUNC PhatState Phat_WriteFileData(Phat_FileInfo_p file_info, const void *buffer, size_t bytes_to_write, size_t *bytes_written)
+{
+	PhatState ret = PhatState_OK;
+	Phat_p phat = file_info->phat;
+	uint16_t offset_in_sector;
+	LBA_t FPLBA;
+	size_t sectors_to_write;
+	uint8_t *sector_buffer;
+	Phat_FileSectorBuffer_p cached_buffer;
+
+	*bytes_written = 0;
+	offset_in_sector = file_info->file_pointer % 512;
+	Phat_SetFileUnsynced(file_info, file_info->file_pointer < file_info->file_size ? file_info->file_pointer : file_info->file_size);
+
+	// Allocate the clusters for the whole request before writing any data
+	ret = Phat_ReserveFileClusters(file_info, file_info->file_pointer + (FileSize_t)bytes_to_write);
+	if (ret != PhatState_OK) return ret;
+	if (file_info->file_pointer > file_info->file_size)
+	{
+		ret = Phat_ZeroFileGap(file_info);
+		if (ret != PhatState_OK) return ret;
+	}
+	if (offset_in_sector)
+	{
+		size_t to_copy;
+		ret = Phat_GetCurFilePointerLBA(file_info, &FPLBA, 1);
+		if (ret != PhatState_OK) return ret;
+		ret = Phat_LoadFileSectorBuffer(file_info, FPLBA, 1, &sector_buffer);
+		if (ret != PhatState_OK) return ret;
+		to_copy = 512 - offset_in_sector;
+		if (to_copy > bytes_to_write) to_copy = bytes_to_write;
+		memcpy(&sector_buffer[offset_in_sector], buffer, to_copy);
+		ret = Phat_WriteFileSectors(phat, FPLBA, 1, sector_buffer);
+		if (ret != PhatState_OK) return ret;
+		file_info->modified = 1;
+		buffer = (uint8_t *)buffer + to_copy;
+		bytes_to_write -= to_copy;
+		file_info->file_pointer += (FileSize_t)to_copy;
+		*bytes_written += to_copy;
+	}
+	sectors_to_write = bytes_to_write / 512;
+	while (sectors_to_write)
+	{
+		size_t continuous_sectors;
+		ret = Phat_GetCurFilePointerLBA(file_info, &FPLBA, 1);
+		if (ret != PhatState_OK) return ret;
+
+		// Write the physically adjacent clusters with one driver call
+		ret = Phat_GetContiguousSectors(file_info, sectors_to_write, &continuous_sectors);
+		if (ret != PhatState_OK) return ret;
+		cached_buffer = Phat_GetFileSectorBuffer(file_info);
+		if (cached_buffer && cached_buffer->LBA >= FPLBA && cached_buffer->LBA - FPLBA < continuous_sectors)
+		{
+			memcpy(cached_buffer->data, (const uint8_t *)buffer + 512 * (cached_buffer->LBA - FPLBA), 512);
+		}
+		ret = Phat_WriteFileSectors(phat, FPLBA, continuous_sectors, buffer);
+		if (ret != PhatState_OK) return ret;
+		file_info->modified = 1;
+		sectors_to_write -= continuous_sectors;
+		buffer = (uint8_t *)buffer + 512 * continuous_sectors;
+		file_info->file_pointer += 512 * continuous_sectors;
+		*bytes_written += 512 * continuous_sectors;
+		bytes_to_write -= 512 * continuous_sectors;
+	}
+	if (bytes_to_write)
+	{
+		ret = Phat_GetCurFilePointerLBA(file_info, &FPLBA, 1);
+		if (ret != PhatState_OK) return ret;
+		// The rest of the sector is read only if it's still in the file
+		ret = Phat_LoadFileSectorBuffer(file_info, FPLBA, file_info->file_pointer + bytes_to_write < file_info->file_size, &sector_buffer);
+		if (ret != PhatState_OK) return ret;
+		memcpy(sector_buffer, buffer, bytes_to_write);
+		ret = Phat_WriteFileSectors(phat, FPLBA, 1, sector_buffer);
+		if (ret != PhatState_OK) return ret;
+		file_info->modified = 1;
+		file_info->file_pointer += (FileSize_t)bytes_to_write;
+		*bytes_written += bytes_to_write;
+	}
+	if (file_info->file_pointer > file_info->file_size) file_info->file_size = file_info->file_pointer;
+	return PhatState_OK;
+}
+
+// Write the collected data of the write-behind buffer to the disk
+PHAT_STATIC_FUNC PhatState Phat_FlushWriteBehind(Phat_FileInfo_p file_info)
+{
+	PhatState ret;
+	FileSize_t file_pointer = file_info->file_pointer;
+	size_t bytes_written;
+
+	if (!file_info->write_behind_bytes) return PhatState_OK;
+	file_info->file_pointer = file_info->write_behind_position;
+	ret = Phat_WriteFileData(file_info, file_info->write_behind_buffer, file_info->write_behind_bytes, &bytes_written);
+	file_info->file_pointer = file_pointer;
+	if (ret != PhatState_OK) return ret;
+	file_info->write_behind_bytes = 0;
+	return PhatState_OK;
+}
+
+PHAT_FUNC PhatState Phat_WriteFile(Phat_FileInfo_p file_info, const void *buffer, size_t bytes_to_write, size_t *bytes_written)
+{
+	PhatState ret = PhatState_OK;
+	Phat_p phat = file_info->phat;
+	static size_t dummy;
+
+	// Check parameters
+	if (!file_info || !buffer || !bytes_to_write) return PhatState_InvalidParameter;
+	if (file_info->readonly || !phat->write_enable) return PhatState_ReadOnly;
+	if (!bytes_written) bytes_written = &dummy;
+	*bytes_written = 0;
+	ret = Phat_AcquireSharedFile(file_info);
+	if (ret != PhatState_OK) return ret;
+	file_info->read_ahead_sectors = 0;
+	if (file_info->append) file_info->file_pointer = file_info->file_size;
+	if (file_info->write_behind_buffer)
+	{
+		// Only the data that continues the collected data and fits into the buffer is collected
+		if (file_info->write_behind_bytes &&
+			(file_info->file_pointer != file_info->write_behind_position + file_info->write_behind_bytes ||
+			bytes_to_write > file_info->write_behind_buffer_size - file_info->write_behind_bytes))
+		{
+			ret = Phat_FlushWriteBehind(file_info);
 			if (ret != PhatState_OK) return ret;
 		}
+		if (bytes_to_write < file_info->write_behind_buffer_size && file_info->file_pointer <= file_info->file_size)
+		{
+			// The clusters are reserved now, so running out of space is reported by this call instead of by the flush
+			if (file_info->file_pointer + (FileSize_t)bytes_to_write > file_info->file_size)
+			{
+				ret = Phat_ReserveFileClusters(file_info, file_info->file_pointer + (FileSize_t)bytes_to_write);
+				if (ret != PhatState_OK) return ret;
+			}
+			if (!file_info->write_behind_bytes)
+			{
+				file_info->write_behind_position = file_info->file_pointer;
+				file_info->write_behind_file_size = file_info->file_size;
+			}
+			memcpy(&file_info->write_behind_buffer[file_info->write_behind_bytes], buffer, bytes_to_write);
+			file_info->write_behind_bytes += bytes_to_write;
+			file_info->file_pointer += (FileSize_t)bytes_to_write;
+			if (file_info->file_pointer > file_info->file_size) file_info->file_size = file_info->file_pointer;
+			file_info->modified = 1;
+			*bytes_written = bytes_to_write;
+			if (file_info->write_behind_bytes == file_info->write_behind_buffer_size)
+				return Phat_FlushWriteBehind(file_info);
+			return PhatState_OK;
+		}
 	}
-	memset(&dir_item, 0, sizeof dir_item);
-	memcpy(dir_item.file_name_8_3, name83, 11);
-	dir_item.attributes = attrib;
-	dir_item.creation_date = Phat_EncodeDate(&phat->cur_date);
-	dir_item.creation_time = Phat_EncodeTime(&phat->cur_time);
-	dir_item.creation_time_tenths = 0;
-	dir_item.last_modification_date = Phat_EncodeDate(&phat->cur_date);
-	dir_item.last_modification_time = Phat_EncodeTime(&phat->cur_time);
-	dir_item.last_access_date = Phat_EncodeDate(&phat->cur_date);
-	dir_item.first_cluster_low = first_cluster & 0xFFFF;
-	dir_item.first_cluster_high = first_cluster >> 16;
-	dir_item.file_size = 0;
-	ret = Phat_PutDirItem(dir_info, &dir_item);
-	if (ret != PhatState_OK)
+	return Phat_WriteFileData(file_info, buffer, bytes_to_write, bytes_written);
+}
+
+PHAT_FUNC PhatState Phat_WriteFileAt(Phat_FileInfo_p file_info, FileSize_t offset, const void *buffer, size_t bytes_to_write, size_t *bytes_written)
+{
+	PhatState ret = PhatState_OK;
+	Phat_p phat;
+	FileSize_t file_pointer = offset;
+	static size_t dummy;
+
+	// Check parameters
+	if (!file_info || !buffer || !bytes_to_write) return PhatState_InvalidParameter;
+	phat = file_info->phat;
+	if (file_info->readonly || !phat->write_enable) return PhatState_ReadOnly;
+	if (!bytes_written) bytes_written = &dummy;
+	*bytes_written = 0;
+	ret = Phat_AcquireSharedFile(file_info);
+	if (ret != PhatState_OK) return ret;
+	ret = Phat_FlushWriteBehind(file_info);
+	if (ret != PhatState_OK) return ret;
+	file_info->read_ahead_sectors = 0;
+	if (file_info->append) file_pointer = file_info->file_size;
+
+	Phat_SwapFileCursor(file_info, &file_pointer);
+	ret = Phat_WriteFileData(file_info, buffer, bytes_to_write, bytes_written);
+	Phat_SwapFileCursor(file_info, &file_pointer);
+	return ret;
+}
+
+PHAT_FUNC PhatState Phat_SetFileWriteBehind(Phat_FileInfo_p file_info, void *buffer, size_t buffer_size)
+{
+	PhatState ret;
+
+	// Check parameters
+	if (!file_info) return PhatState_InvalidParameter;
+	if (buffer && buffer_size < 512) return PhatState_InvalidParameter;
+
+	ret = Phat_FlushWriteBehind(file_info);
+	if (ret != PhatState_OK) return ret;
+	file_info->write_behind_buffer = buffer;
+	file_info->write_behind_buffer_size = buffer ? buffer_size : 0;
+	return PhatState_OK;
+}
+
+PHAT_FUNC PhatState Phat_DiscardFileWriteBehind(Phat_FileInfo_p file_info)
+{
+	// Check parameters
+	if (!file_info) return PhatState_InvalidParameter;
+
+	// Another handle of the file would have flushed it when taking over, only the holder has collected data
+	if (!file_info->write_behind_bytes) return PhatState_OK;
+	if (file_info->file_size > file_info->write_behind_file_size)
+	{
+		// The clusters reserved for the dropped data are freed by `Phat_CloseFile()`
+		file_info->file_size = file_info->write_behind_file_size;
+		file_info->release_unused = 1;
+	}
+	if (file_info->file_pointer > file_info->file_size) file_info->file_pointer = file_info->file_size;
+	file_info->write_behind_bytes = 0;
+	return PhatState_OK;
+}
+
+PHAT_FUNC PhatState Phat_WriteFileDirect(Phat_FileInfo_p file_info, const void *buffer, size_t bytes_to_write, size_t *bytes_written)
+{
+	PhatState ret = PhatState_OK;
+	Phat_p phat;
+	LBA_t FPLBA;
+	size_t sectors_to_write;
+	size_t continuous_sectors;
+	static size_t dummy;
+
+	// Check parameters
+	if (!file_info || !buffer || !bytes_to_write) return PhatState_InvalidParameter;
+	ret = Phat_AcquireSharedFile(file_info);
+	if (ret != PhatState_OK) return ret;
+	if (file_info->append) file_info->file_pointer = file_info->file_size;
+	if (file_info->file_pointer % 512 || bytes_to_write % 512) return PhatState_InvalidParameter;
+	phat = file_info->phat;
+	if (file_info->readonly || !phat->write_enable) return PhatState_ReadOnly;
+	if (!bytes_written) bytes_written = &dummy;
+	*bytes_written = 0;
+	ret = Phat_FlushWriteBehind(file_info);
+	if (ret != PhatState_OK) return ret;
+	file_info->read_ahead_sectors = 0;
+	Phat_DropFileSectorBuffer(file_info);
+	Phat_SetFileUnsynced(file_info, file_info->file_pointer < file_info->file_size ? file_info->file_pointer : file_info->file_size);
+
+	ret = Phat_ReserveFileClusters(file_info, file_info->file_pointer + (FileSize_t)bytes_to_write);
+	if (ret != PhatState_OK) return ret;
+	if (file_info->file_pointer > file_info->file_size)
 	{
-		if (first_cluster > 2) Phat_UnlinkCluster(phat, first_cluster);
-		return ret;
+		ret = Phat_ZeroFileGap(file_info);
+		if (ret != PhatState_OK) return ret;
+	}
+	sectors_to_write = bytes_to_write / 512;
+	while (sectors_to_write)
+	{
+		ret = Phat_GetCurFilePointerLBA(file_info, &FPLBA, 0);
+		if (ret != PhatState_OK) return ret;
+		ret = Phat_GetContiguousSectors(file_info, sectors_to_write, &continuous_sectors);
+		if (ret != PhatState_OK) return ret;
+		if (!phat->driver.fn_write_sector(buffer, FPLBA, continuous_sectors, phat->driver.userdata))
+		{
+			return PhatState_WriteFail;
+		}
+		Phat_UpdateDataPages(phat, FPLBA, continuous_sectors, buffer);
+		file_info->modified = 1;
+		sectors_to_write -= continuous_sectors;
+		buffer = (const uint8_t *)buffer + 512 * continuous_sectors;
+		file_info->file_pointer += 512 * continuous_sectors;
+		*bytes_written += 512 * continuous_sectors;
+		if (file_info->file_pointer > file_info->file_size) file_info->file_size = file_info->file_pointer;
 	}
 	return PhatState_OK;
 }
 
-PHAT_FUNC PhatState Phat_OpenFile(Phat_DirInfo_p dir_info, const WChar_p path, PhatBool_t readonly, Phat_FileInfo_p file_info)
+PHAT_FUNC PhatState Phat_AllocateFileSpace(Phat_FileInfo_p file_info, FileSize_t bytes, PhatBool_t keep_size)
 {
+	PhatState ret = PhatState_OK;
 	Phat_p phat;
-	PhatState ret;
-	WChar_p p;
-	WChar_p ch;
-	size_t dirname_len;
+	Cluster_t cluster_size;
+	Cluster_t clusters_wanted;
+	Cluster_t num_clusters;
+	Cluster_t last_cluster;
+	Cluster_t next_cluster;
+	Cluster_t new_cluster;
 
 	// Check parameters
-	if (!dir_info || !path || !file_info) return PhatState_InvalidParameter;
+	if (!file_info || !file_info->phat) return PhatState_InvalidParameter;
+	phat = file_info->phat;
+	if (file_info->readonly || !phat->write_enable) return PhatState_ReadOnly;
+	ret = Phat_AcquireSharedFile(file_info);
+	if (ret != PhatState_OK) return ret;
+	if (!bytes) return PhatState_OK;
+	Phat_SetFileUnsynced(file_info, file_info->file_size);
 
-	phat = dir_info->phat;
-	memset(file_info, 0, sizeof * file_info);
-	file_info->phat = phat;
-	ret = Phat_FindItem(phat, path, dir_info, &p);
-	if (ret == PhatState_EndOfDirectory)
+	cluster_size = (Cluster_t)phat->sectors_per_cluster * phat->bytes_per_sector;
+	clusters_wanted = (bytes - 1) / cluster_size + 1;
+	if (file_info->first_cluster)
 	{
-		if (readonly) return PhatState_FileNotFound;
+		// Find the end of the chain, starting from the cluster that the file pointer is in
+		last_cluster = file_info->first_cluster;
+		num_clusters = 1;
+		if (file_info->cur_cluster >= 2 && file_info->cur_cluster_index)
+		{
+			last_cluster = file_info->cur_cluster;
+			num_clusters = file_info->cur_cluster_index + 1;
+		}
 		for (;;)
 		{
-			ch = p;
-			while (*ch && *ch != L'/' && *ch != L'\\') ch++;
-			dirname_len = (size_t)(ch - p);
-			if (dirname_len > MAX_LFN) return PhatState_NameTooLong;
-			if (*ch)
-			{
-				Phat_CloseDir(dir_info);
-				return PhatState_DirectoryNotFound;
-			}
-			else
-			{
-				ret = Phat_MarkDirty(phat, 1, 1);
-				if (ret != PhatState_OK) return ret;
-				memcpy(phat->filename_buffer, p, dirname_len * sizeof(WChar_t));
-				phat->filename_buffer[dirname_len] = 0;
-				ret = Phat_CreateNewItemInDir(dir_info, phat->filename_buffer, 0);
-				if (ret != PhatState_OK) return ret;
-				ret = Phat_FindItem(phat, phat->filename_buffer, dir_info, NULL);
-				if (ret != PhatState_OK) return ret;
-				break;
-			}
+			ret = Phat_GetFATNextCluster(phat, last_cluster, &next_cluster);
+			if (ret == PhatState_EndOfFATChain) break;
+			if (ret != PhatState_OK) return ret;
+			last_cluster = next_cluster;
+			num_clusters++;
+		}
+		if (num_clusters < clusters_wanted)
+		{
+			ret = Phat_AllocateClusters(phat, last_cluster, clusters_wanted - num_clusters, &new_cluster);
+			if (ret != PhatState_OK) return ret;
 		}
 	}
-	else if (ret == PhatState_OK)
+	else
 	{
-		if (dir_info->attributes & ATTRIB_DIRECTORY)
+		ret = Phat_AllocateClusters(phat, 0, clusters_wanted, &new_cluster);
+		if (ret != PhatState_OK) return ret;
+		ret = Phat_SetFileFirstCluster(file_info, new_cluster);
+		if (ret != PhatState_OK)
 		{
-			Phat_CloseDir(dir_info);
-			return PhatState_IsADirectory;
+			Phat_UnlinkCluster(phat, new_cluster);
+			return ret;
 		}
 	}
-	else
+	if (bytes > file_info->file_size)
 	{
-		// Error
-		Phat_CloseDir(dir_info);
-		return ret;
+		// The clusters beyond the file size are freed when the file is closed, the directory entry is rewritten then
+		if (keep_size) file_info->release_unused = 1;
+		else file_info->file_size = bytes;
+		file_info->modified = 1;
 	}
-	file_info->modified = 0;
-	file_info->first_cluster = dir_info->first_cluster;
-	file_info->cur_cluster = dir_info->first_cluster;
-	file_info->file_size = dir_info->file_size;
-	file_info->readonly = readonly || ((dir_info->attributes & ATTRIB_READ_ONLY) != 0);
-	file_info->file_pointer = 0;
-	file_info->cur_cluster_index = 0;
-	file_info->sector_buffer_is_valid = 0;
 	return PhatState_OK;
 }
 
-PHAT_FUNC PhatState Phat_OpenFileFromRoot(Phat_p phat, const WChar_p path, PhatBool_t readonly, Phat_FileInfo_p file_info)
-{
-	Phat_DirInfo_p dir_info;
-
-	// Check parameters
-	if (!phat || !path || !file_info) return PhatState_InvalidParameter;
-	file_info->phat = phat;
-	if (!readonly && !phat->write_enable) return PhatState_ReadOnly;
-
-	dir_info = &file_info->file_item;
-	Phat_OpenRootDir(phat, dir_info);
-	return Phat_OpenFile(dir_info, path, readonly, file_info);
-}
-
-PHAT_STATIC_FUNC PhatState Phat_UpdateClusterByFilePointer(Phat_FileInfo_p file_info, PhatBool_t allocate_new_sectors)
+// Free the clusters of the chain beyond the file size, the directory entry is left to the caller.
+// The cluster cursors that were in the freed clusters go back to the start of the file.
+PHAT_STATIC_FUNC PhatState Phat_ReleaseUnusedClusters(Phat_FileInfo_p file_info)
 {
-	PhatState ret = PhatState_OK;
+	PhatState ret;
 	Phat_p phat = file_info->phat;
+	Cluster_t cluster_size = (Cluster_t)phat->sectors_per_cluster * phat->bytes_per_sector;
+	Cluster_t keep_clusters;
+	Cluster_t cluster = file_info->first_cluster;
 	Cluster_t cluster_index;
 	Cluster_t next_cluster;
-	cluster_index = file_info->file_pointer / ((Cluster_t)phat->sectors_per_cluster * phat->bytes_per_sector);
-	if (file_info->cur_cluster_index > cluster_index)
+
+	if (!cluster) return PhatState_OK;
+	keep_clusters = file_info->file_size ? (Cluster_t)((file_info->file_size - 1) / cluster_size + 1) : 0;
+	Phat_DropFileSectorBuffer(file_info);
+	if (file_info->shared)
 	{
+		// The cluster cursors of the other handles of the file could be in the freed clusters
+		file_info->seen_release_count = ++file_info->shared->release_count;
+		file_info->shared->cluster = 0;
+		file_info->shared->cluster_index = 0;
+	}
+	if (file_info->cur_cluster_index >= keep_clusters)
+	{
+		file_info->cur_cluster = cluster;
 		file_info->cur_cluster_index = 0;
-		file_info->cur_cluster = file_info->first_cluster;
 	}
-	while (file_info->cur_cluster_index < cluster_index)
+	if (file_info->at_cluster_index >= keep_clusters)
 	{
-		ret = Phat_GetFATNextCluster(phat, file_info->cur_cluster, &next_cluster);
-		if (ret == PhatState_EndOfFATChain)
-		{
-			if (!allocate_new_sectors) return PhatState_EndOfFile;
-			// Allocate a new cluster
-			next_cluster = file_info->cur_cluster + 1;
-			ret = Phat_AllocateCluster(phat, &next_cluster);
-			if (ret != PhatState_OK) return ret;
-			ret = Phat_WriteFAT(phat, file_info->cur_cluster, next_cluster, 0);
-			if (ret != PhatState_OK) return ret;
-			file_info->cur_cluster = next_cluster;
-			ret = Phat_WipeCluster(phat, next_cluster);
-			if (ret != PhatState_OK) return ret;
-		}
-		else if (ret != PhatState_OK)
-			return ret;
-		file_info->cur_cluster_index++;
-		file_info->cur_cluster = next_cluster;
+		file_info->at_cluster = cluster;
+		file_info->at_cluster_index = 0;
+	}
+	if (!keep_clusters)
+	{
+		file_info->first_cluster = 0;
+		file_info->cur_cluster = 0;
+		file_info->at_cluster = 0;
+		return Phat_UnlinkCluster(phat, cluster);
 	}
-	return PhatState_OK;
-}
 
-PHAT_STATIC_FUNC PhatState Phat_GetCurFilePointerLBA(Phat_FileInfo_p file_info, LBA_p LBA_out, PhatBool_t allocate_new_sectors)
-{
-	PhatState ret = Phat_UpdateClusterByFilePointer(file_info, allocate_new_sectors);
+	// Find the last cluster to keep, starting from the cluster cursor
+	cluster_index = 0;
+	if (file_info->cur_cluster >= 2)
+	{
+		cluster = file_info->cur_cluster;
+		cluster_index = file_info->cur_cluster_index;
+	}
+	for (;;)
+	{
+		ret = Phat_GetFATNextCluster(phat, cluster, &next_cluster);
+		if (ret == PhatState_EndOfFATChain) return PhatState_OK;
+		if (ret != PhatState_OK) return ret;
+		if (++cluster_index == keep_clusters) break;
+		cluster = next_cluster;
+	}
+
+	// Cut the chain, then free the rest of it in one pass over the FAT
+	ret = Phat_WriteFAT(phat, cluster, phat->end_of_cluster_chain, 0);
 	if (ret != PhatState_OK) return ret;
-	file_info->offset_in_cluster = (file_info->file_pointer / file_info->phat->bytes_per_sector) % file_info->phat->sectors_per_cluster;
-	*LBA_out = Phat_ClusterToLBA(file_info->phat, file_info->cur_cluster) + file_info->offset_in_cluster + file_info->phat->partition_start_LBA;
-	return PhatState_OK;
+	return Phat_UnlinkCluster(phat, next_cluster);
 }
 
-PHAT_FUNC PhatState Phat_ReadFile(Phat_FileInfo_p file_info, void *buffer, size_t bytes_to_read, size_t *bytes_read)
+PHAT_FUNC PhatState Phat_TruncateFile(Phat_FileInfo_p file_info, FileSize_t new_size)
 {
-	PhatState ret = PhatState_OK;
-	Phat_p phat = file_info->phat;
-	uint16_t offset_in_sector;
-	LBA_t FPLBA;
-	size_t sectors_to_read;
-	static size_t dummy;
+	PhatState ret;
+	Phat_p phat;
+	Phat_SectorCache_p cached_sector;
+	Phat_DirItem_p dir_item;
+	FileSize_t file_pointer;
 
 	// Check parameters
-	if (!file_info || !buffer || !bytes_to_read) return PhatState_InvalidParameter;
-	if (!bytes_read) bytes_read = &dummy;
-	*bytes_read = 0;
-	if (file_info->first_cluster == 0) return PhatState_EndOfFile;
-	if (file_info->file_pointer >= file_info->file_size) return PhatState_EndOfFile;
-	if (file_info->file_pointer + bytes_to_read > file_info->file_size)
-		bytes_to_read = file_info->file_size - file_info->file_pointer;
-	offset_in_sector = file_info->file_pointer % 512;
-	if (offset_in_sector)
+	if (!file_info || !file_info->phat) return PhatState_InvalidParameter;
+	phat = file_info->phat;
+	if (file_info->readonly || !phat->write_enable) return PhatState_ReadOnly;
+
+	ret = Phat_AcquireSharedFile(file_info);
+	if (ret != PhatState_OK) return ret;
+	ret = Phat_FlushWriteBehind(file_info);
+	if (ret != PhatState_OK) return ret;
+	file_info->read_ahead_sectors = 0;
+	Phat_SetFileUnsynced(file_info, new_size < file_info->file_size ? new_size : file_info->file_size);
+
+	if (new_size > file_info->file_size)
 	{
-		size_t to_copy;
-		ret = Phat_GetCurFilePointerLBA(file_info, &FPLBA, 0);
+		// Grow the file with zeros, the same as writing after seeking past the end
+		ret = Phat_ReserveFileClusters(file_info, new_size);
 		if (ret != PhatState_OK) return ret;
-		if (file_info->sector_buffer_LBA != FPLBA || !file_info->sector_buffer_is_valid)
-		{
-			ret = Phat_ReadSectorsWithoutCache(phat, FPLBA, 1, file_info->sector_buffer);
-			if (ret != PhatState_OK) return ret;
-			file_info->sector_buffer_LBA = FPLBA;
-			file_info->sector_buffer_is_valid = 1;
-		}
-		to_copy = 512 - offset_in_sector;
-		if (to_copy > bytes_to_read) to_copy = bytes_to_read;
-		memcpy(buffer, &file_info->sector_buffer[offset_in_sector], to_copy);
-		buffer = (uint8_t *)buffer + to_copy;
-		bytes_to_read -= to_copy;
-		file_info->file_pointer += (FileSize_t)to_copy;
-		*bytes_read += to_copy;
-	}
-	sectors_to_read = bytes_to_read / 512;
-	while (sectors_to_read)
-	{
-		uint8_t continuous_sectors;
-		ret = Phat_GetCurFilePointerLBA(file_info, &FPLBA, 0);
+		file_pointer = file_info->file_pointer;
+		file_info->file_pointer = new_size;
+		ret = Phat_ZeroFileGap(file_info);
+		file_info->file_pointer = file_pointer;
 		if (ret != PhatState_OK) return ret;
-		if (FPLBA == file_info->sector_buffer_LBA && file_info->sector_buffer_is_valid)
-		{
-			continuous_sectors = 1;
-			memcpy(buffer, file_info->sector_buffer, 512);
-		}
-		else
-		{
-			continuous_sectors = phat->sectors_per_cluster - file_info->offset_in_cluster;
-			if (continuous_sectors > sectors_to_read) continuous_sectors = (uint8_t)sectors_to_read;
-			ret = Phat_ReadSectorsWithoutCache(phat, FPLBA, continuous_sectors, buffer);
-			if (ret != PhatState_OK) return ret;
-		}
-		sectors_to_read -= continuous_sectors;
-		buffer = (uint8_t *)buffer + 512 * continuous_sectors;
-		file_info->file_pointer += 512 * continuous_sectors;
-		*bytes_read += 512 * continuous_sectors;
-		bytes_to_read -= 512 * continuous_sectors;
+		file_info->file_size = new_size;
+		file_info->modified = 1;
+		return PhatState_OK;
 	}
-	if (bytes_to_read)
+
+	// Shorten the directory entry first, a failure afterwards leaves lost clusters instead of a file longer than its chain
+	ret = Phat_GetFileDirItemSector(file_info, &cached_sector, &dir_item);
+	if (ret != PhatState_OK) return ret;
+	dir_item->file_size = new_size;
+	if (!new_size)
 	{
-		ret = Phat_GetCurFilePointerLBA(file_info, &FPLBA, 0);
-		if (ret != PhatState_OK) return ret;
-		if (file_info->sector_buffer_LBA != FPLBA || !file_info->sector_buffer_is_valid)
-		{
-			ret = Phat_ReadSectorsWithoutCache(phat, FPLBA, 1, file_info->sector_buffer);
-			if (ret != PhatState_OK) return ret;
-			file_info->sector_buffer_LBA = FPLBA;
-			file_info->sector_buffer_is_valid = 1;
-		}
-		memcpy(buffer, file_info->sector_buffer, bytes_to_read);
-		file_info->file_pointer += (FileSize_t)bytes_to_read;
-		*bytes_read += bytes_to_read;
+		dir_item->first_cluster_low = 0;
+		dir_item->first_cluster_high = 0;
 	}
-	return file_info->file_pointer >= file_info->file_size ? PhatState_EndOfFile : PhatState_OK;
+	Phat_SetCachedSectorModified(cached_sector);
+	file_info->file_size = new_size;
+	file_info->modified = 1;
+	return Phat_ReleaseUnusedClusters(file_info);
 }
 
-PHAT_FUNC PhatState Phat_WriteFile(Phat_FileInfo_p file_info, const void *buffer, size_t bytes_to_write, size_t *bytes_written)
+PHAT_FUNC PhatState Phat_SeekFile(Phat_FileInfo_p file_info, FileSize_t position)
 {
-	PhatState ret = PhatState_OK;
-	Phat_p phat = file_info->phat;
-	uint16_t offset_in_sector;
-	LBA_t FPLBA;
-	size_t sectors_to_write;
-	static size_t dummy;
-	Phat_DirInfo_p dir_info = &file_info->file_item;
+	PhatState ret;
 
 	// Check parameters
-	if (!file_info || !buffer || !bytes_to_write) return PhatState_InvalidParameter;
-	if (file_info->readonly || !phat->write_enable) return PhatState_ReadOnly;
-	if (file_info->file_item.attributes & ATTRIB_READ_ONLY) return PhatState_ReadOnly;
-	if (!bytes_written) bytes_written = &dummy;
-	*bytes_written = 0;
-	offset_in_sector = file_info->file_pointer % 512;
-	if (file_info->first_cluster == 0)
+	if (!file_info) return PhatState_InvalidParameter;
+	ret = Phat_AcquireSharedFile(file_info);
+	if (ret != PhatState_OK) return ret;
+
+	if (position != file_info->file_pointer)
 	{
-		// Allocate cluster for empty file
-		Cluster_t new_cluster = 0;
-		Phat_DirItem_t dir_item;
-		ret = Phat_AllocateCluster(phat, &new_cluster);
-		if (ret != PhatState_OK) return ret;
-		ret = Phat_GetDirItem(dir_info, &dir_item);
-		if (ret != PhatState_OK) return ret;
-		dir_item.first_cluster_low = new_cluster & 0xFFFF;
-		dir_item.first_cluster_high = new_cluster >> 16;
-		ret = Phat_PutDirItem(dir_info, &dir_item);
+		ret = Phat_FlushWriteBehind(file_info);
 		if (ret != PhatState_OK) return ret;
-		file_info->first_cluster = new_cluster;
-		file_info->cur_cluster = new_cluster;
 	}
-	if (offset_in_sector)
+	file_info->file_pointer = position;
+	if (Phat_IsEOF(file_info)) return PhatState_EndOfFile;
+	else return PhatState_OK;
+}
+
+PHAT_FUNC void Phat_GetFilePointer(Phat_FileInfo_p file_info, FileSize_t *position)
+{
+	*position = file_info->file_pointer;
+}
+
+PHAT_FUNC void Phat_GetFileSize(Phat_FileInfo_p file_info, FileSize_t *size)
+{
+	*size = Phat_GetSharedFileSize(file_info);
+}
+
+PHAT_FUNC PhatState Phat_GetFileExtents(Phat_FileInfo_p file_info, Phat_FileExtent_p extents, size_t max_extents, size_t *num_extents)
+{
+	PhatState ret;
+	Phat_p phat;
+	FileSize_t sectors_left;
+	FileSize_t file_offset = 0;
+	Cluster_t cluster;
+	Cluster_t next_cluster = 0;
+	Cluster_t run_start;
+	LBA_t run_LBA;
+	LBA_t run_sectors;
+	size_t count = 0;
+
+	// Check parameters
+	if (!file_info || !num_extents || (!extents && max_extents)) return PhatState_InvalidParameter;
+	phat = file_info->phat;
+	*num_extents = 0;
+	ret = Phat_AcquireSharedFile(file_info);
+	if (ret != PhatState_OK) return ret;
+	ret = Phat_FlushWriteBehind(file_info);
+	if (ret != PhatState_OK) return ret;
+	if (!file_info->first_cluster || !file_info->file_size) return PhatState_OK;
+
+	sectors_left = (file_info->file_size - 1) / 512 + 1;
+	cluster = file_info->first_cluster;
+	while (sectors_left)
 	{
-		size_t to_copy;
-		ret = Phat_GetCurFilePointerLBA(file_info, &FPLBA, 1);
-		if (ret != PhatState_OK) return ret;
-		if (file_info->sector_buffer_LBA != FPLBA || !file_info->sector_buffer_is_valid)
+		// Follow the chain while the next cluster is adjacent
+		run_start = cluster;
+		run_sectors = phat->sectors_per_cluster;
+		while (run_sectors < sectors_left)
 		{
-			ret = Phat_ReadSectorsWithoutCache(phat, FPLBA, 1, file_info->sector_buffer);
+			ret = Phat_GetFATNextCluster(phat, cluster, &next_cluster);
+			if (ret == PhatState_EndOfFATChain) return PhatState_FATError;
 			if (ret != PhatState_OK) return ret;
-			file_info->sector_buffer_LBA = FPLBA;
-			file_info->sector_buffer_is_valid = 1;
+			if (next_cluster != cluster + 1) break;
+			cluster = next_cluster;
+			run_sectors += phat->sectors_per_cluster;
 		}
-		to_copy = 512 - offset_in_sector;
-		if (to_copy > bytes_to_write) to_copy = bytes_to_write;
-		memcpy(&file_info->sector_buffer[offset_in_sector], buffer, to_copy);
-		ret = Phat_WriteSectorsWithoutCache(phat, FPLBA, 1, file_info->sector_buffer);
+		if (run_sectors > sectors_left) run_sectors = sectors_left;
+		run_LBA = Phat_ClusterToLBA(phat, run_start) + phat->partition_start_LBA;
+
+		// The caller reads the sectors from the driver, the data cache must not hold newer data of them
+		ret = Phat_WriteBackDataPageRange(phat, run_LBA, run_sectors);
 		if (ret != PhatState_OK) return ret;
-		file_info->modified = 1;
-		buffer = (uint8_t *)buffer + to_copy;
-		bytes_to_write -= to_copy;
-		file_info->file_pointer += (FileSize_t)to_copy;
-		*bytes_written += to_copy;
-	}
-	sectors_to_write = bytes_to_write / 512;
-	while (sectors_to_write)
+		if (count < max_extents)
+		{
+			extents[count].file_offset = file_offset;
+			extents[count].LBA = run_LBA;
+			extents[count].num_sectors = run_sectors;
+		}
+		count++;
+		file_offset += (FileSize_t)run_sectors * 512;
+		sectors_left -= (FileSize_t)run_sectors;
+		cluster = next_cluster;
+	}
+	*num_extents = count;
+	return PhatState_OK;
+}
+
+PHAT_FUNC PhatBool_t Phat_IsEOF(Phat_FileInfo_p file_info)
+{
+	return file_info->file_pointer >= Phat_GetSharedFileSize(file_info);
+}
+
+// Write back the modified sectors of the FATs that hold the entries from `first_sector` to `last_sector` of the first FAT,
+// from the sector cache and from the resident FAT window
+PHAT_STATIC_FUNC PhatState Phat_WriteBackFATSectors(Phat_p phat, LBA_t first_sector, LBA_t last_sector)
+{
+	PhatState ret;
+	LBA_t FAT_LBA = phat->partition_start_LBA + phat->FAT1_start_LBA;
+
+	for (size_t i = 0; i < PHAT_CACHED_SECTORS; i++)
 	{
-		uint8_t continuous_sectors;
-		ret = Phat_GetCurFilePointerLBA(file_info, &FPLBA, 1);
-		if (ret != PhatState_OK) return ret;
-		if (FPLBA == file_info->sector_buffer_LBA && file_info->sector_buffer_is_valid)
+		Phat_SectorCache_p cached_sector = &phat->cache[i];
+		if (!Phat_IsCachedSectorValid(cached_sector) || Phat_IsCachedSectorSync(cached_sector)) continue;
+		for (LBA_t j = 0; j < phat->num_FATs; j++)
 		{
-			memcpy(file_info->sector_buffer, buffer, 512);
+			LBA_t LBA = FAT_LBA + j * phat->FAT_size_in_sectors;
+			if (cached_sector->LBA >= LBA + first_sector && cached_sector->LBA <= LBA + last_sector)
+			{
+				ret = Phat_WriteBackCachedSector(phat, cached_sector);
+				if (ret != PhatState_OK) return ret;
+				break;
+			}
 		}
-		continuous_sectors = phat->sectors_per_cluster - file_info->offset_in_cluster;
-		if (continuous_sectors > sectors_to_write) continuous_sectors = (uint8_t)sectors_to_write;
-		ret = Phat_WriteSectorsWithoutCache(phat, FPLBA, continuous_sectors, buffer);
-		if (ret != PhatState_OK) return ret;
-		file_info->modified = 1;
-		sectors_to_write -= continuous_sectors;
-		buffer = (uint8_t *)buffer + 512 * continuous_sectors;
-		file_info->file_pointer += 512 * continuous_sectors;
-		*bytes_written += 512 * continuous_sectors;
-		bytes_to_write -= 512 * continuous_sectors;
 	}
-	if (bytes_to_write)
+	for (LBA_t i = first_sector; i <= last_sector; i++)
 	{
-		ret = Phat_GetCurFilePointerLBA(file_info, &FPLBA, 1);
+		LBA_t index = i - phat->resident_FAT_first_sector;
+		if (index >= phat->resident_FAT_num_sectors) continue;
+		if (!(phat->resident_FAT_modified[index >> 3] & (1 << (index & 7)))) continue;
+		ret = Phat_WriteResidentFATSectors(phat, index, 1);
 		if (ret != PhatState_OK) return ret;
-		memset(file_info->sector_buffer, 0, sizeof file_info->sector_buffer);
-		memcpy(file_info->sector_buffer, buffer, bytes_to_write);
-		file_info->sector_buffer_LBA = FPLBA;
-		file_info->sector_buffer_is_valid = 1;
-		ret = Phat_WriteSectorsWithoutCache(phat, FPLBA, 1, file_info->sector_buffer);
-		if (ret != PhatState_OK) return ret;
-		file_info->modified = 1;
-		file_info->file_pointer += (FileSize_t)bytes_to_write;
-		*bytes_written += bytes_to_write;
 	}
-	if (file_info->file_pointer > file_info->file_size) file_info->file_size = file_info->file_pointer;
 	return PhatState_OK;
 }
 
-PHAT_FUNC PhatState Phat_SeekFile(Phat_FileInfo_p file_info, FileSize_t position)
+// Write back the cached data and FAT entries of the cluster chain of a file, from the cluster that holds `offset` to the end of the chain.
+// The cluster before `offset` is included, its entry changes when the chain grows from a cluster boundary.
+PHAT_STATIC_FUNC PhatState Phat_WriteBackFileChain(Phat_FileInfo_p file_info, FileSize_t offset)
 {
-	// Check parameters
-	if (!file_info) return PhatState_InvalidParameter;
+	PhatState ret;
+	Phat_p phat = file_info->phat;
+	const Phat_FATCodec_t *codec = phat->FAT_codec;
+	Cluster_t cluster_size = (Cluster_t)phat->sectors_per_cluster * phat->bytes_per_sector;
+	FileSize_t file_pointer = offset ? (offset - 1) / cluster_size * cluster_size : 0;
+	Cluster_t cluster;
+	Cluster_t next_cluster = 0;
+	Cluster_t run_start;
+	LBA_t run_LBA;
+	LBA_t run_sectors;
+	PhatBool_t end_of_chain = 0;
+
+	if (file_info->first_cluster < 2) return PhatState_OK;
+
+	// Use the positional cursor, the cursor of the file pointer stays where it is
+	Phat_SwapFileCursor(file_info, &file_pointer);
+	ret = Phat_UpdateClusterByFilePointer(file_info, 0);
+	cluster = file_info->cur_cluster;
+	Phat_SwapFileCursor(file_info, &file_pointer);
+	if (ret == PhatState_EndOfFile) return PhatState_OK;
+	if (ret != PhatState_OK) return ret;
 
-	file_info->file_pointer = position;
-	if (Phat_IsEOF(file_info)) return PhatState_EndOfFile;
-	else return PhatState_OK;
-}
+	while (!end_of_chain)
+	{
+		run_start = cluster;
+		for (;;)
+		{
+			ret = Phat_GetFATNextCluster(phat, cluster, &next_cluster);
+			if (ret == PhatState_EndOfFATChain)
+			{
+				end_of_chain = 1;
+				break;
+			}
+			if (ret != PhatState_OK) return ret;
+			if (next_cluster != cluster + 1) break;
+			cluster = next_cluster;
+		}
 
-PHAT_FUNC void Phat_GetFilePointer(Phat_FileInfo_p file_info, FileSize_t *position)
-{
-	*position = file_info->file_pointer;
+		// The data goes before the FAT entries that refer to it
+		run_LBA = Phat_ClusterToLBA(phat, run_start) + phat->partition_start_LBA;
+		run_sectors = (LBA_t)(cluster - run_start + 1) * phat->sectors_per_cluster;
+		ret = Phat_WriteBackDataPageRange(phat, run_LBA, run_sectors);
+		if (ret != PhatState_OK) return ret;
+		ret = Phat_WriteBackFATSectors(phat, codec->entry_offset(run_start) >> phat->bytes_per_sector_shift,
+			(codec->entry_offset(cluster) + codec->entry_size - 1) >> phat->bytes_per_sector_shift);
+		if (ret != PhatState_OK) return ret;
+		cluster = next_cluster;
+	}
+	return PhatState_OK;
 }
 
-PHAT_FUNC void Phat_GetFileSize(Phat_FileInfo_p file_info, FileSize_t *size)
+// Update the directory entry of a file: the access date, and the size, modification time and first cluster if the file was modified.
+// `cached_sector_out` receives the cached sector of the entry if it's not NULL.
+PHAT_STATIC_FUNC PhatState Phat_UpdateFileDirItem(Phat_FileInfo_p file_info, Phat_SectorCache_p *cached_sector_out)
 {
-	*size = file_info->file_size;
-}
+	PhatState ret;
+	Phat_p phat = file_info->phat;
+	Phat_SectorCache_p cached_sector;
+	Phat_DirItem_p diritem;
+	Cluster_t first_cluster = file_info->first_cluster;
 
-PHAT_FUNC PhatBool_t Phat_IsEOF(Phat_FileInfo_p file_info)
-{
-	return file_info->file_pointer >= file_info->file_size;
+	ret = Phat_GetFileDirItemSector(file_info, &cached_sector, &diritem);
+	if (ret != PhatState_OK) return ret;
+
+	diritem->last_access_date = Phat_EncodeDate(&phat->cur_date);
+	if (file_info->modified)
+	{
+		// The clusters kept by `PHAT_OPEN_TRUNCATE` are freed when closing
+		if (file_info->release_unused && !file_info->file_size) first_cluster = 0;
+		diritem->last_modification_date = Phat_EncodeDate(&phat->cur_date);
+		diritem->last_modification_time = Phat_EncodeTime(&phat->cur_time);
+		diritem->file_size = file_info->file_size;
+		diritem->first_cluster_low = first_cluster & 0xFFFF;
+		diritem->first_cluster_high = first_cluster >> 16;
+	}
+	Phat_SetCachedSectorModified(cached_sector);
+	if (cached_sector_out) *cached_sector_out = cached_sector;
+	return PhatState_OK;
 }
 
 PHAT_FUNC PhatState Phat_CloseFile(Phat_FileInfo_p file_info)
 {
-	Phat_DirItem_t diritem;
 	PhatState ret;
 	Phat_p phat = file_info->phat;
-	Phat_DirInfo_p dir_info = &file_info->file_item;
 
 	// Check parameters
 	if (!file_info) return PhatState_InvalidParameter;
 
+	ret = Phat_AcquireSharedFile(file_info);
+	if (ret != PhatState_OK) return ret;
+	ret = Phat_FlushWriteBehind(file_info);
+	if (ret != PhatState_OK) return ret;
+	if (phat) Phat_SaveChainHint(file_info);
 	if (phat && phat->write_enable)
 	{
-		ret = Phat_GetDirItem(dir_info, &diritem);
+		ret = Phat_UpdateFileDirItem(file_info, NULL);
 		if (ret != PhatState_OK) return ret;
 
-		diritem.last_access_date = Phat_EncodeDate(&phat->cur_date);
-		if (file_info->modified)
+		// With other handles of the file still open, the last one to close frees the unused clusters
+		if (file_info->release_unused && (!file_info->shared || file_info->shared->num_handles == 1))
 		{
-			diritem.last_modification_date = Phat_EncodeDate(&phat->cur_date);
-			diritem.last_modification_time = Phat_EncodeTime(&phat->cur_time);
-			diritem.file_size = file_info->file_size;
+			ret = Phat_ReleaseUnusedClusters(file_info);
+			if (ret != PhatState_OK) return ret;
 		}
-		ret = Phat_PutDirItem(dir_info, &diritem);
-		if (ret != PhatState_OK) return ret;
 	}
 
-	Phat_CloseDir(dir_info);
+	Phat_DetachSharedFile(file_info);
+	Phat_DropFileSectorBuffer(file_info);
 	memset(file_info, 0, sizeof * file_info);
 	return PhatState_OK;
 }
 
+PHAT_FUNC PhatState Phat_SyncFile(Phat_FileInfo_p file_info)
+{
+	PhatState ret;
+	Phat_p phat;
+	Phat_SectorCache_p cached_sector;
+
+	// Check parameters
+	if (!file_info || !file_info->phat) return PhatState_InvalidParameter;
+	phat = file_info->phat;
+
+	ret = Phat_AcquireSharedFile(file_info);
+	if (ret != PhatState_OK) return ret;
+	ret = Phat_FlushWriteBehind(file_info);
+	if (ret != PhatState_OK) return ret;
+	if (file_info->readonly || !phat->write_enable) return PhatState_OK;
+	if (!file_info->modified && file_info->unsynced_from == (FileSize_t)-1) return PhatState_OK;
+
+	if (file_info->unsynced_from != (FileSize_t)-1)
+	{
+		ret = Phat_WriteBackFileChain(file_info, file_info->unsynced_from);
+		if (ret != PhatState_OK) return ret;
+		file_info->unsynced_from = (FileSize_t)-1;
+	}
+	ret = Phat_UpdateFileDirItem(file_info, &cached_sector);
+	if (ret != PhatState_OK) return ret;
+	return Phat_WriteBackCachedSector(phat, cached_sector);
+}
+
 PHAT_FUNC PhatState Phat_CreateDirectory(Phat_p phat, const WChar_p path)
 {
 	Phat_DirInfo_t dir_info;
@@ -2880,12 +5080,46 @@ FailExit:
 	return ret;
 }
 
+// Mark the entry that `dir_info` is at and its LFN entries as deleted
+PHAT_STATIC_FUNC PhatState Phat_RemoveDirItem(Phat_DirInfo_p dir_info)
+{
+	PhatState ret;
+	Cluster_t first_entry;
+	Cluster_t last_entry = dir_info->cur_diritem;
+
+	ret = Phat_FindFirstLFNEntry(dir_info);
+	if (ret != PhatState_OK) return ret;
+	first_entry = dir_info->cur_diritem;
+
+	for (Cluster_t i = first_entry; i <= last_entry; i++)
+	{
+		Phat_DirItem_t dir_item;
+		dir_info->cur_diritem = i;
+		ret = Phat_GetDirItem(dir_info, &dir_item);
+		if (ret != PhatState_OK) return ret;
+		dir_item.file_name_8_3[0] = 0xE5;
+		ret = Phat_PutDirItem(dir_info, &dir_item);
+		if (ret != PhatState_OK) return ret;
+	}
+	return PhatState_OK;
+}
+
+// Remove the directory entry of an opened file, the handle only knows where its SFN entry is, the LFN entries are found from there
+PHAT_STATIC_FUNC PhatState Phat_RemoveFileDirItem(Phat_FileInfo_p file_info)
+{
+	Phat_DirInfo_t dir_info;
+
+	Phat_OpenRootDir(file_info->phat, &dir_info);
+	dir_info.dir_start_cluster = file_info->dir_start_cluster;
+	dir_info.dir_current_cluster = file_info->dir_start_cluster;
+	dir_info.cur_diritem = file_info->dir_item_index;
+	return Phat_RemoveDirItem(&dir_info);
+}
+
 PHAT_FUNC PhatState Phat_DeleteFile(Phat_p phat, const WChar_p path)
 {
 	PhatState ret;
 	Phat_DirInfo_t dir_info;
-	Cluster_t first_entry = 0;
-	Cluster_t last_entry = 0;
 	Cluster_t first_cluster;
 
 	// Check parameters
@@ -2898,26 +5132,16 @@ PHAT_FUNC PhatState Phat_DeleteFile(Phat_p phat, const WChar_p path)
 
 	first_cluster = dir_info.first_cluster;
 
-	last_entry = dir_info.cur_diritem;
-	ret = Phat_FindFirstLFNEntry(&dir_info);
+	ret = Phat_RemoveDirItem(&dir_info);
 	if (ret != PhatState_OK) goto FailExit;
-	first_entry = dir_info.cur_diritem;
 
-	for (Cluster_t i = first_entry; i <= last_entry; i++)
+	// Mark the clusters of the file as free clusters, an empty file has none
+	if (first_cluster >= 2)
 	{
-		Phat_DirItem_t dir_item;
-		dir_info.cur_diritem = i;
-		ret = Phat_GetDirItem(&dir_info, &dir_item);
-		if (ret != PhatState_OK) return ret;
-		dir_item.file_name_8_3[0] = 0xE5;
-		ret = Phat_PutDirItem(&dir_info, &dir_item);
-		if (ret != PhatState_OK) return ret;
+		ret = Phat_UnlinkCluster(phat, first_cluster);
+		if (ret != PhatState_OK) goto FailExit;
 	}
 
-	// Mark the clusters of the file as free clusters.
-	ret = Phat_UnlinkCluster(phat, first_cluster);
-	if (ret != PhatState_OK) goto FailExit;
-
 FailExit:
 	Phat_CloseDir(&dir_info);
 	return ret;
@@ -3154,6 +5378,303 @@ PHAT_FUNC PhatState Phat_Move(Phat_p phat, const WChar_p oldpath, const WChar_p
 	return PhatState_OK;
 }
 
+PHAT_FUNC PhatState Phat_CopyFile(Phat_p phat, const WChar_p src_path, const WChar_p dst_path)
+{
+	PhatState ret;
+	PhatState close_ret;
+	Phat_FileInfo_t src;
+	Phat_FileInfo_t dst;
+	LBA_t src_LBA;
+	LBA_t dst_LBA;
+	size_t sectors_left;
+	size_t sectors_to_copy;
+
+	// Check parameters
+	if (!phat || !src_path || !dst_path) return PhatState_InvalidParameter;
+	if (!phat->write_enable) return PhatState_ReadOnly;
+
+	ret = Phat_OpenFileFromRoot(phat, src_path, PHAT_OPEN_READONLY, &src);
+	if (ret != PhatState_OK) return ret;
+	ret = Phat_OpenFileFromRoot(phat, dst_path, 0, &dst);
+	if (ret != PhatState_OK)
+	{
+		Phat_CloseFile(&src);
+		return ret;
+	}
+	if (dst.readonly)
+	{
+		ret = PhatState_ReadOnly;
+		goto FailExit;
+	}
+	if (src.dir_item_LBA == dst.dir_item_LBA && src.dir_item_index == dst.dir_item_index)
+	{
+		ret = PhatState_InvalidParameter;
+		goto FailExit;
+	}
+
+	// Overwrite the destination the same way as `PHAT_OPEN_TRUNCATE`, its clusters are reused and the rest are allocated in one go.
+	// The clusters are reserved before the size is reset, so the destination keeps its data if the volume is too full.
+	ret = Phat_ReserveFileClusters(&dst, src.file_size);
+	if (ret != PhatState_OK) goto FailExit;
+	dst.file_size = 0;
+	dst.modified = 1;
+	dst.release_unused = 1;
+	Phat_SetFileUnsynced(&dst, 0);
+
+	// Copy the runs that are contiguous in both files, the last sector is copied whole
+	sectors_left = src.file_size / 512 + (src.file_size % 512 != 0);
+	while (sectors_left)
+	{
+		ret = Phat_GetCurFilePointerLBA(&src, &src_LBA, 0);
+		if (ret != PhatState_OK) goto FailExit;
+		ret = Phat_GetContiguousSectors(&src, sectors_left < PHAT_COPY_BUFFER_SECTORS ? sectors_left : PHAT_COPY_BUFFER_SECTORS, &sectors_to_copy);
+		if (ret != PhatState_OK) goto FailExit;
+		ret = Phat_GetCurFilePointerLBA(&dst, &dst_LBA, 0);
+		if (ret != PhatState_OK) goto FailExit;
+		ret = Phat_GetContiguousSectors(&dst, sectors_to_copy, &sectors_to_copy);
+		if (ret != PhatState_OK) goto FailExit;
+		ret = Phat_ReadFileSectors(phat, src_LBA, sectors_to_copy, phat->copy_buffer);
+		if (ret != PhatState_OK) goto FailExit;
+		ret = Phat_WriteFileSectors(phat, dst_LBA, sectors_to_copy, phat->copy_buffer);
+		if (ret != PhatState_OK) goto FailExit;
+		sectors_left -= sectors_to_copy;
+		// The file pointer stops at the end of the file, past it would wrap around for a file close to 4 GiB
+		if (512 * sectors_to_copy < src.file_size - src.file_pointer)
+			src.file_pointer += (FileSize_t)(512 * sectors_to_copy);
+		else
+			src.file_pointer = src.file_size;
+		dst.file_pointer = src.file_pointer;
+		dst.file_size = src.file_pointer;
+	}
+	ret = PhatState_OK;
+FailExit:
+	Phat_CloseFile(&src);
+	close_ret = Phat_CloseFile(&dst);
+	if (ret != PhatState_OK) return ret;
+	return close_ret;
+}
+
+PHAT_FUNC PhatState Phat_ConcatFiles(Phat_p phat, const WChar_p dst_path, const WChar_p src_path)
+{
+	PhatState ret;
+	PhatState close_ret;
+	Phat_FileInfo_t dst;
+	Phat_FileInfo_t src;
+	PhatBool_t src_removed = 0;
+	Cluster_t cluster_size;
+	size_t bytes_read;
+	size_t bytes_written;
+
+	// Check parameters
+	if (!phat || !dst_path || !src_path) return PhatState_InvalidParameter;
+	if (!phat->write_enable) return PhatState_ReadOnly;
+
+	ret = Phat_OpenFileFromRoot(phat, src_path, PHAT_OPEN_READONLY, &src);
+	if (ret != PhatState_OK) return ret;
+	ret = Phat_OpenFileFromRoot(phat, dst_path, PHAT_OPEN_APPEND, &dst);
+	if (ret != PhatState_OK)
+	{
+		Phat_CloseFile(&src);
+		return ret;
+	}
+	if (dst.readonly || (src.attributes & ATTRIB_READ_ONLY))
+	{
+		ret = PhatState_ReadOnly;
+		goto FailExit;
+	}
+	if (src.dir_item_LBA == dst.dir_item_LBA && src.dir_item_index == dst.dir_item_index)
+	{
+		ret = PhatState_InvalidParameter;
+		goto FailExit;
+	}
+	if (src.shared && src.shared->num_handles > 1)
+	{
+		// The other handles of the source would be left on a deleted entry and on clusters that now belong to the destination
+		ret = PhatState_FileIsOpen;
+		goto FailExit;
+	}
+	if (src.file_size > (FileSize_t)-1 - dst.file_size)
+	{
+		// The merged file wouldn't fit in the 32-bit size of a directory entry
+		ret = PhatState_NotEnoughSpace;
+		goto FailExit;
+	}
+
+	cluster_size = (Cluster_t)phat->sectors_per_cluster * phat->bytes_per_sector;
+	if (dst.file_size % cluster_size == 0 && src.first_cluster)
+	{
+		// The destination ends at a cluster boundary, the chain of the source is linked to it without moving any data.
+		// The source entry goes first, a failure afterwards leaves lost clusters instead of two files sharing a chain.
+		ret = Phat_ReleaseUnusedClusters(&dst);
+		if (ret != PhatState_OK) goto FailExit;
+		ret = Phat_RemoveFileDirItem(&src);
+		if (ret != PhatState_OK) goto FailExit;
+		src_removed = 1;
+		if (dst.first_cluster)
+			ret = Phat_WriteFAT(phat, dst.cur_cluster, src.first_cluster, 0);
+		else
+			ret = Phat_SetFileFirstCluster(&dst, src.first_cluster);
+		if (ret != PhatState_OK) goto FailExit;
+		dst.file_size += src.file_size;
+		dst.modified = 1;
+	}
+	else
+	{
+		// Copy the data of the source to the end of the destination, then delete the source
+		ret = Phat_ReserveFileClusters(&dst, dst.file_size + src.file_size);
+		if (ret != PhatState_OK) goto FailExit;
+		while (src.file_pointer < src.file_size)
+		{
+			ret = Phat_ReadFile(&src, phat->copy_buffer, sizeof phat->copy_buffer, &bytes_read);
+			if (ret != PhatState_OK && ret != PhatState_EndOfFile) goto FailExit;
+			if (!bytes_read) break;
+			ret = Phat_WriteFile(&dst, phat->copy_buffer, bytes_read, &bytes_written);
+			if (ret != PhatState_OK) goto FailExit;
+		}
+		ret = Phat_RemoveFileDirItem(&src);
+		if (ret != PhatState_OK) goto FailExit;
+		src_removed = 1;
+		if (src.first_cluster)
+		{
+			ret = Phat_UnlinkCluster(phat, src.first_cluster);
+			if (ret != PhatState_OK) goto FailExit;
+		}
+	}
+	ret = PhatState_OK;
+FailExit:
+	if (src_removed)
+	{
+		Phat_DetachSharedFile(&src);
+		Phat_DropFileSectorBuffer(&src);
+	}
+	else
+		Phat_CloseFile(&src);
+	close_ret = Phat_CloseFile(&dst);
+	if (ret != PhatState_OK) return ret;
+	return close_ret;
+}
+
+PHAT_FUNC PhatState Phat_WriteWholeFile(Phat_p phat, const WChar_p path, const void *data, FileSize_t size)
+{
+	PhatState ret;
+	Phat_DirInfo_t dir_info;
+	Phat_DirItem_t dir_item;
+	WChar_p name;
+	size_t name_len;
+	PhatBool_t exists;
+	const uint8_t *ptr = data;
+	FileSize_t bytes_left = size;
+	Cluster_t cluster_size;
+	Cluster_t clusters_left;
+	Cluster_t first_cluster = 0;
+	Cluster_t old_first_cluster = 0;
+	Cluster_t cluster;
+	Cluster_t next_cluster = 0;
+	Cluster_t run_length;
+	size_t run_bytes;
+	size_t run_sectors;
+	size_t written;
+	LBA_t LBA;
+
+	// Check parameters
+	if (!phat || !path || (!data && size)) return PhatState_InvalidParameter;
+	if (!phat->write_enable) return PhatState_ReadOnly;
+
+	// The parent directory is walked once, `name` is left at the last part of the path if the file doesn't exist
+	Phat_OpenRootDir(phat, &dir_info);
+	ret = Phat_FindItem(phat, path, &dir_info, &name);
+	switch (ret)
+	{
+	case PhatState_OK:
+		if (dir_info.attributes & ATTRIB_DIRECTORY) return PhatState_IsADirectory;
+		if (dir_info.attributes & ATTRIB_READ_ONLY) return PhatState_ReadOnly;
+		exists = 1;
+		old_first_cluster = dir_info.first_cluster;
+		break;
+	case PhatState_EndOfDirectory:
+		name_len = Phat_Wcslen(name);
+		if (name_len > MAX_LFN) return PhatState_NameTooLong;
+		memcpy(phat->filename_buffer, name, name_len * sizeof(WChar_t));
+		phat->filename_buffer[name_len] = 0;
+		if (!Phat_IsValidFilename(phat->filename_buffer)) return PhatState_BadFileName;
+		exists = 0;
+		break;
+	default:
+		return ret;
+	}
+
+	// Allocate the exact number of clusters, then write each contiguous run of them with as few calls as the driver allows
+	cluster_size = (Cluster_t)phat->sectors_per_cluster * phat->bytes_per_sector;
+	clusters_left = size ? (size - 1) / cluster_size + 1 : 0;
+	if (clusters_left)
+	{
+		ret = Phat_AllocateClusters(phat, 0, clusters_left, &first_cluster);
+		if (ret != PhatState_OK) return ret;
+	}
+	cluster = first_cluster;
+	while (clusters_left)
+	{
+		run_length = 1;
+		while (run_length < clusters_left)
+		{
+			ret = Phat_GetFATNextCluster(phat, cluster + run_length - 1, &next_cluster);
+			if (ret != PhatState_OK) goto FailExit;
+			if (next_cluster != cluster + run_length) break;
+			run_length++;
+		}
+		run_bytes = (size_t)run_length * cluster_size;
+		if (run_bytes > bytes_left) run_bytes = bytes_left;
+		run_sectors = run_bytes / 512;
+		LBA = Phat_ClusterToLBA(phat, cluster) + phat->partition_start_LBA;
+		written = 0;
+		while (written < run_sectors)
+		{
+			size_t to_write = run_sectors - written;
+			if (to_write > PHAT_MAX_TRANSFER_SECTORS) to_write = PHAT_MAX_TRANSFER_SECTORS;
+			ret = Phat_WriteFileSectors(phat, LBA + (LBA_t)written, to_write, ptr + written * 512);
+			if (ret != PhatState_OK) goto FailExit;
+			written += to_write;
+		}
+		if (run_bytes % 512)
+		{
+			// The last sector is padded with zeros
+			memcpy(phat->copy_buffer, ptr + run_sectors * 512, run_bytes % 512);
+			memset(phat->copy_buffer + run_bytes % 512, 0, 512 - run_bytes % 512);
+			ret = Phat_WriteFileSectors(phat, LBA + (LBA_t)run_sectors, 1, phat->copy_buffer);
+			if (ret != PhatState_OK) goto FailExit;
+		}
+		ptr += run_bytes;
+		bytes_left -= (FileSize_t)run_bytes;
+		clusters_left -= run_length;
+		cluster = next_cluster;
+	}
+
+	// The directory entry is written once with the final size and the first cluster, after the data
+	if (exists)
+	{
+		ret = Phat_GetDirItem(&dir_info, &dir_item);
+		if (ret != PhatState_OK) goto FailExit;
+		dir_item.last_modification_date = Phat_EncodeDate(&phat->cur_date);
+		dir_item.last_modification_time = Phat_EncodeTime(&phat->cur_time);
+		dir_item.last_access_date = Phat_EncodeDate(&phat->cur_date);
+		dir_item.file_size = size;
+		dir_item.first_cluster_low = first_cluster & 0xFFFF;
+		dir_item.first_cluster_high = first_cluster >> 16;
+		ret = Phat_PutDirItem(&dir_info, &dir_item);
+		if (ret != PhatState_OK) goto FailExit;
+		if (old_first_cluster >= 2) return Phat_UnlinkCluster(phat, old_first_cluster);
+	}
+	else
+	{
+		ret = Phat_PutNewItemInDir(&dir_info, phat->filename_buffer, 0, first_cluster, size);
+		if (ret != PhatState_OK) goto FailExit;
+	}
+	return PhatState_OK;
+FailExit:
+	if (first_cluster >= 2) Phat_UnlinkCluster(phat, first_cluster);
+	return ret;
+}
+
 PHAT_FUNC PhatState Phat_InitializeMBR(Phat_p phat, PhatBool_t force, PhatBool_t flush)
 {
 	PhatState ret;
@@ -3277,16 +5798,10 @@ PHAT_FUNC PhatState Phat_InitializeGPT(Phat_p phat, PhatBool_t force, PhatBool_t
 	*(Phat_GPT_Header_p)cached_sector->data = header;
 	Phat_SetCachedSectorModified(cached_sector);
 
-	for (LBA_t i = 2; i < first_usable_LBA; i++)
-	{
-		ret = Phat_WriteSectorsWithoutCache(phat, i, 1, empty_sector);
-		if (ret != PhatState_OK) return ret;
-	}
-	for (LBA_t i = last_usable_LBA + 1; i < header.alternate_LBA; i++)
-	{
-		ret = Phat_WriteSectorsWithoutCache(phat, i, 1, empty_sector);
-		if (ret != PhatState_OK) return ret;
-	}
+	ret = Phat_WriteZeroSectors(phat, 2, first_usable_LBA - 2);
+	if (ret != PhatState_OK) return ret;
+	ret = Phat_WriteZeroSectors(phat, last_usable_LBA + 1, (size_t)(header.alternate_LBA - last_usable_LBA - 1));
+	if (ret != PhatState_OK) return ret;
 
 	if (flush)
 	{
@@ -3740,10 +6255,24 @@ PHAT_FUNC PhatState Phat_MakeFS_And_Mount(Phat_p phat, int partition_index, int
 	phat->num_diritems_in_a_cluster = (phat->bytes_per_sector * phat->sectors_per_cluster) / 32;
 	phat->num_FAT_entries = (phat->FAT_size_in_sectors * phat->bytes_per_sector * 8) / phat->FAT_bits;
 	phat->FATs_are_same = 1;
-	phat->max_valid_cluster = phat->num_FAT_entries + 1;
+	ret = Phat_InstallFATCodec(phat);
+	if (ret != PhatState_OK) return ret;
 	phat->free_clusters = free_clusters;
 	phat->next_free_cluster = 3;
 	phat->is_dirty = 0;
+	phat->num_FAT_mirror_ranges = 0;
+	phat->resident_FAT = NULL;
+	phat->resident_FAT_num_sectors = 0;
+	memset(phat->resident_FAT_modified, 0, sizeof phat->resident_FAT_modified);
+	phat->FAT_read_ahead = 0;
+	phat->data_pages = NULL;
+	phat->data_page_buffer = NULL;
+	phat->num_data_pages = 0;
+	memset(phat->chain_hints, 0, sizeof phat->chain_hints);
+	memset(phat->file_sector_buffers, 0, sizeof phat->file_sector_buffers);
+#if PHAT_OPEN_FILES
+	memset(phat->open_files, 0, sizeof phat->open_files);
+#endif
 
 	ret = Phat_ReadSectorThroughCache(phat, partition_start_LBA, &cached_sector);
 	if (ret != PhatState_OK) return ret;
@@ -3779,12 +6308,10 @@ PHAT_FUNC PhatState Phat_MakeFS_And_Mount(Phat_p phat, int partition_index, int
 		case 12:
 			memcpy(dbr->file_system_type, "FAT12   ", 8);
 			memcpy(dbr->boot_code, dbr12_boot_code, 448);
-			phat->end_of_cluster_chain = 0xFF8;
 			break;
 		case 16:
 			memcpy(dbr->file_system_type, "FAT16   ", 8);
 			memcpy(dbr->boot_code, dbr16_boot_code, 448);
-			phat->end_of_cluster_chain = 0xFFF8;
 			break;
 		}
 		dbr->boot_sector_signature = 0xAA55;
@@ -3794,11 +6321,8 @@ PHAT_FUNC PhatState Phat_MakeFS_And_Mount(Phat_p phat, int partition_index, int
 		phat->data_start_LBA = phat->root_dir_start_LBA + (((LBA_t)root_dir_entry_count * 32) + 511) / 512;
 		phat->has_FSInfo = 0;
 
-		for (uint16_t i = 0; i < num_root_dir_sectors; i++)
-		{
-			ret = Phat_WriteSectorsWithoutCache(phat, partition_start_LBA + phat->root_dir_start_LBA + i, 1, empty_sector);
-			if (ret != PhatState_OK) return ret;
-		}
+		ret = Phat_WriteZeroSectors(phat, partition_start_LBA + phat->root_dir_start_LBA, num_root_dir_sectors);
+		if (ret != PhatState_OK) return ret;
 	}
 	else
 	{
@@ -3840,7 +6364,9 @@ PHAT_FUNC PhatState Phat_MakeFS_And_Mount(Phat_p phat, int partition_index, int
 		Phat_SetCachedSectorModified(cached_sector);
 
 		// FS Info
-		ret = Phat_ReadSectorThroughCache(phat, partition_start_LBA + 1, &cached_sector);
+		phat->FSInfo_LBA = partition_start_LBA + 1;
+		phat->FSInfo_modified = 0;
+		ret = Phat_ReadSectorThroughCache(phat, phat->FSInfo_LBA, &cached_sector);
 		if (ret != PhatState_OK) return ret;
 		fsi = (Phat_FSInfo_p)&cached_sector->data;
 		fsi->lead_signature = 0x41615252;
@@ -3868,7 +6394,6 @@ PHAT_FUNC PhatState Phat_MakeFS_And_Mount(Phat_p phat, int partition_index, int
 
 		phat->root_dir_cluster = 2;
 		phat->data_start_LBA = phat->root_dir_start_LBA;
-		phat->end_of_cluster_chain = 0x0FFFFFF8;
 		phat->has_FSInfo = 1;
 
 		// Wipe for FAT32 root dir
@@ -3876,6 +6401,11 @@ PHAT_FUNC PhatState Phat_MakeFS_And_Mount(Phat_p phat, int partition_index, int
 		if (ret != PhatState_OK) return ret;
 
 	}
+	phat->max_valid_cluster = Phat_GetMaxValidCluster(phat);
+
+	// Every data cluster is free except the FAT32 root directory
+	phat->free_clusters = phat->max_valid_cluster - (FAT_bits == 32 ? 2 : 1);
+	phat->FSInfo_modified = phat->has_FSInfo;
 
 	// Initialize the FAT table
 	for (uint8_t i = 0; i < num_FATs; i++)
@@ -3901,11 +6431,8 @@ PHAT_FUNC PhatState Phat_MakeFS_And_Mount(Phat_p phat, int partition_index, int
 		}
 
 		Phat_SetCachedSectorModified(cached_sector);
-		for (uint32_t f = 1; f < FAT_size; f++)
-		{
-			ret = Phat_WriteSectorsWithoutCache(phat, FAT_LBA + f, 1, empty_sector);
-			if (ret != PhatState_OK) return ret;
-		}
+		ret = Phat_WriteZeroSectors(phat, FAT_LBA + 1, FAT_size - 1);
+		if (ret != PhatState_OK) return ret;
 	}
 
 	if (is_mbr)
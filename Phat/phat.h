@@ -9,8 +9,80 @@
 #define PHAT_CACHED_SECTORS 8
 #endif
 
+#ifndef PHAT_FAT_MIRROR_RANGES
+#define PHAT_FAT_MIRROR_RANGES 4
+#endif
+
+// Scratch buffer for copying FAT mirrors and for FAT read-ahead
+#ifndef PHAT_FAT_BUFFER_SECTORS
+#define PHAT_FAT_BUFFER_SECTORS 2
+#endif
+
+// Upper limit of the adaptive FAT read-ahead, also limited by `PHAT_FAT_BUFFER_SECTORS` and half of the sector cache
+#ifndef PHAT_FAT_READ_AHEAD_SECTORS
+#define PHAT_FAT_READ_AHEAD_SECTORS 2
+#endif
+
+// Size of the constant zero-filled buffer, zeros are written to this many sectors with one driver call
+#ifndef PHAT_ZERO_SECTORS
+#define PHAT_ZERO_SECTORS 8
+#endif
+
+// Number of remembered positions in the cluster chains of files, used to reach the end of a file without walking its whole chain
+#ifndef PHAT_CHAIN_HINTS
+#define PHAT_CHAIN_HINTS 4
+#endif
+
+// Staging buffer of `Phat_CopyFile()`, the data is copied with up to this many sectors per driver call.
+// `Phat_ConcatFiles()` copies through it too, and `Phat_WriteWholeFile()` pads the last sector of a file in it,
+// so it must hold at least one sector. Every sector of it is 512 bytes of `Phat_t`, raise it for faster copies
+#ifndef PHAT_COPY_BUFFER_SECTORS
+#define PHAT_COPY_BUFFER_SECTORS 2
+#endif
+
+// Sector buffers shared by the opened files for the sectors they read or write partially.
+// A file borrows one when it needs it and keeps it until another file takes it, so this is the number of files
+// that can do small reads and writes in turn without reloading the partial sector.
+#ifndef PHAT_FILE_SECTOR_BUFFERS
+#define PHAT_FILE_SECTOR_BUFFERS 2
+#endif
+
+// Size of the open-file table, the handles of the same file share its size, first cluster and modification state
+// through the table. Opening one more file than the table holds fails with `PhatState_TooManyOpenFiles`, handles of a file
+// that is already open don't take another record. Set to 0 to leave the table out, every handle then keeps its own state.
+#ifndef PHAT_OPEN_FILES
+#define PHAT_OPEN_FILES 4
+#endif
+
+#ifndef PHAT_RESIDENT_FAT_MAX_SECTORS
+#define PHAT_RESIDENT_FAT_MAX_SECTORS 256
+#endif
+
+// Build profile: set any of these to 0 to leave the code for that FAT type out
+#ifndef PHAT_SUPPORT_FAT12
+#define PHAT_SUPPORT_FAT12 1
+#endif
+
+#ifndef PHAT_SUPPORT_FAT16
+#define PHAT_SUPPORT_FAT16 1
+#endif
+
+#ifndef PHAT_SUPPORT_FAT32
+#define PHAT_SUPPORT_FAT32 1
+#endif
+
+#if !PHAT_SUPPORT_FAT12 && !PHAT_SUPPORT_FAT16 && !PHAT_SUPPORT_FAT32
+#error At least one of the FAT types must be supported
+#endif
+
 #define SECTORCACHE_SYNC 0x80000000
 #define SECTORCACHE_VALID 0x40000000
+#define SECTORCACHE_REFERENCED 0x20000000
+
+// Flags for `Phat_OpenFile()`
+#define PHAT_OPEN_READONLY 0x01
+#define PHAT_OPEN_APPEND 0x02
+#define PHAT_OPEN_TRUNCATE 0x04
 
 #ifndef MAX_LFN
 #define MAX_LFN 255
@@ -58,6 +130,57 @@ typedef struct Phat_SectorCache_s
 	struct Phat_SectorCache_s *next;
 }Phat_SectorCache_t, *Phat_SectorCache_p;
 
+// A page of the file data cache, the data of the pages follows the headers in the caller-provided buffer
+typedef struct Phat_DataPage_s
+{
+	LBA_t LBA;
+	uint32_t usage;
+}Phat_DataPage_t, *Phat_DataPage_p;
+
+// A known position in the cluster chain of a file
+typedef struct Phat_ChainHint_s
+{
+	Cluster_t first_cluster;
+	Cluster_t cluster;
+	Cluster_t cluster_index;
+}Phat_ChainHint_t, *Phat_ChainHint_p;
+
+// A sector of file data lent to an opened file, it always holds the same data as the disk
+typedef struct Phat_FileSectorBuffer_s
+{
+	struct Phat_FileInfo_s *owner;
+	LBA_t LBA;
+	uint8_t data[512];
+}Phat_FileSectorBuffer_t, *Phat_FileSectorBuffer_p;
+
+// A file in the open-file table. The handle that used the file last holds the current state,
+// the record gets it when another handle of the file is used.
+typedef struct Phat_OpenFileRecord_s
+{
+	LBA_t dir_item_LBA;
+	Cluster_t dir_item_index;
+	uint8_t num_handles;
+	struct Phat_FileInfo_s *holder;
+	Cluster_t first_cluster;
+	FileSize_t file_size;
+	FileSize_t unsynced_from;
+	PhatBool_t modified;
+	PhatBool_t release_unused;
+	Cluster_t cluster;
+	Cluster_t cluster_index;
+	uint32_t change_count;
+	uint32_t release_count;
+}Phat_OpenFileRecord_t, *Phat_OpenFileRecord_p;
+
+typedef struct Phat_SectorRange_s
+{
+	LBA_t start;
+	LBA_t end;
+}Phat_SectorRange_t, *Phat_SectorRange_p;
+
+// FAT entry accessors of a FAT type, the instances are in phat.c
+typedef struct Phat_FATCodec_s Phat_FATCodec_t, *Phat_FATCodec_p;
+
 typedef struct Phat_Date_s
 {
 	uint16_t year;
@@ -96,15 +219,41 @@ typedef struct Phat_s
 	uint8_t FAT_bits;
 	uint8_t num_FATs;
 	uint16_t bytes_per_sector;
+	uint8_t bytes_per_sector_shift;
 	uint8_t sectors_per_cluster;
 	uint8_t num_diritems_in_a_sector;
 	uint16_t num_diritems_in_a_cluster;
 	Cluster_t num_FAT_entries;
 	PhatBool_t has_FSInfo;
+	PhatBool_t FSInfo_modified;
+	LBA_t FSInfo_LBA;
 	Cluster_t free_clusters;
 	Cluster_t next_free_cluster;
 	Cluster_t max_valid_cluster;
 	Cluster_t end_of_cluster_chain;
+	const Phat_FATCodec_t *FAT_codec;
+	PhatBool_t FAT_mirror_deferred;
+	uint8_t num_FAT_mirror_ranges;
+	Phat_SectorRange_t FAT_mirror_ranges[PHAT_FAT_MIRROR_RANGES];
+	uint8_t FAT_buffer[PHAT_FAT_BUFFER_SECTORS * 512];
+	uint8_t copy_buffer[PHAT_COPY_BUFFER_SECTORS * 512];
+	LBA_t FAT_read_ahead_next;
+	uint8_t FAT_read_ahead;
+	uint8_t *resident_FAT;
+	LBA_t resident_FAT_first_sector;
+	LBA_t resident_FAT_num_sectors;
+	uint8_t resident_FAT_modified[(PHAT_RESIDENT_FAT_MAX_SECTORS + 7) / 8];
+	Phat_DataPage_p data_pages;
+	uint8_t *data_page_buffer;
+	size_t num_data_pages;
+	size_t data_page_hand;
+	Phat_ChainHint_t chain_hints[PHAT_CHAIN_HINTS];
+	uint8_t chain_hint_next;
+	Phat_FileSectorBuffer_t file_sector_buffers[PHAT_FILE_SECTOR_BUFFERS];
+	uint8_t file_sector_buffer_next;
+#if PHAT_OPEN_FILES
+	Phat_OpenFileRecord_t open_files[PHAT_OPEN_FILES];
+#endif
 }PHAT_ALIGNMENT Phat_t, *Phat_p;
 
 typedef struct Phat_DirInfo_s
@@ -131,20 +280,49 @@ typedef struct Phat_DirInfo_s
 typedef struct Phat_FileInfo_s
 {
 	Phat_p phat;
-	Phat_DirInfo_t file_item;
+	Cluster_t dir_start_cluster;
+	Cluster_t dir_item_index;
+	LBA_t dir_item_LBA;
+	uint8_t attributes;
+	Phat_OpenFileRecord_p shared;
+	uint32_t seen_change_count;
+	uint32_t seen_release_count;
 	Cluster_t first_cluster;
 	Cluster_t file_pointer;
 	Cluster_t cur_cluster;
 	Cluster_t cur_cluster_index;
 	Cluster_t file_size;
 	uint8_t offset_in_cluster;
+	Cluster_t at_cluster;
+	Cluster_t at_cluster_index;
+	uint8_t at_offset_in_cluster;
 	PhatBool_t readonly;
+	PhatBool_t append;
+	PhatBool_t release_unused;
+	FileSize_t unsynced_from;
 	PhatBool_t modified;
-	PhatBool_t sector_buffer_is_valid;
-	uint8_t sector_buffer[512];
-	LBA_t sector_buffer_LBA;
+	Phat_FileSectorBuffer_p sector_buffer;
+	uint8_t *read_ahead_buffer;
+	size_t read_ahead_buffer_sectors;
+	size_t read_ahead_window;
+	size_t read_ahead_sectors;
+	FileSize_t read_ahead_position;
+	FileSize_t read_ahead_next;
+	uint8_t *write_behind_buffer;
+	size_t write_behind_buffer_size;
+	size_t write_behind_bytes;
+	FileSize_t write_behind_position;
+	FileSize_t write_behind_file_size;
 }PHAT_ALIGNMENT Phat_FileInfo_t, *Phat_FileInfo_p;
 
+// A physically contiguous run of a file
+typedef struct Phat_FileExtent_s
+{
+	FileSize_t file_offset;
+	LBA_t LBA;
+	LBA_t num_sectors;
+}Phat_FileExtent_t, *Phat_FileExtent_p;
+
 typedef enum PhatState_e
 {
 	PhatState_OK = 0,
@@ -183,6 +361,9 @@ typedef enum PhatState_e
 	PhatState_PartitionIndexOutOfBound,
 	PhatState_NeedBigLBA,
 	PhatState_ModifiedDataNeedWriteBack,
+	PhatState_FATTypeNotSupported,
+	PhatState_TooManyOpenFiles,
+	PhatState_FileIsOpen,
 	PhatState_LastState,
 }PhatState;
 
@@ -297,6 +478,7 @@ PHAT_FUNC PhatBool_t Phat_IsValidFilename(WChar_p filename);
  *   - PhatState_InvalidParameter: phat is NULL
  *   - PhatState_NoMBR: No valid partition table found
  *   - PhatState_FSNotFat: Partition doesn't contain FAT filesystem
+ *   - PhatState_FATTypeNotSupported: The FAT type is disabled by `PHAT_SUPPORT_FAT12/16/32`
  *   - PhatState_PartitionIndexOutOfBound: Invalid partition index
  *   - PhatState_ReadFail: Failed to read partition data
  *
@@ -318,6 +500,62 @@ PHAT_FUNC PhatState Phat_Mount(Phat_p phat, int partition_index, PhatBool_t writ
  */
 PHAT_FUNC PhatState Phat_ChangeWriteEnable(Phat_p phat, PhatBool_t write_enable);
 
+/**
+ * @brief Defer the FAT mirroring until flush
+ *
+ * @param phat Mounted Phat context
+ * @param deferred Only update the first FAT during the session if non-zero
+ * @return PhatState
+ *   - PhatState_OK: Success
+ *   - PhatState_InvalidParameter: phat is NULL or not mounted
+ *   - PhatState_FATTypeNotSupported: The volume is FAT12, which has no dirty bit to guard the differing FATs
+ *   - PhatState_ReadFail/PhatState_WriteFail: Failed to copy the pending FAT sectors when turning it off
+ *
+ * @note When deferred, FAT changes only go to the first FAT, the modified FAT sectors are remembered
+ * and copied to the other FATs by `Phat_FlushCache()` and `Phat_Unmount()`.
+ * The volume is marked dirty on the disk, in FAT entry 1, before the FATs start to differ, and the flag is restored
+ * once they are the same again.
+ * Up to `PHAT_FAT_MIRROR_RANGES` ranges are remembered, nearby ranges are merged when running out of them.
+ */
+PHAT_FUNC PhatState Phat_SetDeferredFATMirroring(Phat_p phat, PhatBool_t deferred);
+
+/**
+ * @brief Keep the first FAT, or a window of it, in a caller-provided buffer
+ *
+ * @param phat Mounted Phat context
+ * @param buffer 4-byte aligned buffer to hold the FAT sectors, NULL to stop keeping the FAT in memory
+ * @param buffer_size Size of `buffer` in bytes
+ * @param first_cluster The window starts from the FAT sector holding the entry of this cluster, use 0 for the whole FAT
+ * @return PhatState
+ *   - PhatState_OK: Success
+ *   - PhatState_InvalidParameter: phat is NULL, or the buffer can't hold a single FAT sector
+ *   - PhatState_ReadFail/PhatState_WriteFail: Failed to load the FAT or to write back the previous window
+ *
+ * @note The window covers as many FAT sectors as `buffer` holds, up to `PHAT_RESIDENT_FAT_MAX_SECTORS`.
+ * A whole FAT12/FAT16 FAT fits in 256 sectors, a FAT32 volume could keep the part of the FAT that is being used.
+ * FAT entries inside the window are read and written in memory only, the modified sectors are written to every FAT
+ * by `Phat_FlushCache()` and `Phat_Unmount()`. `Phat_Mount()` drops the window, call this after mounting.
+ */
+PHAT_FUNC PhatState Phat_SetResidentFAT(Phat_p phat, void *buffer, size_t buffer_size, Cluster_t first_cluster);
+
+/**
+ * @brief Cache file data in a caller-provided buffer
+ *
+ * @param phat Mounted Phat context
+ * @param buffer 4-byte aligned buffer for the cached pages, NULL to stop caching file data
+ * @param buffer_size Size of `buffer` in bytes, each page takes 512 bytes plus a small header
+ * @return PhatState
+ *   - PhatState_OK: Success
+ *   - PhatState_InvalidParameter: phat is NULL, or the buffer can't hold a single page
+ *   - PhatState_WriteFail: Failed to write back the modified pages of the previous buffer
+ *
+ * @note The cache is shared by all of the opened files and is separate from the sector cache of the metadata.
+ * Short reads and writes go through the cache, runs longer than a quarter of the pages go to the disk directly
+ * and only update the pages they overlap. Modified pages are written back when they are evicted,
+ * by `Phat_FlushCache()` and by `Phat_Unmount()`. `Phat_Mount()` drops the cache, call this after mounting.
+ */
+PHAT_FUNC PhatState Phat_SetDataCache(Phat_p phat, void *buffer, size_t buffer_size);
+
 /**
  * @brief Flush all cached sectors to storage
  *
@@ -328,6 +566,10 @@ PHAT_FUNC PhatState Phat_ChangeWriteEnable(Phat_p phat, PhatBool_t write_enable)
  *   - PhatState_WriteFail: Failed to write cached data
  *
  * @note This ensures all pending writes are committed to storage.
+ * The deferred FAT mirrors are also synchronized here.
+ * The free cluster count and the next free cluster hint are only kept in memory during the session,
+ * the FSInfo sector is updated here.
+ * The modified sectors of the resident FAT window are written back here too.
  * Called automatically during Unmount/DeInit.
  */
 PHAT_FUNC PhatState Phat_FlushCache(Phat_p phat, PhatBool_t invalidate);
@@ -438,38 +680,54 @@ PHAT_FUNC void Phat_CloseDir(Phat_DirInfo_p dir_info);
  *
  * @param dir_info Opened directory context
  * @param path File path (UTF-16 encoded)
- * @param readonly Open in read-only mode if non-zero
+ * @param open_mode Combination of the `PHAT_OPEN_*` flags, `PHAT_OPEN_READONLY` (1) opens in read-only mode
  * @param file_info File info structure to initialize
  * @return PhatState
  *   - PhatState_OK: Success
  *   - PhatState_InvalidParameter: Invalid parameters
- *   - PhatState_FileNotFound: File doesn't exist (and readonly=1)
+ *   - PhatState_FileNotFound: File doesn't exist (and PHAT_OPEN_READONLY is set)
  *   - PhatState_IsADirectory: Path exists but is a directory
- *   - PhatState_ReadOnly: Write attempted on read-only filesystem
- *
- * @note If readonly=0 and file doesn't exist, it will be created.
+ *   - PhatState_ReadOnly: Write attempted on read-only filesystem, or PHAT_OPEN_TRUNCATE on a read-only file
+ *   - PhatState_TooManyOpenFiles: `PHAT_OPEN_FILES` different files are already open
+ *
+ * @note If PHAT_OPEN_READONLY isn't set and file doesn't exist, it will be created.
+ * With PHAT_OPEN_APPEND, the file pointer starts at the end of the file and every write goes to the end of the file.
+ * The last cluster of the file is found once when opening, from a remembered position in its chain if there is one,
+ * so appending to a large file doesn't walk its cluster chain on every reopen.
+ * With PHAT_OPEN_TRUNCATE, the file size is set to 0 but the cluster chain is kept for the following writes to reuse,
+ * the clusters that are left unused are freed by `Phat_CloseFile()`. The directory entry is only updated when closing.
+ * file_info only keeps the location of the directory entry, dir_info is free to be used again after opening.
+ * Sectors that are read or written partially go through a buffer borrowed from the pool in `Phat_t`, see `PHAT_FILE_SECTOR_BUFFERS`.
+ * Opening a file that is already open shares its size, cluster chain and unsynced state with the other handles,
+ * see `PHAT_OPEN_FILES`; the unused clusters of a truncated file are freed when its last handle is closed.
  * file_info must be closed with Phat_CloseFile when done.
  */
-PHAT_FUNC PhatState Phat_OpenFile(Phat_DirInfo_p dir_info, const WChar_p path, PhatBool_t readonly, Phat_FileInfo_p file_info);
+PHAT_FUNC PhatState Phat_OpenFile(Phat_DirInfo_p dir_info, const WChar_p path, uint8_t open_mode, Phat_FileInfo_p file_info);
 
 /**
  * @brief Open file from root dir for reading or writing
  *
  * @param phat Mounted Phat context
  * @param path File path (UTF-16 encoded)
- * @param readonly Open in read-only mode if non-zero
+ * @param open_mode Combination of the `PHAT_OPEN_*` flags, `PHAT_OPEN_READONLY` (1) opens in read-only mode
  * @param file_info File info structure to initialize
  * @return PhatState
  *   - PhatState_OK: Success
  *   - PhatState_InvalidParameter: Invalid parameters
- *   - PhatState_FileNotFound: File doesn't exist (and readonly=1)
+ *   - PhatState_FileNotFound: File doesn't exist (and PHAT_OPEN_READONLY is set)
  *   - PhatState_IsADirectory: Path exists but is a directory
- *   - PhatState_ReadOnly: Write attempted on read-only filesystem
- *
- * @note If readonly=0 and file doesn't exist, it will be created.
+ *   - PhatState_ReadOnly: Write attempted on read-only filesystem, or PHAT_OPEN_TRUNCATE on a read-only file
+ *   - PhatState_TooManyOpenFiles: `PHAT_OPEN_FILES` different files are already open
+ *
+ * @note If PHAT_OPEN_READONLY isn't set and file doesn't exist, it will be created.
+ * With PHAT_OPEN_APPEND, the file pointer starts at the end of the file and every write goes to the end of the file.
+ * The last cluster of the file is found once when opening, from a remembered position in its chain if there is one,
+ * so appending to a large file doesn't walk its cluster chain on every reopen.
+ * With PHAT_OPEN_TRUNCATE, the file size is set to 0 but the cluster chain is kept for the following writes to reuse,
+ * the clusters that are left unused are freed by `Phat_CloseFile()`. The directory entry is only updated when closing.
  * file_info must be closed with Phat_CloseFile when done.
  */
-PHAT_FUNC PhatState Phat_OpenFileFromRoot(Phat_p phat, const WChar_p path, PhatBool_t readonly, Phat_FileInfo_p file_info);
+PHAT_FUNC PhatState Phat_OpenFileFromRoot(Phat_p phat, const WChar_p path, uint8_t open_mode, Phat_FileInfo_p file_info);
 
 /**
  * @brief Read data from opened file
@@ -489,6 +747,62 @@ PHAT_FUNC PhatState Phat_OpenFileFromRoot(Phat_p phat, const WChar_p path, PhatB
  */
 PHAT_FUNC PhatState Phat_ReadFile(Phat_FileInfo_p file_info, void *buffer, size_t bytes_to_read, size_t *bytes_read);
 
+/**
+ * @brief Read data from an opened file at the given offset
+ *
+ * @param file_info Opened file context
+ * @param offset Offset in the file to read from
+ * @param buffer Buffer to receive data
+ * @param bytes_to_read Number of bytes to read
+ * @param bytes_read Actual number of bytes read (can be NULL)
+ * @return PhatState
+ *   - PhatState_OK: Success
+ *   - PhatState_EndOfFile: Reached end of file
+ *   - PhatState_InvalidParameter: Invalid parameters
+ *   - PhatState_ReadFail: Storage read error
+ *
+ * @note The file pointer is not used or moved. Positional reads and writes walk the cluster chain with a cursor
+ * of their own, so they don't disturb the position of the sequential reads and writes.
+ */
+PHAT_FUNC PhatState Phat_ReadFileAt(Phat_FileInfo_p file_info, FileSize_t offset, void *buffer, size_t bytes_to_read, size_t *bytes_read);
+
+/**
+ * @brief Give an opened file a buffer for sequential read-ahead
+ *
+ * @param file_info Opened file context
+ * @param buffer Buffer to hold the prefetched sectors, NULL to stop reading ahead
+ * @param buffer_size Size of `buffer` in bytes
+ * @return PhatState
+ *   - PhatState_OK: Success
+ *   - PhatState_InvalidParameter: file_info is NULL, or the buffer can't hold a single sector
+ *
+ * @note While `Phat_ReadFile()` continues from where the last read ended, the following sectors are read
+ * into `buffer` ahead of time. The window starts at one cluster and doubles on every refill up to the buffer size.
+ * A seek drops the window and reads go directly to the disk until the access becomes sequential again.
+ * Reads bigger than the buffer bypass it. The buffer must stay valid until the file is closed.
+ */
+PHAT_FUNC PhatState Phat_SetFileReadAhead(Phat_FileInfo_p file_info, void *buffer, size_t buffer_size);
+
+/**
+ * @brief Read whole sectors of an opened file directly into the caller's buffer
+ *
+ * @param file_info Opened file context, the file pointer must be a multiple of 512
+ * @param buffer Buffer to receive the data, passed to the driver as it is
+ * @param bytes_to_read Number of bytes to read, must be a multiple of 512
+ * @param bytes_read Actual number of bytes read (can be NULL)
+ * @return PhatState
+ *   - PhatState_OK: Success
+ *   - PhatState_EndOfFile: Reached end of file
+ *   - PhatState_InvalidParameter: Invalid parameters or unaligned file pointer or length
+ *   - PhatState_ReadFail: Storage read error
+ *
+ * @note The data goes from the driver to `buffer` without being copied through the file's sector buffer,
+ * the read-ahead buffer or the sector cache, the buffer must meet the alignment the driver needs for DMA.
+ * Each physically contiguous run of clusters is read with one driver call.
+ * If the file ends inside of the last sector, the whole sector is still read into `buffer`.
+ */
+PHAT_FUNC PhatState Phat_ReadFileDirect(Phat_FileInfo_p file_info, void *buffer, size_t bytes_to_read, size_t *bytes_read);
+
 /**
  * @brief Write data to opened file
  *
@@ -508,6 +822,117 @@ PHAT_FUNC PhatState Phat_ReadFile(Phat_FileInfo_p file_info, void *buffer, size_
  */
 PHAT_FUNC PhatState Phat_WriteFile(Phat_FileInfo_p file_info, const void *buffer, size_t bytes_to_write, size_t *bytes_written);
 
+/**
+ * @brief Write data to an opened file at the given offset
+ *
+ * @param file_info Opened file context (must be writable)
+ * @param offset Offset in the file to write to
+ * @param buffer Data to write
+ * @param bytes_to_write Number of bytes to write
+ * @param bytes_written Actual number of bytes written (can be NULL)
+ * @return PhatState
+ *   - PhatState_OK: Success
+ *   - PhatState_InvalidParameter: Invalid parameters
+ *   - PhatState_ReadOnly: File or filesystem is read-only
+ *   - PhatState_WriteFail: Storage write error
+ *   - PhatState_NotEnoughSpace: Insufficient disk space
+ *
+ * @note The file pointer is not used or moved, see `Phat_ReadFileAt()`.
+ * File size is automatically extended if writing beyond current EOF, the gap is filled with zeros.
+ */
+PHAT_FUNC PhatState Phat_WriteFileAt(Phat_FileInfo_p file_info, FileSize_t offset, const void *buffer, size_t bytes_to_write, size_t *bytes_written);
+
+/**
+ * @brief Give an opened file a buffer to collect small writes in
+ *
+ * @param file_info Opened file context
+ * @param buffer Buffer to collect the written data in, NULL to stop collecting
+ * @param buffer_size Size of `buffer` in bytes, one cluster or more works best
+ * @return PhatState
+ *   - PhatState_OK: Success
+ *   - PhatState_InvalidParameter: file_info is NULL, or the buffer is smaller than a sector
+ *   - PhatState_WriteFail: Failed to write the data collected in the previous buffer
+ *
+ * @note Writes that continue the collected data are copied into `buffer` and go to the disk together
+ * when the buffer is full, or on `Phat_SeekFile()`, `Phat_ReadFile()` and `Phat_CloseFile()`.
+ * Writes that don't fit into the buffer, or start past the end of the file, are written directly.
+ * The clusters for collected data are allocated by the write that collects it, and the file size is updated immediately.
+ * The buffer must stay valid until the file is closed.
+ */
+PHAT_FUNC PhatState Phat_SetFileWriteBehind(Phat_FileInfo_p file_info, void *buffer, size_t buffer_size);
+
+/**
+ * @brief Drop the data collected in the write-behind buffer of an opened file without writing it
+ *
+ * @param file_info Opened file context
+ * @return PhatState
+ *   - PhatState_OK: Success
+ *   - PhatState_InvalidParameter: file_info is NULL
+ *
+ * @note For when the collected data can't be written, e.g. the driver keeps failing: `Phat_CloseFile()` flushes the
+ * buffer first and fails the same way, dropping the data lets the file be closed. The file size goes back to what it was
+ * before the data was collected, and the part of the file the data would have overwritten keeps its old content.
+ */
+PHAT_FUNC PhatState Phat_DiscardFileWriteBehind(Phat_FileInfo_p file_info);
+
+/**
+ * @brief Write whole sectors to an opened file directly from the caller's buffer
+ *
+ * @param file_info Opened file context (must be writable), the file pointer must be a multiple of 512
+ * @param buffer Data to write, passed to the driver as it is
+ * @param bytes_to_write Number of bytes to write, must be a multiple of 512
+ * @param bytes_written Actual number of bytes written (can be NULL)
+ * @return PhatState
+ *   - PhatState_OK: Success
+ *   - PhatState_InvalidParameter: Invalid parameters or unaligned file pointer or length
+ *   - PhatState_ReadOnly: File or filesystem is read-only
+ *   - PhatState_WriteFail: Storage write error
+ *   - PhatState_NotEnoughSpace: Insufficient disk space
+ *
+ * @note The clusters for the whole write are allocated first, then the data goes from `buffer` to the driver
+ * without being copied, one driver call for each physically contiguous run of clusters.
+ * The buffer must meet the alignment the driver needs for DMA.
+ */
+PHAT_FUNC PhatState Phat_WriteFileDirect(Phat_FileInfo_p file_info, const void *buffer, size_t bytes_to_write, size_t *bytes_written);
+
+/**
+ * @brief Reserve clusters for a file ahead of writing it
+ *
+ * @param file_info Opened file context (must be writable)
+ * @param bytes Number of bytes counted from the beginning of the file to reserve space for
+ * @param keep_size Keep the file size unchanged if non-zero, otherwise extend the file size to `bytes`
+ * @return PhatState
+ *   - PhatState_OK: Success
+ *   - PhatState_InvalidParameter: Invalid parameters
+ *   - PhatState_ReadOnly: File or filesystem is read-only
+ *   - PhatState_NotEnoughSpace: Insufficient disk space, nothing was reserved
+ *
+ * @note The new clusters are taken from as few contiguous runs as possible and are linked in one pass,
+ * so later writes inside the reserved space don't need to allocate clusters.
+ * The reserved clusters are not zeroed, reading past the old file size returns whatever was on the disk.
+ * With keep_size set, the clusters beyond the file size stay with the file while it's open, the writes that grow the file use
+ * them, and the ones still beyond the file size are freed when the last handle of the file is closed.
+ */
+PHAT_FUNC PhatState Phat_AllocateFileSpace(Phat_FileInfo_p file_info, FileSize_t bytes, PhatBool_t keep_size);
+
+/**
+ * @brief Set the size of a file, freeing the clusters beyond the new size
+ *
+ * @param file_info Opened file context (must be writable)
+ * @param new_size New file size in bytes
+ * @return PhatState
+ *   - PhatState_OK: Success
+ *   - PhatState_InvalidParameter: Invalid parameters
+ *   - PhatState_ReadOnly: File or filesystem is read-only
+ *   - PhatState_NotEnoughSpace: Insufficient disk space to grow the file
+ *
+ * @note Shrinking cuts the cluster chain after the last cluster still needed and frees the rest of it,
+ * including the clusters reserved by `Phat_AllocateFileSpace()` with keep_size set.
+ * Growing fills the new part of the file with zeros.
+ * The file pointer is not moved, it could be beyond the end of the file afterwards.
+ */
+PHAT_FUNC PhatState Phat_TruncateFile(Phat_FileInfo_p file_info, FileSize_t new_size);
+
 /**
  * @brief Close file and update directory entry
  *
@@ -518,10 +943,27 @@ PHAT_FUNC PhatState Phat_WriteFile(Phat_FileInfo_p file_info, const void *buffer
  *   - PhatState_WriteFail: Failed to update directory entry
  *
  * @note Updates file metadata (size, modification time) in directory.
+ * For a file opened with PHAT_OPEN_TRUNCATE, the clusters beyond the new file size are freed.
  * file_info becomes invalid after this call.
  */
 PHAT_FUNC PhatState Phat_CloseFile(Phat_FileInfo_p file_info);
 
+/**
+ * @brief Make the data and the directory entry of a file durable without flushing the whole cache
+ *
+ * @param file_info Opened file context
+ * @return PhatState
+ *   - PhatState_OK: Success
+ *   - PhatState_InvalidParameter: file_info is NULL
+ *   - PhatState_WriteFail: Failed to write to the disk
+ *
+ * @note The write-behind buffer is flushed, then the cached data and the FAT sectors of the part of the cluster chain
+ * that changed since the last sync are written back, then the directory entry is updated and written back.
+ * The dirty sectors of other files and directories stay in the cache.
+ * With deferred FAT mirroring, only the first FAT is written, the other FATs are still synchronized by `Phat_FlushCache()`.
+ */
+PHAT_FUNC PhatState Phat_SyncFile(Phat_FileInfo_p file_info);
+
 /**
  * @brief Set file pointer position
  *
@@ -552,6 +994,28 @@ PHAT_FUNC void Phat_GetFilePointer(Phat_FileInfo_p file_info, FileSize_t *positi
  */
 PHAT_FUNC void Phat_GetFileSize(Phat_FileInfo_p file_info, FileSize_t *size);
 
+/**
+ * @brief Get the physically contiguous runs that hold the data of a file
+ *
+ * @param file_info Opened file context
+ * @param extents Array to receive the runs, can be NULL if max_extents is 0
+ * @param max_extents Number of elements in `extents`
+ * @param num_extents Total number of runs of the file is stored here, could be more than max_extents
+ * @return PhatState
+ *   - PhatState_OK: Success
+ *   - PhatState_InvalidParameter: Invalid parameters
+ *   - PhatState_FATError: The cluster chain is shorter than the file size
+ *
+ * @note Each run gives the file offset it starts at, the LBA to pass to the driver and its length in sectors.
+ * The runs cover the file size rounded up to sectors, the clusters reserved beyond the file size are not reported.
+ * Only the first `max_extents` runs are stored, call with `max_extents` set to 0 to count the runs.
+ * The collected write-behind data and the modified data cache pages of the file are written to the disk first, so the
+ * runs can be read with the driver right away. The directory entry is not updated, call `Phat_SyncFile` for that.
+ * The file pointer is left untouched. Walking the chain doesn't move the cluster cursor of the file, but writing the
+ * collected write-behind data does, the same way `Phat_WriteFile()` would.
+ */
+PHAT_FUNC PhatState Phat_GetFileExtents(Phat_FileInfo_p file_info, Phat_FileExtent_p extents, size_t max_extents, size_t *num_extents);
+
 /**
  * @brief Check if file pointer is at end of file
  *
@@ -648,6 +1112,71 @@ PHAT_FUNC PhatState Phat_Rename(Phat_p phat, const WChar_p path, const WChar_p n
  */
 PHAT_FUNC PhatState Phat_Move(Phat_p phat, const WChar_p oldpath, const WChar_p newpath);
 
+/**
+ * @brief Copy a file
+ *
+ * @param phat Mounted Phat context (must be writable)
+ * @param src_path Path of the file to copy
+ * @param dst_path Path of the copy, created if it doesn't exist, overwritten if it does
+ * @return PhatState
+ *   - PhatState_OK: Success
+ *   - PhatState_InvalidParameter: Invalid parameters, or both paths are the same file
+ *   - PhatState_ReadOnly: Filesystem or the destination file is read-only
+ *   - PhatState_FileNotFound: Source doesn't exist
+ *   - PhatState_IsADirectory: Source or destination is a directory
+ *   - PhatState_NotEnoughSpace: Insufficient disk space, an existing destination keeps its data
+ *
+ * @note The clusters of the destination are reserved before copying, reusing the clusters it already has.
+ * The data goes through the staging buffer in `Phat_t`, one read and one write of up to `PHAT_COPY_BUFFER_SECTORS`
+ * sectors for each run that is physically contiguous in both files.
+ */
+PHAT_FUNC PhatState Phat_CopyFile(Phat_p phat, const WChar_p src_path, const WChar_p dst_path);
+
+/**
+ * @brief Append a file to the end of another file and delete it
+ *
+ * @param phat Mounted Phat context (must be writable)
+ * @param dst_path Path of the file to append to, created if it doesn't exist
+ * @param src_path Path of the file to append, deleted on success
+ * @return PhatState
+ *   - PhatState_OK: Success
+ *   - PhatState_InvalidParameter: Invalid parameters, or both paths are the same file
+ *   - PhatState_ReadOnly: Filesystem or one of the files is read-only
+ *   - PhatState_FileNotFound: Source doesn't exist
+ *   - PhatState_IsADirectory: Source or destination is a directory
+ *   - PhatState_NotEnoughSpace: Insufficient disk space for copying, or the merged file would be 4 GiB or larger
+ *   - PhatState_FileIsOpen: The source is open by another handle
+ *
+ * @note If the size of the destination is a multiple of the cluster size, the cluster chain of the source is linked
+ * to the end of the destination and no data is moved. Otherwise the whole source is copied to the end of the
+ * destination, not only its last partial cluster, and the clusters of the source are freed afterwards. The time this
+ * takes grows with the size of the source, and there must be room for a second copy of it until it is deleted.
+ * The source must not be open elsewhere, which is only checked when `PHAT_OPEN_FILES` is not 0.
+ */
+PHAT_FUNC PhatState Phat_ConcatFiles(Phat_p phat, const WChar_p dst_path, const WChar_p src_path);
+
+/**
+ * @brief Create or overwrite a file with the given data in one call
+ *
+ * @param phat Mounted Phat context (must be writable)
+ * @param path Path of the file, the directory that contains it must exist
+ * @param data The whole content of the file
+ * @param size Size of the data in bytes
+ * @return PhatState
+ *   - PhatState_OK: Success
+ *   - PhatState_InvalidParameter: Invalid parameters
+ *   - PhatState_ReadOnly: Filesystem or the file is read-only
+ *   - PhatState_DirectoryNotFound: The directory that contains the file doesn't exist
+ *   - PhatState_IsADirectory: The path is a directory
+ *   - PhatState_BadFileName: Invalid filename
+ *   - PhatState_NotEnoughSpace: Insufficient disk space
+ *
+ * @note The path is resolved once and the clusters are allocated in as few contiguous runs as possible, each run is
+ * written with one driver call. The directory entry is written once, with the final size and the first cluster, after
+ * the data. An existing file gets the new clusters first and its old clusters are freed afterwards.
+ */
+PHAT_FUNC PhatState Phat_WriteWholeFile(Phat_p phat, const WChar_p path, const void *data, FileSize_t size);
+
 /**
  * @brief Initialize disk with MBR partition table
  *
@@ -724,6 +1253,7 @@ PHAT_FUNC PhatState Phat_CreatePartition(Phat_p phat, LBA_t partition_start, LBA
  *   - PhatState_InvalidParameter: Invalid parameters
  *   - PhatState_CannotMakeFS: Partition too small for FAT
  *   - PhatState_PartitionTooSmall: Partition too small for selected FAT type
+ *   - PhatState_FATTypeNotSupported: The FAT type is disabled by `PHAT_SUPPORT_FAT12/16/32`
  */
 PHAT_FUNC PhatState Phat_MakeFS_And_Mount(Phat_p phat, int partition_index, int FAT_bits, uint16_t root_dir_entry_count, uint32_t volume_ID, const char *volume_lable, PhatBool_t flush);
 #endif